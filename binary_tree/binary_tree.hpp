@@ -4,8 +4,36 @@
 #include <iostream>
 #include <queue>
 #include <vector>
+#include <string>
 #include <algorithm>
 #include <exception>
+#include <stdexcept>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <memory>
+#include <type_traits>
+
+#include "epoch.hpp"
+#include "memory_resource.hpp"
+#include "text_writer.hpp"
+
+// Coroutine lookups (SearchMany) are opt-in, they need C++20
+#ifdef BT_ENABLE_COROUTINES
+#if !defined(__cpp_impl_coroutine)
+#error "BT_ENABLE_COROUTINES needs a C++20 compiler with coroutine support"
+#endif
+#include <coroutine>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BT_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BT_PREFETCH(addr) ((void)(addr))
+#endif
 
 namespace binary_tree {
 
@@ -96,10 +124,15 @@ void RightRotate(TreeNode* node, TreeNode** root) {
     node->parent_ = f_node;
 }
 
+// Hot/cold layout. A descent reads the child links and the leading bytes
+// of the key, so those come first and share the node's first cache line
+// however large T is. parent_ and the balance metadata node types declare
+// after these are only read while rebalancing. For values much larger than
+// a cache line, see KeyPayload.
 #define CREATE_BASE_TREETYPE_MEMBERS(TYPE) \
-    T data_; \
     TYPE *left_; \
     TYPE *right_; \
+    T data_; \
     TYPE *parent_; \
 
 #define CREATE_OPERATORS_FOR_TYPE(TYPE) \
@@ -114,8 +147,11 @@ void RightRotate(TreeNode* node, TreeNode** root) {
     inline bool operator>=(const T& rhs) const { return this->data_ >= rhs; } \
     inline bool operator==(const T& rhs) const { return this->data_ == rhs; } \
     \
+    inline std::string ToString() const { return FormatToString(*this); } \
+    \
     friend std::ostream& operator<<(std::ostream& os, const TYPE& node) { \
-        os << node.ToString(); \
+        TextWriter out(os); \
+        node.Format(out); \
         return os; \
     }
 
@@ -127,938 +163,4269 @@ struct TreeNodeBase {
                right_(nullptr),
                parent_(nullptr) {}
 
-    TreeNodeBase(T data): data_(data),
-                     left_(nullptr),
+    TreeNodeBase(T data): left_(nullptr),
                      right_(nullptr),
+                     data_(std::move(data)),
                      parent_(nullptr) {}
 
-    inline std::string ToString() const {
-        return std::to_string(data_);
+    inline void Format(TextWriter& out) const {
+        FormatValue(out, data_);
     }
 
     CREATE_OPERATORS_FOR_TYPE(TreeNodeBase);
 };
 
-template<typename T, typename TreeNode = TreeNodeBase<T>>
-class BinaryTreeBase {
- public:
-    using TreeNodeType = TreeNode;
-
-    BinaryTreeBase():root_(nullptr) {}
-
-    BinaryTreeBase(const BinaryTreeBase&) = delete;
-    BinaryTreeBase& operator=(const BinaryTreeBase&) = delete;
+// ------------ Key Payload -------------
 
-    virtual ~BinaryTreeBase() {
-        Destroy(root_);
+// Value type for payloads much larger than a cache line: the key is stored
+// in the node next to the links, the payload out of line where only the
+// caller reads it, so a descent stays on small nodes. Ordered by key alone.
+// A bare key converts to a KeyPayload without payload for lookups, e.g.
+// RBTree<KeyPayload<int, Row>>::Search(42).
+template<typename Key, typename Payload>
+class KeyPayload {
+ public:
+    KeyPayload(): key_(), payload_(nullptr) {}
+    KeyPayload(const Key& key): key_(key), payload_(nullptr) {}
+    KeyPayload(const Key& key, const Payload& payload): key_(key), payload_(new Payload(payload)) {}
+    KeyPayload(const KeyPayload& other):
+        key_(other.key_), payload_(other.payload_ ? new Payload(*other.payload_) : nullptr) {}
+    KeyPayload(KeyPayload&& other): key_(std::move(other.key_)), payload_(other.payload_) {
+        other.payload_ = nullptr;
     }
+    KeyPayload& operator=(KeyPayload other) {
+        std::swap(key_, other.key_);
+        std::swap(payload_, other.payload_);
+        return *this;
+    }
+    ~KeyPayload() { delete payload_; }
+
+    const Key& GetKey() const { return key_; }
+    bool HasPayload() const { return payload_ != nullptr; }
+    const Payload& GetPayload() const { return *payload_; }
+    Payload& GetPayload() { return *payload_; }
+
+    bool operator<(const KeyPayload& rhs) const { return key_ < rhs.key_; }
+    bool operator>(const KeyPayload& rhs) const { return rhs.key_ < key_; }
+    bool operator<=(const KeyPayload& rhs) const { return !(rhs.key_ < key_); }
+    bool operator>=(const KeyPayload& rhs) const { return !(key_ < rhs.key_); }
+    bool operator==(const KeyPayload& rhs) const { return !(key_ < rhs.key_) && !(rhs.key_ < key_); }
+
+ private:
+    Key key_;
+    Payload *payload_;
+};
 
-    TreeNode* Insert(const T& data);
-    TreeNode* Search(const T& target) const;
-    bool Delete(const T& target);
-
-    void Clear();
-    int GetHeight() const;
-
-    template<typename U, typename TreeNodeT>
-    friend std::ostream& operator<<(std::ostream& os, const BinaryTreeBase<U, TreeNodeT>& bst);
-
- protected:
-    TreeNode *root_;
-
-    void Destroy(TreeNode* node);
-    void InorderPrint(std::ostream& os, TreeNode* node) const;
-    void TreePrint(std::ostream& os, TreeNode* node) const;
-    void TreePrintInternal(std::ostream& os, TreeNode* node, const std::string& prefix, bool is_left) const;
-
-    int GetHeightInternal(TreeNode* node) const;
-
-    virtual bool InsertRecursively(TreeNode*& parent, TreeNode* node) = 0;
-    virtual TreeNode* SearchRecursively(TreeNode* node, const T& target) const = 0;
-    virtual bool DeleteRecursively(TreeNode* node, const T& target) = 0;
-}; // class BinaryTreeBase
+template<typename Key, typename Payload>
+void FormatValue(TextWriter& out, const KeyPayload<Key, Payload>& value) {
+    FormatValue(out, value.GetKey());
+}
 
-template<typename T, typename TreeNode>
-TreeNode* BinaryTreeBase<T, TreeNode>::Insert(const T& data) {
-    TreeNode *node_to_insert = new TreeNode(data);
-    if (InsertRecursively(root_, node_to_insert))
-        return node_to_insert;
+// ------------ Memory Accounting -------------
 
-    delete node_to_insert;
-    return nullptr;
+// Bytes the heap hands out for a request of size bytes: 16-byte granules
+// with an 8-byte chunk header, at least 32. That is glibc malloc, and close
+// to the small size classes of jemalloc and tcmalloc.
+inline size_t HeapAllocationSize(size_t size) {
+    size_t chunk = (size + sizeof(size_t) + 15) & ~static_cast<size_t>(15);
+    return std::max(chunk, static_cast<size_t>(32));
 }
 
-template<typename T, typename TreeNode>
-TreeNode* BinaryTreeBase<T, TreeNode>::Search(const T& target) const {
-    return SearchRecursively(root_, target);
-}
+// Heap memory a value owns beyond its own sizeof. Customization point found
+// by ADL, like FormatValue: a type owning heap memory declares an overload
+// next to it. Types without one are taken to own nothing.
+template<typename T>
+size_t HeapBytes(const T&) { return 0; }
 
-template<typename T, typename TreeNode>
-bool BinaryTreeBase<T, TreeNode>::Delete(const T& target) {
-    return DeleteRecursively(root_, target);
+inline size_t HeapBytes(const std::string& value) {
+    // Short strings live inside the object
+    const char *object = reinterpret_cast<const char*>(&value);
+    if (value.data() >= object && value.data() < object + sizeof(value)) return 0;
+    return HeapAllocationSize(value.capacity() + 1);
 }
 
-template<typename T, typename TreeNode>
-int BinaryTreeBase<T, TreeNode>::GetHeight() const {
-    return GetHeightInternal(root_);
+template<typename U, typename Alloc>
+size_t HeapBytes(const std::vector<U, Alloc>& value) {
+    size_t bytes = (value.capacity() ? HeapAllocationSize(value.capacity() * sizeof(U)) : 0);
+    for (const auto& item : value) {
+        bytes += HeapBytes(item);
+    }
+    return bytes;
 }
 
-template<typename T, typename TreeNode>
-void BinaryTreeBase<T, TreeNode>::Clear() {
-    Destroy(root_);
-    root_ = nullptr;
+template<typename Key, typename Payload>
+size_t HeapBytes(const KeyPayload<Key, Payload>& value) {
+    size_t bytes = HeapBytes(value.GetKey());
+    if (value.HasPayload()) {
+        bytes += HeapAllocationSize(sizeof(Payload)) + HeapBytes(value.GetPayload());
+    }
+    return bytes;
 }
 
-template<typename T, typename TreeNode>
-int BinaryTreeBase<T, TreeNode>::GetHeightInternal(TreeNode* node) const {
-    if (!node) {
-        return 0;
+// What a tree holds on the heap, from MemoryUsage()
+struct TreeMemoryUsage {
+    size_t nodes;               // Nodes held, tombstones included
+    size_t node_size;           // sizeof one node
+    size_t node_bytes;          // nodes * node_size
+    size_t allocator_slack;     // Heap rounding and chunk headers on the node allocations
+    size_t payload_bytes;       // Heap memory owned by the keys, see HeapBytes
+    size_t block_bytes;         // Clone() blocks still held, one allocation each
+    size_t block_free_bytes;    // Slots of those blocks whose node is gone, held until the block is
+
+    TreeMemoryUsage(): nodes(0), node_size(0), node_bytes(0), allocator_slack(0),
+                       payload_bytes(0), block_bytes(0), block_free_bytes(0) {}
+
+    size_t Total() const { return node_bytes + allocator_slack + payload_bytes + block_free_bytes; }
+    // Share of the footprint holding neither nodes nor keys
+    double Fragmentation() const {
+        size_t total = Total();
+        return total ? static_cast<double>(allocator_slack + block_free_bytes) / total : 0.0;
     }
 
-    int left_height = GetHeightInternal(node->left_);
-    int right_height = GetHeightInternal(node->right_);
-
-    return std::max(left_height, right_height) + 1;
-}
-
-template<typename T, typename TreeNode>
-std::ostream& operator<<(std::ostream& os, const BinaryTreeBase<T, TreeNode>& bst) {
-    os << "[ ";
-    bst.InorderPrint(os, bst.root_);
-    os << "]\n";
-    bst.TreePrint(os, bst.root_);
-    return os;
-}
+    void Add(const TreeMemoryUsage& other) {
+        nodes += other.nodes;
+        node_size = std::max(node_size, other.node_size);
+        node_bytes += other.node_bytes;
+        allocator_slack += other.allocator_slack;
+        payload_bytes += other.payload_bytes;
+        block_bytes += other.block_bytes;
+        block_free_bytes += other.block_free_bytes;
+    }
+};
 
-template<typename T, typename TreeNode>
-void BinaryTreeBase<T, TreeNode>::Destroy(TreeNode* node) {
-    if (!node) return;
+enum class DumpFormat {
+    Text = 0,   // The box-drawing layout used by operator<<
+    Dot,        // Graphviz digraph
+    Json,       // Flat node list: {"nodes":[{"id","parent","side","value"}, ...]}
+};
 
-    if (node->left_) Destroy(node->left_);
-    if (node->right_) Destroy(node->right_);
-    delete node;
-}
+struct DumpOptions {
+    DumpFormat format;
+    int max_depth;      // Nodes deeper than this are elided, negative means no limit
+    size_t max_nodes;   // Stop after emitting this many nodes, 0 means no limit
 
-template<typename T, typename TreeNode>
-void BinaryTreeBase<T, TreeNode>::InorderPrint(std::ostream& os, TreeNode* node) const {
-    if (!node) return;
-    if (node->left_) InorderPrint(os, node->left_);
-    os << *node << " ";
-    if (node->right_) InorderPrint(os, node->right_);
-}
+    DumpOptions(): format(DumpFormat::Text), max_depth(-1), max_nodes(0) {}
+    explicit DumpOptions(DumpFormat f, int depth = -1, size_t nodes = 0):
+        format(f), max_depth(depth), max_nodes(nodes) {}
+};
 
+// Counters collected by TreeStats. Take a snapshot before and after an
+// operation and use Delta() to see what that operation cost.
+struct TreeStatsSnapshot {
+    static constexpr int kDepthBuckets = 64;
+
+    uint64_t comparisons;   // Key comparisons while descending
+    uint64_t rotations;     // LeftRotate / RightRotate calls
+    uint64_t fixup_steps;   // Rebalancing loop iterations, splay steps, subtree rebuilds
+    uint64_t allocations;   // Nodes allocated
+    uint64_t deallocations; // Nodes freed
+    uint64_t searches;      // Search calls
+    uint64_t hops;          // Links followed by InsertHint and finger searches to place a key
+    // Search depth in nodes visited, the last bucket collects everything deeper
+    uint64_t depth_histogram[kDepthBuckets];
+
+    TreeStatsSnapshot(): comparisons(0), rotations(0), fixup_steps(0),
+                         allocations(0), deallocations(0), searches(0), hops(0),
+                         depth_histogram() {}
+
+    TreeStatsSnapshot Delta(const TreeStatsSnapshot& earlier) const {
+        TreeStatsSnapshot delta;
+        delta.comparisons = comparisons - earlier.comparisons;
+        delta.rotations = rotations - earlier.rotations;
+        delta.fixup_steps = fixup_steps - earlier.fixup_steps;
+        delta.allocations = allocations - earlier.allocations;
+        delta.deallocations = deallocations - earlier.deallocations;
+        delta.searches = searches - earlier.searches;
+        delta.hops = hops - earlier.hops;
+        for (int i = 0; i < kDepthBuckets; ++i) {
+            delta.depth_histogram[i] = depth_histogram[i] - earlier.depth_histogram[i];
+        }
+        return delta;
+    }
+};
 
-template<typename T, typename TreeNode>
-void BinaryTreeBase<T, TreeNode>::TreePrintInternal(std::ostream& os, TreeNode* node,
-                                                    const std::string& prefix, bool is_left) const {
-    os << prefix << (is_left ?  "├──" : "└──" );
+// Holds a stats policy's kEnabled. C++11 needs an out-of-class definition
+// once the constant is bound to a reference, and only a template's can sit
+// in a header included by several translation units.
+template<bool Enabled>
+struct StatsEnabled {
+    static constexpr bool kEnabled = Enabled;
+};
 
-    if (node) {
-        os << *node << std::endl;
+template<bool Enabled>
+constexpr bool StatsEnabled<Enabled>::kEnabled;
 
-        TreePrintInternal(os, node->left_,  prefix + (is_left ? "│   " : "    "), true);
-        TreePrintInternal(os, node->right_, prefix + (is_left ? "│   " : "    "), false);
-    } else {
-        os << "nil" << std::endl;
-    }
-}
+// Default stats policy of every tree, all hooks compile away
+struct NoTreeStats : StatsEnabled<false> {
 
-template<typename T, typename TreeNode>
-void BinaryTreeBase<T, TreeNode>::TreePrint(std::ostream& os, TreeNode* node) const {
-    TreePrintInternal(os, node, "", false);
-}
+    inline void OnCompare() const {}
+    inline void OnRotate() const {}
+    inline void OnFixUp() const {}
+    inline void OnAllocate() const {}
+    inline void OnDeallocate() const {}
+    inline void OnSearch(int) const {}
+    inline void OnHop() const {}
 
-// ------------ Binary Search Tree -------------
+    inline TreeStatsSnapshot Snapshot() const { return TreeStatsSnapshot(); }
+    inline void Reset() {}
+};
 
-template<typename T>
-class BinarySearchTree final : public BinaryTreeBase<T> {
+// Counting stats policy, e.g. RBTree<int, TreeStats>. Not thread safe.
+class TreeStats : public StatsEnabled<true> {
  public:
-    BinarySearchTree() {}
-    ~BinarySearchTree() {}
+    inline void OnCompare() const { ++counters_.comparisons; }
+    inline void OnRotate() const { ++counters_.rotations; }
+    inline void OnFixUp() const { ++counters_.fixup_steps; }
+    inline void OnAllocate() const { ++counters_.allocations; }
+    inline void OnDeallocate() const { ++counters_.deallocations; }
+    inline void OnSearch(int depth) const {
+        ++counters_.searches;
+        ++counters_.depth_histogram[std::min(depth, TreeStatsSnapshot::kDepthBuckets - 1)];
+    }
+    inline void OnHop() const { ++counters_.hops; }
 
- protected:
-    using TreeNode = typename BinaryTreeBase<T>::TreeNodeType;
-    using BaseTreeType = BinaryTreeBase<T>;
+    inline TreeStatsSnapshot Snapshot() const { return counters_; }
+    inline void Reset() { counters_ = TreeStatsSnapshot(); }
 
-    bool InsertRecursively(TreeNode*& parent, TreeNode* node) override;
-    TreeNode* SearchRecursively(TreeNode* node, const T& target) const override;
-    bool DeleteRecursively(TreeNode* node, const T& target) override;
+ private:
+    // Searches are const, counting them must not be
+    mutable TreeStatsSnapshot counters_;
+};
 
+// Key policies. With MultiKeys equal keys are all kept, in insertion order.
+struct UniqueKeys {
+    static constexpr bool kAllowDuplicates = false;
 };
 
-template<typename T>
-bool BinarySearchTree<T>::InsertRecursively(TreeNode*& parent, TreeNode* node) {
-    if (!parent) {
-        parent = node;
-        return true;
-    }
+struct MultiKeys {
+    static constexpr bool kAllowDuplicates = true;
+};
 
-    if (*node < *parent) {
-        if (parent->left_) {
-            return InsertRecursively(parent->left_, node);
-        }
+// ------------ Augmentation -------------
 
-        node->parent_ = parent;
-        parent->left_ = node;
-        return true;
-    } else if (*node > *parent) {
-        if (parent->right_) {
-            return InsertRecursively(parent->right_, node);
-        }
+// An augmentation keeps a subtree aggregate in every node. A policy has a
+// Value type and a Compute(node) that combines the node's own data with the
+// values already stored in its children. The trees recompute it after
+// rotations and along the changed path on insert and delete.
+struct NoAugment {
+    static constexpr bool kEnabled = false;
+};
 
-        node->parent_ = parent;
-        parent->right_ = node;
-        return true;
-    }
-    return false;
-}
+// Holds augment_ only when the policy is enabled, so plain nodes stay the same size
+template<typename Augment, bool = Augment::kEnabled>
+struct AugmentStorage {
+    typename Augment::Value augment_;
+};
 
-template<typename T>
-typename BinarySearchTree<T>::TreeNode*
-BinarySearchTree<T>::SearchRecursively(TreeNode* node, const T& target) const {
-    if (!node) return nullptr;
-    if (*node == target) return node;
-    else if (*node > target) {
-        return SearchRecursively(node->left_, target);
-    } else {
-        return SearchRecursively(node->right_, target);
+template<typename Augment>
+struct AugmentStorage<Augment, false> {};
+
+// Augmentation with a monoid: Value, Identity(), Lift(data) and an
+// associative Combine(a, b). Enables Aggregate(lo, hi) on the tree.
+template<typename Monoid>
+struct MonoidAugment {
+    static constexpr bool kEnabled = true;
+    using Value = typename Monoid::Value;
+
+    static Value Identity() { return Monoid::Identity(); }
+    template<typename Data>
+    static Value Lift(const Data& data) { return Monoid::Lift(data); }
+    static Value Combine(const Value& a, const Value& b) { return Monoid::Combine(a, b); }
+
+    // In key order: left subtree, node, right subtree
+    template<typename Node>
+    static Value Compute(const Node* node) {
+        Value value = Monoid::Lift(node->data_);
+        if (node->left_) value = Monoid::Combine(node->left_->augment_, value);
+        if (node->right_) value = Monoid::Combine(value, node->right_->augment_);
+        return value;
     }
-
-    return nullptr;
-}
+};
 
 template<typename T>
-bool BinarySearchTree<T>::DeleteRecursively(TreeNode* node, const T& target) {
-    if (!node) return false;
-
-    if (*node > target) {
-        return DeleteRecursively(node->left_, target);
-    } else if (*node < target) {
-        return DeleteRecursively(node->right_, target);
-    } else {
-        TreeNode *parent = node->parent_;
-        bool is_root = (parent == nullptr);
-        bool is_left_child = (!is_root && (parent->left_ == node));
+struct SumMonoid {
+    using Value = T;
+    static Value Identity() { return T(); }
+    static Value Lift(const T& data) { return data; }
+    static Value Combine(const Value& a, const Value& b) { return a + b; }
+};
 
-        if (!node->left_ && !node->right_) {
-            delete node;
-            if (is_root) BaseTreeType::root_ = nullptr;
-            else {
-                if (is_left_child) parent->left_ = nullptr;
-                else parent->right_ = nullptr;
-            }
+template<typename T>
+struct MinMonoid {
+    using Value = T;
+    static Value Identity() { return std::numeric_limits<T>::max(); }
+    static Value Lift(const T& data) { return data; }
+    static Value Combine(const Value& a, const Value& b) { return b < a ? b : a; }
+};
 
-        } else if (!node->right_) {
-            TreeNode *l_node = node->left_;
-            if (is_root) {
-                BaseTreeType::root_ = l_node;
-            } else {
-                if (is_left_child) parent->left_ = l_node;
-                else parent->right_ = l_node;
-            }
-            l_node->parent_ = parent;
-            delete node;
+template<typename T>
+struct MaxMonoid {
+    using Value = T;
+    static Value Identity() { return std::numeric_limits<T>::lowest(); }
+    static Value Lift(const T& data) { return data; }
+    static Value Combine(const Value& a, const Value& b) { return a < b ? b : a; }
+};
 
-        } else if (!node->left_) {
-            TreeNode *r_node = node->right_;
-            if (is_root) {
-                BaseTreeType::root_ = r_node;
-            } else {
-                if (is_left_child) parent->left_ = r_node;
-                else parent->right_ = r_node;
-            }
-            r_node->parent_ = parent;
-            delete node;
+template<typename TreeNode, typename Augment, bool = Augment::kEnabled>
+struct AugmentUpdater {
+    static constexpr bool kEnabled = true;
+    using Policy = Augment;
+    static void Update(TreeNode* node) { node->augment_ = Augment::Compute(node); }
+    static bool Check(const TreeNode* node) { return node->augment_ == Augment::Compute(node); }
+};
 
-        } else {
-            TreeNode *ino_prev = node->left_;
-            while (ino_prev->right_) {
-                ino_prev = ino_prev->right_;
-            }
-            node->data_ = ino_prev->data_;
+template<typename TreeNode, typename Augment>
+struct AugmentUpdater<TreeNode, Augment, false> {
+    static constexpr bool kEnabled = false;
+    using Policy = Augment;
+    static void Update(TreeNode*) {}
+    static bool Check(const TreeNode*) { return true; }
+};
 
-            return DeleteRecursively(ino_prev, ino_prev->data_);
-        }
+// Augmentation of a node type, specialized next to the node types that take a policy
+template<typename TreeNode>
+struct NodeAugment : AugmentUpdater<TreeNode, NoAugment> {};
 
-        return true;
-    }
-}
+// ------------ Tombstones -------------
 
-// ------------ Red Black Tree -------------
+// A tree in lazy delete mode leaves deleted nodes linked and flags them.
+// Lookups and traversals ask here and step over flagged nodes.
+template<typename TreeNode>
+struct NodeTombstone {
+    static bool IsDead(const TreeNode*) { return false; }
+};
 
-template<typename T>
-struct RBTreeNode {
-    enum class Color {
-        Red = 0,
-        Black,
-    };
+// ------------ Subtree Sizes -------------
 
-    Color color_;
+// Nodes of trees with MultiKeys count the live nodes of their subtree in
+// size_, so Count(key) is two rank descents instead of a walk over the run
+template<bool Counted>
+struct SizeStorage {
+    size_t size_;
 
-    CREATE_BASE_TREETYPE_MEMBERS(RBTreeNode);
+    SizeStorage(): size_(1) {}
+};
 
-    RBTreeNode(): color_(Color::Red), data_(),
-                  left_(nullptr), right_(nullptr),
-                  parent_(nullptr) {}
-    RBTreeNode(T data): color_(Color::Red), data_(data),
-                        left_(nullptr), right_(nullptr),
-                        parent_(nullptr) {}
-    RBTreeNode(T data, Color color): color_(color), data_(data),
-                        left_(nullptr), right_(nullptr),
-                        parent_(nullptr) {}
+template<>
+struct SizeStorage<false> {};
 
-    inline bool IsRed() const { return color_ == Color::Red; }
-    inline void SetRed() { color_ = Color::Red; }
-    inline void SetBlack() { color_ = Color::Black; }
-    inline std::string ToString() const {
-        return std::to_string(data_) + " " + (color_ == Color::Red ? "R" : "B");
+template<typename TreeNode, bool = std::is_base_of<SizeStorage<true>, TreeNode>::value>
+struct NodeSize {
+    static constexpr bool kEnabled = true;
+    static size_t Get(const TreeNode* node) { return node ? node->size_ : 0; }
+    static size_t Compute(const TreeNode* node) {
+        return (NodeTombstone<TreeNode>::IsDead(node) ? 0 : 1) + Get(node->left_) + Get(node->right_);
     }
+};
 
-    CREATE_OPERATORS_FOR_TYPE(RBTreeNode);
+template<typename TreeNode>
+struct NodeSize<TreeNode, false> {
+    static constexpr bool kEnabled = false;
+    static size_t Get(const TreeNode*) { return 0; }
 };
 
-template<typename T>
-class RBTree final : public BinaryTreeBase<T, RBTreeNode<T>> {
- public:
-    RBTree() {}
-    ~RBTree() {}
+// Keeps size_ of counted nodes next to the augmentation, along the paths
+// the trees already update for it
+template<typename TreeNode, typename Augment, bool = NodeSize<TreeNode>::kEnabled>
+struct CountingUpdater : AugmentUpdater<TreeNode, Augment> {};
+
+template<typename TreeNode, typename Augment>
+struct CountingUpdater<TreeNode, Augment, true> {
+    static constexpr bool kEnabled = true;
+    using Policy = Augment;
+    static void Update(TreeNode* node) {
+        AugmentUpdater<TreeNode, Augment>::Update(node);
+        node->size_ = NodeSize<TreeNode>::Compute(node);
+    }
+    static bool Check(const TreeNode* node) {
+        return AugmentUpdater<TreeNode, Augment>::Check(node) && node->size_ == NodeSize<TreeNode>::Compute(node);
+    }
+};
 
-    bool IsTreeValid() const;
+// ------------ Validation -------------
+
+enum class ValidationErrorKind {
+    Order = 0,      // Key not within the bounds set by its ancestors
+    ParentLink,     // A child whose parent_ does not point back
+    RootColor,      // Red root
+    RedRed,         // Red node with a red child
+    BlackHeight,    // Paths with different numbers of black nodes
+    StoredHeight,   // Stored height disagrees with the children
+    Balance,        // Balance factor out of [-1, 1]
+    HeapOrder,      // Child priority above its parent's
+    Size,           // Node count disagrees with the size kept by the tree
+    Augment,        // Stored subtree aggregate disagrees with the children
+    Level,          // AA level out of line with the children
+};
 
- protected:
-    using TreeNode = RBTreeNode<T>;
-    using BaseTreeType = BinaryTreeBase<T, RBTreeNode<T>>;
+inline const char* ValidationErrorName(ValidationErrorKind kind) {
+    switch (kind) {
+        case ValidationErrorKind::Order: return "order";
+        case ValidationErrorKind::ParentLink: return "parent link";
+        case ValidationErrorKind::RootColor: return "root color";
+        case ValidationErrorKind::RedRed: return "red node with red child";
+        case ValidationErrorKind::BlackHeight: return "black height";
+        case ValidationErrorKind::StoredHeight: return "stored height";
+        case ValidationErrorKind::Balance: return "balance factor";
+        case ValidationErrorKind::HeapOrder: return "heap order";
+        case ValidationErrorKind::Size: return "size";
+        case ValidationErrorKind::Augment: return "subtree aggregate";
+        case ValidationErrorKind::Level: return "level";
+    }
+    return "unknown";
+}
 
-    bool InsertRecursively(TreeNode*& parent, TreeNode* node) override;
-    TreeNode* SearchRecursively(TreeNode* node, const T& target) const override;
-    bool DeleteRecursively(TreeNode* node, const T& target) override;
+struct ValidationError {
+    ValidationErrorKind kind;
+    const void* node;   // Offending node, only meaningful while the tree is unchanged
+};
 
-    void InsertFixUp(TreeNode* node);
-    void DeleteFixUp(TreeNode* node, TreeNode* parent);
+struct ValidationReport {
+    std::vector<ValidationError> errors;
+    size_t nodes_checked;
+    bool truncated;     // Stopped early after ValidateOptions::max_errors errors
 
-    int CheckRedAndBlackNodeFeatureInternal(TreeNode* node, bool& is_red_valid, bool& is_black_valid) const;
+    ValidationReport(): nodes_checked(0), truncated(false) {}
 
-};
+    bool Ok() const { return errors.empty(); }
 
-template<typename T>
-bool RBTree<T>::IsTreeValid() const {
-    // Check RBTree attributes
-    // 1. Each node is either black or red(Always)
-    // 2. Root is black
-    if (BaseTreeType::root_ && BaseTreeType::root_->IsRed()) {
-        std::cout << "Root is red\n";
-        return false;
+    void Add(ValidationErrorKind kind, const void* node) {
+        errors.push_back(ValidationError{kind, node});
     }
 
-    // 3. Leaves are black(Always: null is black)
-    // 4. If a node is red, its child must be black
-    // 5. Each path containing the same number of black nodes
-    bool is_red_valid = true;
-    bool is_black_valid = true;
-    CheckRedAndBlackNodeFeatureInternal(BaseTreeType::root_, is_red_valid, is_black_valid);
-    if (!is_red_valid) {
-        std::cout << "Red has red child\n";
-        return false;
-    }
-    if (!is_black_valid) {
-        std::cout << "Black node has diffrent number in different paths\n";
-        return false;
+    void Merge(const ValidationReport& other) {
+        errors.insert(errors.end(), other.errors.begin(), other.errors.end());
+        nodes_checked += other.nodes_checked;
+        truncated = truncated || other.truncated;
     }
+};
 
-    return true;
-}
+struct ValidateOptions {
+    size_t threads;     // Check disjoint subtrees on this many threads, 0 or 1 is sequential
+    size_t max_errors;  // Stop after collecting this many errors
 
-template<typename T>
-int RBTree<T>::CheckRedAndBlackNodeFeatureInternal(TreeNode* node, bool& is_red_valid, bool& is_black_valid) const {
-    if (!is_red_valid || !is_black_valid) {
-        return -1;
-    }
+    ValidateOptions(): threads(1), max_errors(16) {}
+    explicit ValidateOptions(size_t n_threads, size_t errors = 16):
+        threads(n_threads), max_errors(errors) {}
+};
 
-    if (!node) {
-        return 1;
-    }
+// Invariants of one node type beyond key order and parent links.
+// Specialized next to the node types that carry balance metadata.
+template<typename TreeNode>
+struct NodeInvariants {
+    // How much the node adds to the black height of the paths through it
+    static int BlackWeight(const TreeNode*) { return 0; }
+    static void CheckRoot(const TreeNode*, ValidationReport*) {}
+    // Checks the node against its direct children
+    static void Check(const TreeNode*, ValidationReport*) {}
+};
 
-    if (node->IsRed() &&
-        ((node->left_ && node->left_->IsRed()) ||
-         (node->right_ && node->right_->IsRed()))) {
-        is_red_valid = false;
-        return -1;
-    }
+// Explicit-stack walk over a subtree. Work can be done in chunks with
+// Step(), and the pending frames can be handed to other walkers.
+template<typename TreeNode>
+class SubtreeValidator {
+ public:
+    struct Frame {
+        TreeNode* node;
+        TreeNode* lo;       // Bounds from the ancestors, null when unbounded
+        TreeNode* hi;
+        int black_depth;    // Black nodes above node
+    };
 
-    int left_black_count = CheckRedAndBlackNodeFeatureInternal(node->left_, is_red_valid, is_black_valid);
+    // Bounds are exclusive unless allow_equal is set (trees with MultiKeys)
+    explicit SubtreeValidator(size_t max_errors, bool allow_equal = false):
+        max_errors_(max_errors), allow_equal_(allow_equal), leaf_black_height_(-1) {}
 
-    if (!is_red_valid || !is_black_valid) {
-        return -1;
+    // Checks the edge parent -> node and queues node
+    void Push(TreeNode* node, TreeNode* parent, TreeNode* lo, TreeNode* hi, int black_depth) {
+        if (!node) {
+            AddLeaf(black_depth, parent);
+            return;
+        }
+        if (node->parent_ != parent) {
+            report_.Add(ValidationErrorKind::ParentLink, node);
+        }
+        stack_.push_back(Frame{node, lo, hi, black_depth});
     }
 
-    int right_black_count = CheckRedAndBlackNodeFeatureInternal(node->right_, is_red_valid, is_black_valid);
+    void Adopt(const Frame& frame) { stack_.push_back(frame); }
 
-    if (!is_red_valid || !is_black_valid) {
-        return -1;
+    // Checks up to budget nodes, returns true when nothing is pending
+    bool Step(size_t budget) {
+        for (size_t i = 0; i < budget && !stack_.empty(); ++i) {
+            Frame frame = stack_.back();
+            stack_.pop_back();
+            Visit(frame);
+        }
+        return stack_.empty();
     }
 
-    if (left_black_count != right_black_count) {
-        is_black_valid = false;
-        return -1;
+    // Checks nodes level by level until at least n frames are pending
+    void StepBreadthFirst(size_t n) {
+        size_t head = 0;
+        while (head < stack_.size() && stack_.size() - head < n) {
+            // Visit pushes onto stack_, do not hold a reference into it
+            Frame frame = stack_[head++];
+            Visit(frame);
+            if (stack_.empty()) return;
+        }
+        stack_.erase(stack_.begin(), stack_.begin() + head);
     }
 
-    return left_black_count + (!node->IsRed());
-}
-
-template<typename T>
-bool RBTree<T>::InsertRecursively(TreeNode*& parent, TreeNode* node) {
-    if (!parent) {
-        parent = node;
-        node->SetRed();
-        InsertFixUp(node);
-        return true;
+    std::vector<Frame> TakePending() {
+        std::vector<Frame> pending;
+        pending.swap(stack_);
+        return pending;
     }
 
-    if (*node < *parent) {
-        if (parent->left_) {
-            return InsertRecursively(parent->left_, node);
+    bool Done() const { return stack_.empty(); }
+    int LeafBlackHeight() const { return leaf_black_height_; }
+    ValidationReport& Report() { return report_; }
+    const ValidationReport& Report() const { return report_; }
+
+ private:
+    std::vector<Frame> stack_;
+    ValidationReport report_;
+    size_t max_errors_;
+    bool allow_equal_;
+    int leaf_black_height_;   // Black height seen at the first nil leaf, -1 before that
+
+    void Visit(const Frame& frame) {
+        if (report_.errors.size() >= max_errors_) {
+            report_.truncated = true;
+            stack_.clear();
+            return;
         }
 
-        node->parent_ = parent;
-        parent->left_ = node;
-        node->SetRed();
-        InsertFixUp(node);
-        return true;
-    } else if (*node > *parent) {
-        if (parent->right_) {
-            return InsertRecursively(parent->right_, node);
+        TreeNode* node = frame.node;
+        ++report_.nodes_checked;
+        bool below_lo = frame.lo && (allow_equal_ ? *node < *frame.lo : !(*frame.lo < *node));
+        bool above_hi = frame.hi && (allow_equal_ ? *frame.hi < *node : !(*node < *frame.hi));
+        if (below_lo || above_hi) {
+            report_.Add(ValidationErrorKind::Order, node);
+        }
+        NodeInvariants<TreeNode>::Check(node, &report_);
+        if (!NodeAugment<TreeNode>::Check(node)) {
+            report_.Add(ValidationErrorKind::Augment, node);
         }
 
-        node->parent_ = parent;
-        parent->right_ = node;
-        node->SetRed();
-        InsertFixUp(node);
-        return true;
+        int black_depth = frame.black_depth + NodeInvariants<TreeNode>::BlackWeight(node);
+        Push(node->right_, node, node, frame.hi, black_depth);
+        Push(node->left_, node, frame.lo, node, black_depth);
     }
-    return false;
-}
 
-template<typename T>
-typename RBTree<T>::TreeNode*
-RBTree<T>::SearchRecursively(TreeNode* node, const T& target) const {
-    if (!node) return nullptr;
-    if (*node == target) return node;
-    else if (*node > target) {
-        return SearchRecursively(node->left_, target);
-    } else {
-        return SearchRecursively(node->right_, target);
+    void AddLeaf(int black_height, TreeNode* parent) {
+        if (leaf_black_height_ < 0) {
+            leaf_black_height_ = black_height;
+        } else if (leaf_black_height_ != black_height) {
+            report_.Add(ValidationErrorKind::BlackHeight, parent);
+        }
     }
+};
 
-    return nullptr;
-}
+#ifdef BT_ENABLE_COROUTINES
+// ------------ Coroutine Search -------------
 
-template<typename T>
-bool RBTree<T>::DeleteRecursively(TreeNode* node, const T& target) {
-    if (!node) return false;
+// Handle of one suspended lookup. Frames all have the same size and are
+// recycled through a per-thread free list instead of the heap.
+struct LookupTask {
+    struct promise_type {
+        LookupTask get_return_object() {
+            return LookupTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t size) {
+            std::vector<void*>& frames = FreeFrames(size);
+            if (frames.empty()) return ::operator new(size);
+            void *frame = frames.back();
+            frames.pop_back();
+            return frame;
+        }
+        static void operator delete(void* frame, size_t size) {
+            FreeFrames(size).push_back(frame);
+        }
 
-    if (*node > target) {
-        return DeleteRecursively(node->left_, target);
-    } else if (*node < target) {
-        return DeleteRecursively(node->right_, target);
-    } else {
-        TreeNode *parent = node->parent_;
-        bool is_root = (parent == nullptr);
-        bool is_left_child = (!is_root && (parent->left_ == node));
-
-        if (!node->left_ && !node->right_) {
-            // Case 1: no children
-            // Delete Directly
-            if (is_root) BaseTreeType::root_ = nullptr;
-            else {
-                if (is_left_child) parent->left_ = nullptr;
-                else parent->right_ = nullptr;
+     private:
+        struct FramePool {
+            std::vector<std::pair<size_t, std::vector<void*>>> lists;
+            ~FramePool() {
+                for (auto& list : lists) {
+                    for (void *frame : list.second) ::operator delete(frame);
+                }
             }
+        };
 
-            if (!node->IsRed()) {
-                DeleteFixUp(nullptr, parent);
+        static std::vector<void*>& FreeFrames(size_t size) {
+            thread_local FramePool pool;
+            for (auto& list : pool.lists) {
+                if (list.first == size) return list.second;
             }
+            pool.lists.emplace_back(size, std::vector<void*>());
+            return pool.lists.back().second;
+        }
+    };
 
-            delete node;
+    std::coroutine_handle<promise_type> handle;
+};
+#endif
 
-        } else if (!node->right_) {
-            // Case 2: has one child
-            // Replace node with the child
-            TreeNode *l_node = node->left_;
-            if (is_root) {
-                BaseTreeType::root_ = l_node;
-            } else {
-                if (is_left_child) parent->left_ = l_node;
-                else parent->right_ = l_node;
-            }
-            l_node->parent_ = parent;
+template<typename T, typename TreeNode = TreeNodeBase<T>, typename Stats = NoTreeStats>
+class BinaryTreeBase {
+ public:
+    using TreeNodeType = TreeNode;
+    using ValueType = T;
 
-            if (!node->IsRed()) {
-                DeleteFixUp(l_node, parent);
-            }
+    BinaryTreeBase():root_(nullptr), version_(0), reclaimer_(nullptr), resource_(nullptr),
+                     leftmost_(nullptr), rightmost_(nullptr), extremes_version_(UINT64_MAX) {}
 
-            delete node;
+    BinaryTreeBase(const BinaryTreeBase&) = delete;
+    BinaryTreeBase& operator=(const BinaryTreeBase&) = delete;
 
-        } else if (!node->left_) {
-            // Case 2
-            TreeNode *r_node = node->right_;
-            if (is_root) {
-                BaseTreeType::root_ = r_node;
-            } else {
-                if (is_left_child) parent->left_ = r_node;
-                else parent->right_ = r_node;
-            }
-            r_node->parent_ = parent;
+    // Moves take the nodes, stats and reclaimer, the source is left empty
+    BinaryTreeBase(BinaryTreeBase&& other) noexcept;
+    BinaryTreeBase& operator=(BinaryTreeBase&& other) noexcept;
 
-            if (!node->IsRed()) {
-                DeleteFixUp(r_node, parent);
-            }
+    virtual ~BinaryTreeBase() {
+        Destroy(root_);
+    }
 
-            delete node;
+    TreeNode* Insert(const T& data);
+    TreeNode* Search(const T& target) const;
+    bool Delete(const T& target);
 
-        } else {
-            // Case 3: has 2 children
-            // Find the inorder proceeding node
-            TreeNode *ino_prev = node->left_;
-            while (ino_prev->right_) {
-                ino_prev = ino_prev->right_;
-            }
-            // Exchange the value of node and proceeding node
-            node->data_ = ino_prev->data_;
+    // Inserts next to hint when data belongs there, otherwise climbs from hint
+    // to the nearest ancestor whose key range covers data. Feeding back the
+    // returned node makes nearly-sorted input O(1) amortized per key: the
+    // check against hint's in-order neighbour follows a bounded number of
+    // links, and the tree's ends are cached. The first InsertHint after any
+    // other update finds the ends again, O(height).
+    TreeNode* InsertHint(TreeNode* hint, const T& data);
+    // Finger search: starts from a known node instead of the root
+    TreeNode* Search(TreeNode* from, const T& target) const;
+
+    // Lookup for trees much larger than the cache. Prefetches both children
+    // before the comparison resolves and picks the next node without a
+    // branch. Read-only: a splay tree is not splayed.
+    TreeNode* SearchPrefetch(const T& target) const;
+    // Interleaves the descents of a batch of keys so that their cache misses
+    // overlap. results[i] is the node for keys[i], or null.
+    void MultiSearch(const T* keys, size_t n, TreeNode** results) const;
+    std::vector<TreeNode*> MultiSearch(const std::vector<T>& keys) const;
+
+#ifdef BT_ENABLE_COROUTINES
+    // Keeps in_flight lookups going as coroutines. Each one prefetches its
+    // next node and suspends, and the others run while the line is fetched.
+    void SearchMany(const T* keys, size_t n, TreeNode** results, size_t in_flight = 16) const;
+    std::vector<TreeNode*> SearchMany(const std::vector<T>& keys, size_t in_flight = 16) const;
+#endif
+
+    // First node not less than target / greater than target, null when none
+    TreeNode* LowerBound(const T& target) const;
+    TreeNode* UpperBound(const T& target) const;
+    // Nodes equal to target are [first, second) in successor order,
+    // tombstones in between included
+    std::pair<TreeNode*, TreeNode*> EqualRange(const T& target) const;
+    // O(log n): trees with MultiKeys keep subtree sizes, the others hold one
+    // live node per key at most
+    size_t Count(const T& target) const;
+
+    // Calls fn(data) for every key in order / for the keys in [lo, hi)
+    template<typename Fn>
+    void ForEach(Fn fn) const;
+    template<typename Fn>
+    void ForEachInRange(const T& lo, const T& hi, Fn fn) const;
+
+    // Combines the monoid augmentation over the keys in [lo, hi) in key
+    // order, O(log n). Only for trees with a MonoidAugment policy.
+    template<typename Augment = typename NodeAugment<TreeNode>::Policy>
+    typename Augment::Value Aggregate(const T& lo, const T& hi) const;
+
+    void Clear();
+    int GetHeight() const;
 
-            // Delete proceeding
-            return DeleteRecursively(ino_prev, ino_prev->data_);
+    // Streams the tree without recursion. Memory is bounded by the tree height.
+    void Dump(std::ostream& os, const DumpOptions& options = DumpOptions()) const;
+    // Same, through a caller's writer: no allocation per node
+    void Dump(TextWriter& out, const DumpOptions& options = DumpOptions()) const;
+
+    const Stats& GetStats() const { return stats_; }
+    TreeStatsSnapshot StatsSnapshot() const { return stats_.Snapshot(); }
+    void ResetStats() { stats_.Reset(); }
+
+    // Walks the tree, O(n). Freed nodes waiting in an epoch reclaimer are
+    // the manager's, see EpochManager::CachedBytes(). A clone block shared
+    // by two trees after Split or Merge is reported by both.
+    TreeMemoryUsage MemoryUsage() const;
+
+    // Frees nodes through an epoch manager instead of deleting them, so
+    // readers pinned on it can still walk unlinked nodes. Node memory is
+    // recycled through the manager, which must outlive the tree. Only
+    // allowed while the tree is empty.
+    void SetReclaimer(EpochManager* reclaimer);
+    EpochManager* GetReclaimer() const { return reclaimer_; }
+
+    // Takes node memory from resource instead of the heap. On a monotonic
+    // resource with trivially destructible nodes, Clear() and the destructor
+    // drop the nodes in O(1) without visiting them, the memory comes back
+    // when the resource is released. With TreeStats they are still walked
+    // once, to count them as deallocated. The resource must outlive the tree.
+    // Only allowed while the tree is empty and has no reclaimer.
+    void SetMemoryResource(MemoryResource* resource);
+    MemoryResource* GetMemoryResource() const { return resource_; }
+
+    // Checks key order, parent links and the invariants of the node type
+    // without recursion or printing
+    ValidationReport Validate(const ValidateOptions& options = ValidateOptions()) const;
+
+    // Validates a live tree a chunk at a time. If the tree is modified
+    // between two steps the walk starts over.
+    class IncrementalValidator {
+     public:
+        explicit IncrementalValidator(const BinaryTreeBase& tree, size_t max_errors = 16):
+            tree_(tree), max_errors_(max_errors), walker_(max_errors, tree.AllowsDuplicates()) {
+            Restart();
         }
 
-        return true;
-    }
-}
+        // Checks up to max_nodes nodes, returns true once the whole tree is checked
+        bool Step(size_t max_nodes);
 
-template<typename T>
-void RBTree<T>::InsertFixUp(TreeNode* node) {
-    TreeNode *parent = node->parent_;
-    if (parent == nullptr) {
-        // Case 1: Node is root, set it to black;
-        node->SetBlack();
+        // Same as Step, bounded by wall time instead
+        template<typename Rep, typename Period>
+        bool StepFor(std::chrono::duration<Rep, Period> budget) {
+            auto deadline = std::chrono::steady_clock::now() + budget;
+            while (!Step(256)) {
+                if (std::chrono::steady_clock::now() >= deadline) return false;
+            }
+            return true;
+        }
 
-    } else if (parent->IsRed()) {
-        // Case 2: Parent node is red
-        // There must be a grand parent
-        TreeNode* grand_parent = parent->parent_;
-        bool parent_is_left = (parent == grand_parent->left_);
-        bool is_left = (node == parent->left_);
-        TreeNode *uncle = (parent_is_left ? grand_parent->right_ : grand_parent->left_);
+        void Restart();
+        const ValidationReport& Report() const { return walker_.Report(); }
 
-        if (uncle && uncle->IsRed()) {
-            // Case 2.1: Uncle node is red
-            // Set parent & uncle to black, set grand parent to red
-            parent->SetBlack();
-            uncle->SetBlack();
-            grand_parent->SetRed();
+     private:
+        const BinaryTreeBase& tree_;
+        size_t max_errors_;
+        uint64_t version_;
+        bool finished_;
+        SubtreeValidator<TreeNode> walker_;
+    };
 
-            // Fixup grandparent recursively
-            InsertFixUp(grand_parent);
-        } else {
-            // Case 2.2: Uncle is black
-            bool has_rotate = false;
-            if (parent_is_left) {
-                if (!is_left) {
-                    // node is right child, parent is left
-                    // left rotate parent
-                    LeftRotate(parent, &(BaseTreeType::root_));
-                    has_rotate = true;
-                }
-            } else {
-                if (is_left) {
-                    // node is left child, parent is right
-                    // right rotate parent
-                    RightRotate(parent, &(BaseTreeType::root_));
-                    has_rotate = true;
-                }
-            }
+    template<typename U, typename TreeNodeT, typename StatsT>
+    friend std::ostream& operator<<(std::ostream& os, const BinaryTreeBase<U, TreeNodeT, StatsT>& bst);
 
-            if (has_rotate) {
-                InsertFixUp(parent);
-            } else {
-                // Case 2.3: Uncle is black, node is left child
-                // Set parent to black, set grand parent to red
-                parent->SetBlack();
-                grand_parent->SetRed();
-
-                // rotate grand parent
-                if (parent_is_left) {
-                    RightRotate(grand_parent, &(BaseTreeType::root_));
+ protected:
+    TreeNode *root_;
+    Stats stats_;
+    // Bumped on every structural change, lets incremental walkers notice
+    uint64_t version_;
+    EpochManager *reclaimer_;
+    MemoryResource *resource_;
+    // Leftmost and rightmost node, like the std::map header, so a hint at an
+    // end needs no climb to the root. Valid while extremes_version_ equals
+    // version_: InsertHint keeps them current, other updates leave them stale.
+    TreeNode *leftmost_;
+    TreeNode *rightmost_;
+    uint64_t extremes_version_;
+
+    // The nodes of a Clone() share one allocation, which goes away with the
+    // last of them. Trees that hand nodes to each other share the blocks.
+    struct CloneBlock {
+        TreeNode *nodes;
+        size_t size;
+        size_t live;
+
+        CloneBlock(TreeNode* nodes, size_t size): nodes(nodes), size(size), live(size) {}
+        ~CloneBlock() { ::operator delete(nodes); }
+    };
+    std::vector<std::shared_ptr<CloneBlock>> clone_blocks_;
+
+    TreeNode* NewNode(const T& data);
+    void FreeNode(TreeNode* node);
+    // Copies the nodes, links and balance data into the empty tree copy with
+    // one preorder pass, without rebalancing. Stats, reclaimer and memory
+    // resource are not copied.
+    void CloneInto(BinaryTreeBase* copy) const;
+    // Lets other free nodes that came from the clone blocks of this tree
+    void ShareCloneBlocks(BinaryTreeBase* other) const;
+    bool InCloneBlock(const TreeNode* node) const;
+    void RotateLeft(TreeNode* node, TreeNode** root);
+    void RotateRight(TreeNode* node, TreeNode** root);
+    void RotateLeft(TreeNode* node) { RotateLeft(node, &root_); }
+    void RotateRight(TreeNode* node) { RotateRight(node, &root_); }
+    // Recomputes the augmentation from node up to the root
+    void UpdateAugmentPath(TreeNode* node);
+
+    void Destroy(TreeNode* node);
+    void InorderPrint(TextWriter& out, TreeNode* node) const;
+    void DumpInternal(TextWriter& out, TreeNode* node, const DumpOptions& options) const;
+
+    static TreeNode* LeftMost(TreeNode* node);
+    static TreeNode* RightMost(TreeNode* node);
+    static TreeNode* Successor(TreeNode* node);
+    static TreeNode* Predecessor(TreeNode* node);
+    // First node from node on in successor order that is not a tombstone
+    static TreeNode* SkipDead(TreeNode* node);
+
+    int GetHeightInternal(TreeNode* node) const;
+
+    // Trees that keep a node count report it here so Validate can check it
+    virtual bool GetTrackedSize(size_t*) const { return false; }
+    // Trees that keep equal keys say so here so Validate accepts them
+    virtual bool AllowsDuplicates() const { return false; }
+    // Called by Clear() once the nodes are gone, trees with counters reset them here
+    virtual void OnClear() {}
+    void CheckTrackedSize(ValidationReport* report) const;
+
+#ifdef BT_ENABLE_COROUTINES
+    // One SearchMany lookup, suspends before reading each node
+    LookupTask Lookup(const T& target, TreeNode** result) const;
+#endif
+
+    // Hangs node under parent (or makes it the root) with parent_ set
+    void LinkNode(TreeNode* parent, bool is_left, TreeNode* node);
+    // Lowest ancestor of from whose subtree can hold target
+    TreeNode* FingerClimb(TreeNode* from, const T& target) const;
+    // Live nodes below target, or not above it when inclusive. Counted nodes only.
+    size_t CountBelow(const T& target, bool inclusive) const;
+    // In-order neighbour of node, the next one or the previous one, if it is
+    // at most kHintSteps links away. *neighbour is null past the cached ends.
+    static const int kHintSteps = 4;
+    bool NearNeighbour(TreeNode* node, bool next, TreeNode** neighbour) const;
+
+    virtual bool InsertInternal(TreeNode*& root, TreeNode* node) = 0;
+    // Links node at an empty child slot found by a descent, then restores the invariants
+    virtual void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) = 0;
+    virtual TreeNode* SearchInternal(TreeNode* node, const T& target) const = 0;
+    virtual bool DeleteInternal(TreeNode* node, const T& target) = 0;
+}; // class BinaryTreeBase
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::Insert(const T& data) {
+    TreeNode *node_to_insert = NewNode(data);
+    if (InsertInternal(root_, node_to_insert)) {
+        ++version_;
+        return node_to_insert;
+    }
+
+    FreeNode(node_to_insert);
+    return nullptr;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::Search(const T& target) const {
+    return SearchInternal(root_, target);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::InsertHint(TreeNode* hint, const T& data) {
+    if (!hint || !root_) return Insert(data);
+
+    if (extremes_version_ != version_) {
+        leftmost_ = LeftMost(root_);
+        rightmost_ = RightMost(root_);
+        extremes_version_ = version_;
+    }
+
+    TreeNode *parent = nullptr;
+    bool is_left = false;
+    TreeNode *neighbour = nullptr;
+    stats_.OnCompare();
+    if (data < hint->data_) {
+        // Fits right before hint if it is above the predecessor
+        if (NearNeighbour(hint, false, &neighbour)) {
+            if (neighbour) stats_.OnCompare();
+            if (!neighbour || neighbour->data_ < data) {
+                if (!hint->left_) {
+                    parent = hint;
+                    is_left = true;
+                } else {
+                    parent = neighbour;
+                    is_left = false;
+                }
+            } else if (!(data < neighbour->data_)) {
+                return (AllowsDuplicates() || NodeTombstone<TreeNode>::IsDead(neighbour)) ? Insert(data) : nullptr;
+            }
+        }
+    } else if (hint->data_ < data) {
+        if (NearNeighbour(hint, true, &neighbour)) {
+            if (neighbour) stats_.OnCompare();
+            if (!neighbour || data < neighbour->data_) {
+                if (!hint->right_) {
+                    parent = hint;
+                    is_left = false;
                 } else {
-                    LeftRotate(grand_parent, &(BaseTreeType::root_));
+                    parent = neighbour;
+                    is_left = true;
                 }
+            } else if (!(neighbour->data_ < data)) {
+                return (AllowsDuplicates() || NodeTombstone<TreeNode>::IsDead(neighbour)) ? Insert(data) : nullptr;
+            }
+        }
+    } else {
+        // A tombstone of the key is revived by the tree's own insert
+        return (AllowsDuplicates() || NodeTombstone<TreeNode>::IsDead(hint)) ? Insert(data) : nullptr;
+    }
+
+    if (!parent) {
+        // Bad hint or a far neighbour, descend from the closest ancestor that covers data
+        TreeNode *cur = FingerClimb(hint, data);
+        while (cur) {
+            stats_.OnCompare();
+            stats_.OnHop();
+            parent = cur;
+            if (data < cur->data_) {
+                cur = cur->left_;
+                is_left = true;
+            } else if (cur->data_ < data) {
+                cur = cur->right_;
+                is_left = false;
+            } else if (AllowsDuplicates()) {
+                // Equal keys go after the ones already there
+                cur = cur->right_;
+                is_left = false;
+            } else {
+                return NodeTombstone<TreeNode>::IsDead(cur) ? Insert(data) : nullptr;
+            }
+        }
+    }
+
+    TreeNode *node = NewNode(data);
+    InsertAt(parent, is_left, node);
+    // Rebalancing keeps the in-order sequence, only a node hung outside an end moves it
+    if (is_left && parent == leftmost_) leftmost_ = node;
+    if (!is_left && parent == rightmost_) rightmost_ = node;
+    ++version_;
+    extremes_version_ = version_;
+    return node;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+bool BinaryTreeBase<T, TreeNode, Stats>::NearNeighbour(TreeNode* node, bool next, TreeNode** neighbour) const {
+    if (node == (next ? rightmost_ : leftmost_)) {
+        *neighbour = nullptr;
+        return true;
+    }
+
+    TreeNode *child = (next ? node->right_ : node->left_);
+    if (child) {
+        // Innermost node of the subtree on that side
+        for (int steps = 0; steps < kHintSteps; ++steps) {
+            stats_.OnHop();
+            TreeNode *inner = (next ? child->left_ : child->right_);
+            if (!inner) {
+                *neighbour = child;
+                return true;
+            }
+            child = inner;
+        }
+        return false;
+    }
+
+    // First ancestor reached from the near side
+    for (int steps = 0; steps < kHintSteps && node->parent_; ++steps) {
+        stats_.OnHop();
+        TreeNode *parent = node->parent_;
+        if ((next ? parent->left_ : parent->right_) == node) {
+            *neighbour = parent;
+            return true;
+        }
+        node = parent;
+    }
+    return false;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::Search(TreeNode* from, const T& target) const {
+    if (!from) return Search(target);
+    return SearchInternal(FingerClimb(from, target), target);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::SearchPrefetch(const T& target) const {
+    // Descend like a lower bound, without leaving early on a match: the only
+    // branch left is the loop condition
+    TreeNode *node = root_;
+    TreeNode *candidate = nullptr;
+    int depth = 0;
+    while (node) {
+        BT_PREFETCH(node->left_);
+        BT_PREFETCH(node->right_);
+        ++depth;
+        stats_.OnCompare();
+        bool go_right = node->data_ < target;
+        TreeNode *children[2] = {node->left_, node->right_};
+        candidate = (go_right ? candidate : node);
+        node = children[go_right];
+    }
+    stats_.OnSearch(depth);
+
+    candidate = SkipDead(candidate);
+    if (candidate && !(target < candidate->data_)) return candidate;
+    return nullptr;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::MultiSearch(const T* keys, size_t n, TreeNode** results) const {
+    // Each round moves every descent in the group down one level and
+    // prefetches its next node, which is read only after the others moved
+    const size_t kGroup = 16;
+    TreeNode *cursors[kGroup];
+    for (size_t begin = 0; begin < n; begin += kGroup) {
+        size_t count = std::min(kGroup, n - begin);
+        const T *group_keys = keys + begin;
+        TreeNode **candidates = results + begin;
+        for (size_t i = 0; i < count; ++i) {
+            cursors[i] = root_;
+            candidates[i] = nullptr;
+        }
+
+        bool active = (root_ != nullptr);
+        while (active) {
+            active = false;
+            for (size_t i = 0; i < count; ++i) {
+                TreeNode *node = cursors[i];
+                if (!node) continue;
+                stats_.OnCompare();
+                bool go_right = node->data_ < group_keys[i];
+                TreeNode *children[2] = {node->left_, node->right_};
+                candidates[i] = (go_right ? candidates[i] : node);
+                cursors[i] = children[go_right];
+                BT_PREFETCH(cursors[i]);
+                active = active || cursors[i];
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            candidates[i] = SkipDead(candidates[i]);
+            if (candidates[i] && group_keys[i] < candidates[i]->data_) candidates[i] = nullptr;
+        }
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+std::vector<TreeNode*> BinaryTreeBase<T, TreeNode, Stats>::MultiSearch(const std::vector<T>& keys) const {
+    std::vector<TreeNode*> results(keys.size());
+    if (!keys.empty()) MultiSearch(keys.data(), keys.size(), results.data());
+    return results;
+}
+
+#ifdef BT_ENABLE_COROUTINES
+template<typename T, typename TreeNode, typename Stats>
+LookupTask BinaryTreeBase<T, TreeNode, Stats>::Lookup(const T& target, TreeNode** result) const {
+    TreeNode *node = root_;
+    TreeNode *candidate = nullptr;
+    while (node) {
+        BT_PREFETCH(node);
+        co_await std::suspend_always();
+        stats_.OnCompare();
+        bool go_right = node->data_ < target;
+        TreeNode *children[2] = {node->left_, node->right_};
+        candidate = (go_right ? candidate : node);
+        node = children[go_right];
+    }
+    candidate = SkipDead(candidate);
+    *result = (candidate && !(target < candidate->data_) ? candidate : nullptr);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::SearchMany(const T* keys, size_t n, TreeNode** results,
+                                                    size_t in_flight) const {
+    // Round robin over the slots, a finished lookup makes room for the next key
+    std::vector<std::coroutine_handle<LookupTask::promise_type>> slots;
+    size_t next = 0;
+    for (; next < n && slots.size() < std::max<size_t>(in_flight, 1); ++next) {
+        slots.push_back(Lookup(keys[next], &results[next]).handle);
+    }
+
+    while (!slots.empty()) {
+        for (size_t i = 0; i < slots.size(); ) {
+            slots[i].resume();
+            if (!slots[i].done()) {
+                ++i;
+                continue;
+            }
+            slots[i].destroy();
+            if (next < n) {
+                slots[i] = Lookup(keys[next], &results[next]).handle;
+                ++next;
+                ++i;
+            } else {
+                slots[i] = slots.back();
+                slots.pop_back();
+            }
+        }
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+std::vector<TreeNode*> BinaryTreeBase<T, TreeNode, Stats>::SearchMany(const std::vector<T>& keys,
+                                                                      size_t in_flight) const {
+    std::vector<TreeNode*> results(keys.size());
+    SearchMany(keys.data(), keys.size(), results.data(), in_flight);
+    return results;
+}
+#endif
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::LowerBound(const T& target) const {
+    TreeNode *node = root_;
+    TreeNode *bound = nullptr;
+    while (node) {
+        stats_.OnCompare();
+        if (node->data_ < target) {
+            node = node->right_;
+        } else {
+            bound = node;
+            node = node->left_;
+        }
+    }
+    return SkipDead(bound);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::UpperBound(const T& target) const {
+    TreeNode *node = root_;
+    TreeNode *bound = nullptr;
+    while (node) {
+        stats_.OnCompare();
+        if (target < node->data_) {
+            bound = node;
+            node = node->left_;
+        } else {
+            node = node->right_;
+        }
+    }
+    return SkipDead(bound);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+std::pair<TreeNode*, TreeNode*> BinaryTreeBase<T, TreeNode, Stats>::EqualRange(const T& target) const {
+    return std::make_pair(LowerBound(target), UpperBound(target));
+}
+
+template<typename T, typename TreeNode, typename Stats>
+size_t BinaryTreeBase<T, TreeNode, Stats>::Count(const T& target) const {
+    if (NodeSize<TreeNode>::kEnabled) {
+        return CountBelow(target, true) - CountBelow(target, false);
+    }
+
+    // Unique keys: one live node at most, tombstones of the key next to it
+    std::pair<TreeNode*, TreeNode*> range = EqualRange(target);
+    size_t count = 0;
+    for (TreeNode *node = range.first; node != range.second; node = Successor(node)) {
+        if (!NodeTombstone<TreeNode>::IsDead(node)) ++count;
+    }
+    return count;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+size_t BinaryTreeBase<T, TreeNode, Stats>::CountBelow(const T& target, bool inclusive) const {
+    size_t count = 0;
+    for (TreeNode *node = root_; node; ) {
+        stats_.OnCompare();
+        if (inclusive ? !(target < node->data_) : node->data_ < target) {
+            count += NodeSize<TreeNode>::Get(node->left_) + (NodeTombstone<TreeNode>::IsDead(node) ? 0 : 1);
+            node = node->right_;
+        } else {
+            node = node->left_;
+        }
+    }
+    return count;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+template<typename Augment>
+typename Augment::Value BinaryTreeBase<T, TreeNode, Stats>::Aggregate(const T& lo, const T& hi) const {
+    // Find the topmost node inside the range, below it the range splits
+    // into a suffix of its left subtree and a prefix of its right subtree
+    TreeNode *split = root_;
+    while (split) {
+        stats_.OnCompare();
+        if (split->data_ < lo) split = split->right_;
+        else if (!(split->data_ < hi)) split = split->left_;
+        else break;
+    }
+    if (!split) return Augment::Identity();
+
+    typename Augment::Value left = Augment::Identity();
+    for (TreeNode *node = split->left_; node; ) {
+        stats_.OnCompare();
+        if (node->data_ < lo) {
+            node = node->right_;
+            continue;
+        }
+        // node and its right subtree are in range and come before what we have
+        typename Augment::Value part = Augment::Lift(node->data_);
+        if (node->right_) part = Augment::Combine(part, node->right_->augment_);
+        left = Augment::Combine(part, left);
+        node = node->left_;
+    }
+
+    typename Augment::Value right = Augment::Identity();
+    for (TreeNode *node = split->right_; node; ) {
+        stats_.OnCompare();
+        if (!(node->data_ < hi)) {
+            node = node->left_;
+            continue;
+        }
+        typename Augment::Value part = Augment::Lift(node->data_);
+        if (node->left_) part = Augment::Combine(node->left_->augment_, part);
+        right = Augment::Combine(right, part);
+        node = node->right_;
+    }
+
+    return Augment::Combine(Augment::Combine(left, Augment::Lift(split->data_)), right);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+template<typename Fn>
+void BinaryTreeBase<T, TreeNode, Stats>::ForEach(Fn fn) const {
+    for (TreeNode *node = SkipDead(LeftMost(root_)); node; node = SkipDead(Successor(node))) {
+        fn(node->data_);
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+template<typename Fn>
+void BinaryTreeBase<T, TreeNode, Stats>::ForEachInRange(const T& lo, const T& hi, Fn fn) const {
+    for (TreeNode *node = LowerBound(lo); node && node->data_ < hi; node = SkipDead(Successor(node))) {
+        fn(node->data_);
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::FingerClimb(TreeNode* from, const T& target) const {
+    // Every subtree on the way up already covers one side of target. Stop at
+    // the first ancestor we reach from the other side that also bounds it.
+    TreeNode *node = from;
+    stats_.OnCompare();
+    bool go_right = from->data_ < target;
+    while (node->parent_) {
+        stats_.OnHop();
+        TreeNode *parent = node->parent_;
+        bool from_near_side = (go_right ? parent->left_ == node : parent->right_ == node);
+        if (from_near_side) {
+            stats_.OnCompare();
+            if (go_right ? !(parent->data_ < target) : !(target < parent->data_)) {
+                // parent == target is found right away by the caller's descent
+                return (parent->data_ < target || target < parent->data_) ? node : parent;
+            }
+        }
+        node = parent;
+    }
+    return node;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+bool BinaryTreeBase<T, TreeNode, Stats>::Delete(const T& target) {
+    if (!DeleteInternal(root_, target)) return false;
+
+    ++version_;
+    return true;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+BinaryTreeBase<T, TreeNode, Stats>::BinaryTreeBase(BinaryTreeBase&& other) noexcept:
+    root_(other.root_), stats_(other.stats_), version_(other.version_),
+    reclaimer_(other.reclaimer_), resource_(other.resource_), leftmost_(nullptr), rightmost_(nullptr),
+    extremes_version_(UINT64_MAX), clone_blocks_(std::move(other.clone_blocks_)) {
+    other.root_ = nullptr;
+    other.stats_.Reset();
+    other.clone_blocks_.clear();
+    ++other.version_;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+BinaryTreeBase<T, TreeNode, Stats>& BinaryTreeBase<T, TreeNode, Stats>::operator=(BinaryTreeBase&& other) noexcept {
+    if (this == &other) return *this;
+
+    Destroy(root_);
+    root_ = other.root_;
+    stats_ = other.stats_;
+    // Kept growing so walkers started on this tree notice the swap
+    version_ = std::max(version_, other.version_) + 1;
+    reclaimer_ = other.reclaimer_;
+    resource_ = other.resource_;
+    clone_blocks_ = std::move(other.clone_blocks_);
+    other.root_ = nullptr;
+    other.stats_.Reset();
+    other.clone_blocks_.clear();
+    ++other.version_;
+    return *this;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::CloneInto(BinaryTreeBase* copy) const {
+    size_t count = 0;
+    for (TreeNode *node = LeftMost(root_); node; node = Successor(node)) {
+        ++count;
+    }
+    if (count == 0) return;
+
+    TreeNode *nodes = static_cast<TreeNode*>(::operator new(count * sizeof(TreeNode)));
+    std::shared_ptr<CloneBlock> block(new CloneBlock(nodes, count));
+    size_t used = 0;
+    auto clone = [&](const TreeNode* node, TreeNode* parent) -> TreeNode* {
+        TreeNode *cloned = new (nodes + used++) TreeNode(*node);
+        cloned->left_ = nullptr;
+        cloned->right_ = nullptr;
+        cloned->parent_ = parent;
+        copy->stats_.OnAllocate();
+        return cloned;
+    };
+
+    // Preorder with an explicit stack, so a parent sits right before its left child
+    copy->root_ = clone(root_, nullptr);
+    std::vector<std::pair<const TreeNode*, TreeNode*>> stack;
+    stack.push_back(std::make_pair(root_, copy->root_));
+    while (!stack.empty()) {
+        const TreeNode *node = stack.back().first;
+        TreeNode *cloned = stack.back().second;
+        stack.pop_back();
+        if (node->right_) {
+            cloned->right_ = clone(node->right_, cloned);
+            stack.push_back(std::make_pair(node->right_, cloned->right_));
+        }
+        if (node->left_) {
+            cloned->left_ = clone(node->left_, cloned);
+            stack.push_back(std::make_pair(node->left_, cloned->left_));
+        }
+    }
+    copy->clone_blocks_.push_back(block);
+    ++copy->version_;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::ShareCloneBlocks(BinaryTreeBase* other) const {
+    for (const auto& block : clone_blocks_) {
+        if (std::find(other->clone_blocks_.begin(), other->clone_blocks_.end(), block) == other->clone_blocks_.end()) {
+            other->clone_blocks_.push_back(block);
+        }
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::SetReclaimer(EpochManager* reclaimer) {
+    if (root_) {
+        throw std::runtime_error("SetReclaimer on a non-empty tree");
+    }
+    if (reclaimer && resource_) {
+        throw std::runtime_error("SetReclaimer on a tree with a memory resource");
+    }
+    reclaimer_ = reclaimer;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::SetMemoryResource(MemoryResource* resource) {
+    if (root_) {
+        throw std::runtime_error("SetMemoryResource on a non-empty tree");
+    }
+    if (resource && reclaimer_) {
+        throw std::runtime_error("SetMemoryResource on a tree with a reclaimer");
+    }
+    resource_ = resource;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+bool BinaryTreeBase<T, TreeNode, Stats>::InCloneBlock(const TreeNode* node) const {
+    for (auto& block : clone_blocks_) {
+        uintptr_t offset = reinterpret_cast<uintptr_t>(node) - reinterpret_cast<uintptr_t>(block->nodes);
+        if (offset < block->size * sizeof(TreeNode)) return true;
+    }
+    return false;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeMemoryUsage BinaryTreeBase<T, TreeNode, Stats>::MemoryUsage() const {
+    TreeMemoryUsage usage;
+    usage.node_size = sizeof(TreeNode);
+    // A memory resource accounts for its own blocks
+    const size_t node_slack = (resource_ ? 0 : HeapAllocationSize(sizeof(TreeNode)) - sizeof(TreeNode));
+    for (TreeNode *node = LeftMost(root_); node; node = Successor(node)) {
+        ++usage.nodes;
+        usage.payload_bytes += HeapBytes(node->data_);
+        // Cloned nodes share their block's allocation
+        if (!InCloneBlock(node)) usage.allocator_slack += node_slack;
+    }
+    usage.node_bytes = usage.nodes * sizeof(TreeNode);
+
+    for (auto& block : clone_blocks_) {
+        size_t bytes = block->size * sizeof(TreeNode);
+        usage.block_bytes += bytes;
+        usage.block_free_bytes += (block->size - block->live) * sizeof(TreeNode);
+        usage.allocator_slack += HeapAllocationSize(bytes) - bytes;
+    }
+    return usage;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::NewNode(const T& data) {
+    stats_.OnAllocate();
+    if (resource_) {
+        void *memory = resource_->Allocate(sizeof(TreeNode), alignof(TreeNode));
+        try {
+            return new (memory) TreeNode(data);
+        } catch (...) {
+            resource_->Deallocate(memory, sizeof(TreeNode), alignof(TreeNode));
+            throw;
+        }
+    }
+    if (!reclaimer_) return new TreeNode(data);
+
+    void *memory = reclaimer_->Allocate(sizeof(TreeNode));
+    try {
+        return new (memory) TreeNode(data);
+    } catch (...) {
+        ::operator delete(memory);
+        throw;
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::FreeNode(TreeNode* node) {
+    stats_.OnDeallocate();
+    for (size_t i = 0; i < clone_blocks_.size(); ++i) {
+        CloneBlock& block = *clone_blocks_[i];
+        uintptr_t offset = reinterpret_cast<uintptr_t>(node) - reinterpret_cast<uintptr_t>(block.nodes);
+        if (offset >= block.size * sizeof(TreeNode)) continue;
+
+        node->~TreeNode();
+        if (--block.live == 0) clone_blocks_.erase(clone_blocks_.begin() + i);
+        return;
+    }
+    if (resource_) {
+        node->~TreeNode();
+        resource_->Deallocate(node, sizeof(TreeNode), alignof(TreeNode));
+        return;
+    }
+    if (!reclaimer_) {
+        delete node;
+        return;
+    }
+    reclaimer_->Retire(node, sizeof(TreeNode), [](void* object) {
+        static_cast<TreeNode*>(object)->~TreeNode();
+    });
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::LinkNode(TreeNode* parent, bool is_left, TreeNode* node) {
+    node->parent_ = parent;
+    if (!parent) root_ = node;
+    else if (is_left) parent->left_ = node;
+    else parent->right_ = node;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::RotateLeft(TreeNode* node, TreeNode** root) {
+    stats_.OnRotate();
+    ++version_;
+    LeftRotate(node, root);
+    // Only node and its new parent have a different subtree now
+    NodeAugment<TreeNode>::Update(node);
+    NodeAugment<TreeNode>::Update(node->parent_);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::RotateRight(TreeNode* node, TreeNode** root) {
+    stats_.OnRotate();
+    ++version_;
+    RightRotate(node, root);
+    NodeAugment<TreeNode>::Update(node);
+    NodeAugment<TreeNode>::Update(node->parent_);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::UpdateAugmentPath(TreeNode* node) {
+    if (!NodeAugment<TreeNode>::kEnabled) return;
+    for (; node; node = node->parent_) {
+        NodeAugment<TreeNode>::Update(node);
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+int BinaryTreeBase<T, TreeNode, Stats>::GetHeight() const {
+    return GetHeightInternal(root_);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::Clear() {
+    Destroy(root_);
+    root_ = nullptr;
+    // A block shared with another tree lives on for the nodes over there
+    clone_blocks_.clear();
+    ++version_;
+    OnClear();
+}
+
+template<typename T, typename TreeNode, typename Stats>
+int BinaryTreeBase<T, TreeNode, Stats>::GetHeightInternal(TreeNode* node) const {
+    if (!node) {
+        return 0;
+    }
+
+    // Depth-first with an explicit stack, the stack never grows beyond height + 1
+    std::vector<std::pair<TreeNode*, int>> stack;
+    stack.push_back(std::make_pair(node, 1));
+    int height = 0;
+    while (!stack.empty()) {
+        TreeNode* cur = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+
+        height = std::max(height, depth);
+        if (cur->right_) stack.push_back(std::make_pair(cur->right_, depth + 1));
+        if (cur->left_) stack.push_back(std::make_pair(cur->left_, depth + 1));
+    }
+
+    return height;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+std::ostream& operator<<(std::ostream& os, const BinaryTreeBase<T, TreeNode, Stats>& bst) {
+    TextWriter out(os);
+    out.Write("[ ");
+    bst.InorderPrint(out, bst.root_);
+    out.Write("]\n");
+    bst.DumpInternal(out, bst.root_, DumpOptions());
+    return os;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::Destroy(TreeNode* node) {
+    if (!node) return;
+    // Nothing to run and nothing to give back node by node
+    if (resource_ && resource_->IsMonotonic() && std::is_trivially_destructible<TreeNode>::value) {
+        if (Stats::kEnabled) {
+            // Keep allocations minus deallocations at the live node count
+            TreeNode *last = RightMost(node);
+            for (TreeNode *cur = LeftMost(node); ; cur = Successor(cur)) {
+                stats_.OnDeallocate();
+                if (cur == last) break;
             }
         }
-    } 
+        return;
+    }
+
+    // Post-order walk through parent_ links, detaching each leaf before deleting it
+    TreeNode* stop = node->parent_;
+    while (node != stop) {
+        if (node->left_) {
+            node = node->left_;
+        } else if (node->right_) {
+            node = node->right_;
+        } else {
+            TreeNode* parent = node->parent_;
+            if (parent != stop) {
+                if (parent->left_ == node) parent->left_ = nullptr;
+                else parent->right_ = nullptr;
+            }
+            FreeNode(node);
+            node = parent;
+        }
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+ValidationReport BinaryTreeBase<T, TreeNode, Stats>::Validate(const ValidateOptions& options) const {
+    SubtreeValidator<TreeNode> top(options.max_errors, AllowsDuplicates());
+    if (root_) {
+        NodeInvariants<TreeNode>::CheckRoot(root_, &top.Report());
+    }
+    top.Push(root_, nullptr, nullptr, nullptr, 0);
+
+    if (options.threads <= 1) {
+        top.Step(std::numeric_limits<size_t>::max());
+        CheckTrackedSize(&top.Report());
+        return top.Report();
+    }
+
+    // Check the top levels here until there are enough subtrees to hand out,
+    // then walk those subtrees concurrently
+    top.StepBreadthFirst(options.threads * 4);
+    std::vector<typename SubtreeValidator<TreeNode>::Frame> pending = top.TakePending();
+    std::vector<SubtreeValidator<TreeNode>> workers(options.threads, SubtreeValidator<TreeNode>(options.max_errors, AllowsDuplicates()));
+    for (size_t i = 0; i < pending.size(); ++i) {
+        workers[i % workers.size()].Adopt(pending[i]);
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers.size(); ++i) {
+        SubtreeValidator<TreeNode>* worker = &workers[i];
+        threads.push_back(std::thread([worker]() {
+            worker->Step(std::numeric_limits<size_t>::max());
+        }));
+    }
+    workers[0].Step(std::numeric_limits<size_t>::max());
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ValidationReport report = top.Report();
+    int black_height = top.LeafBlackHeight();
+    for (auto& worker : workers) {
+        report.Merge(worker.Report());
+        if (worker.LeafBlackHeight() < 0) continue;
+        if (black_height < 0) {
+            black_height = worker.LeafBlackHeight();
+        } else if (black_height != worker.LeafBlackHeight()) {
+            report.Add(ValidationErrorKind::BlackHeight, root_);
+        }
+    }
+    if (report.errors.size() > options.max_errors) {
+        report.errors.resize(options.max_errors);
+        report.truncated = true;
+    }
+    CheckTrackedSize(&report);
+    return report;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::CheckTrackedSize(ValidationReport* report) const {
+    size_t size = 0;
+    if (!report->truncated && GetTrackedSize(&size) && size != report->nodes_checked) {
+        report->Add(ValidationErrorKind::Size, root_);
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::IncrementalValidator::Restart() {
+    version_ = tree_.version_;
+    finished_ = false;
+    walker_ = SubtreeValidator<TreeNode>(max_errors_, tree_.AllowsDuplicates());
+    if (tree_.root_) {
+        NodeInvariants<TreeNode>::CheckRoot(tree_.root_, &walker_.Report());
+    }
+    walker_.Push(tree_.root_, nullptr, nullptr, nullptr, 0);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+bool BinaryTreeBase<T, TreeNode, Stats>::IncrementalValidator::Step(size_t max_nodes) {
+    if (version_ != tree_.version_) {
+        Restart();
+    }
+    if (finished_) return true;
+
+    if (walker_.Step(max_nodes)) {
+        tree_.CheckTrackedSize(&walker_.Report());
+        finished_ = true;
+    }
+    return finished_;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::LeftMost(TreeNode* node) {
+    if (!node) return nullptr;
+    while (node->left_) {
+        node = node->left_;
+    }
+    return node;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::RightMost(TreeNode* node) {
+    if (!node) return nullptr;
+    while (node->right_) {
+        node = node->right_;
+    }
+    return node;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::Successor(TreeNode* node) {
+    if (node->right_) {
+        return LeftMost(node->right_);
+    }
+
+    TreeNode* parent = node->parent_;
+    while (parent && parent->right_ == node) {
+        node = parent;
+        parent = parent->parent_;
+    }
+    return parent;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::Predecessor(TreeNode* node) {
+    if (node->left_) {
+        node = node->left_;
+        while (node->right_) {
+            node = node->right_;
+        }
+        return node;
+    }
+
+    TreeNode* parent = node->parent_;
+    while (parent && parent->left_ == node) {
+        node = parent;
+        parent = parent->parent_;
+    }
+    return parent;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+TreeNode* BinaryTreeBase<T, TreeNode, Stats>::SkipDead(TreeNode* node) {
+    while (node && NodeTombstone<TreeNode>::IsDead(node)) {
+        node = Successor(node);
+    }
+    return node;
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::InorderPrint(TextWriter& out, TreeNode* node) const {
+    // Walk successors through parent_ links, no stack needed
+    TreeNode* end = (node ? node->parent_ : nullptr);
+    for (TreeNode* cur = LeftMost(node); cur && cur != end; cur = Successor(cur)) {
+        cur->Format(out);
+        out.Put(' ');
+    }
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::Dump(std::ostream& os, const DumpOptions& options) const {
+    TextWriter out(os);
+    DumpInternal(out, root_, options);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::Dump(TextWriter& out, const DumpOptions& options) const {
+    DumpInternal(out, root_, options);
+}
+
+template<typename T, typename TreeNode, typename Stats>
+void BinaryTreeBase<T, TreeNode, Stats>::DumpInternal(TextWriter& out, TreeNode* node,
+                                               const DumpOptions& options) const {
+    struct Frame {
+        TreeNode* node;
+        int depth;
+        bool is_left;
+        long parent_id;
+    };
+
+    const bool is_text = (options.format == DumpFormat::Text);
+    std::vector<Frame> stack;
+    // Text only: whether the ancestor at each depth was a left child,
+    // which decides between "│   " and "    " in the prefix
+    std::vector<bool> branches;
+    long next_id = 0;
+    size_t emitted = 0;
+
+    if (options.format == DumpFormat::Dot) {
+        out.Write("digraph BinaryTree {\n");
+    } else if (options.format == DumpFormat::Json) {
+        out.Write("{\"nodes\":[");
+    }
+
+    if (node || is_text) {
+        stack.push_back(Frame{node, 0, false, -1});
+    }
+
+    bool truncated = false;
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        TreeNode* cur = frame.node;
+        // Only real nodes count against the limit, trailing nil lines still print
+        if (cur && options.max_nodes && emitted >= options.max_nodes) {
+            truncated = true;
+            break;
+        }
+        stack.pop_back();
+        bool at_depth_limit = (options.max_depth >= 0 && frame.depth >= options.max_depth);
+        bool has_children = (cur && (cur->left_ || cur->right_));
+        long id = next_id;
+
+        if (is_text) {
+            branches.resize(frame.depth);
+            for (bool b : branches) {
+                out.Write(b ? "│   " : "    ");
+            }
+            out.Write(frame.is_left ?  "├──" : "└──" );
+
+            if (!cur) {
+                out.Write("nil\n");
+                continue;
+            }
+            cur->Format(out);
+            out.Put('\n');
+
+            if (at_depth_limit && has_children) {
+                for (bool b : branches) {
+                    out.Write(b ? "│   " : "    ");
+                }
+                out.Write(frame.is_left ? "│   " : "    ").Write("└──...\n");
+            }
+        } else if (options.format == DumpFormat::Dot) {
+            out.Write("  n");
+            FormatValue(out, id);
+            out.Write(" [label=\"");
+            out.SetEscapeQuotes(true);
+            cur->Format(out);
+            out.SetEscapeQuotes(false);
+            out.Write("\"];\n");
+            if (frame.parent_id >= 0) {
+                out.Write("  n");
+                FormatValue(out, frame.parent_id);
+                out.Write(" -> n");
+                FormatValue(out, id);
+                out.Write(frame.is_left ? " [label=\"L\"];\n" : " [label=\"R\"];\n");
+            }
+        } else {
+            out.Write(emitted ? ",\n" : "\n").Write("{\"id\":");
+            FormatValue(out, id);
+            out.Write(",\"parent\":");
+            FormatValue(out, frame.parent_id);
+            out.Write(",\"side\":\"");
+            out.Write(frame.parent_id < 0 ? "root" : (frame.is_left ? "left" : "right"));
+            out.Write("\",\"value\":\"");
+            out.SetEscapeJson(true);
+            cur->Format(out);
+            out.SetEscapeJson(false);
+            out.Write("\"}");
+        }
+
+        ++next_id;
+        ++emitted;
+        if (at_depth_limit) {
+            continue;
+        }
+
+        if (is_text) {
+            branches.push_back(frame.is_left);
+            // Push right first so the left subtree is printed first
+            stack.push_back(Frame{cur->right_, frame.depth + 1, false, id});
+            stack.push_back(Frame{cur->left_, frame.depth + 1, true, id});
+        } else {
+            if (cur->right_) stack.push_back(Frame{cur->right_, frame.depth + 1, false, id});
+            if (cur->left_) stack.push_back(Frame{cur->left_, frame.depth + 1, true, id});
+        }
+    }
+
+    if (options.format == DumpFormat::Dot) {
+        if (truncated) {
+            out.Write("  truncated [shape=plaintext, label=\"...\"];\n");
+        }
+        out.Write("}\n");
+    } else if (options.format == DumpFormat::Json) {
+        out.Write(truncated ? "\n],\"truncated\":true}\n" : "\n],\"truncated\":false}\n");
+    } else if (truncated) {
+        out.Write("...(truncated)\n");
+    }
+}
+
+// ------------ Binary Search Tree -------------
+
+template<typename T, typename Stats = NoTreeStats>
+class BinarySearchTree final : public BinaryTreeBase<T, TreeNodeBase<T>, Stats> {
+ public:
+    BinarySearchTree() {}
+    ~BinarySearchTree() {}
+
+    BinarySearchTree(BinarySearchTree&&) = default;
+    BinarySearchTree& operator=(BinarySearchTree&&) = default;
+
+    // Same shape, one allocation for all the nodes
+    BinarySearchTree Clone() const;
+
+ protected:
+    using BaseTreeType = BinaryTreeBase<T, TreeNodeBase<T>, Stats>;
+    using TreeNode = typename BaseTreeType::TreeNodeType;
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
+
+};
+
+template<typename T, typename Stats>
+BinarySearchTree<T, Stats> BinarySearchTree<T, Stats>::Clone() const {
+    BinarySearchTree copy;
+    BaseTreeType::CloneInto(&copy);
+    return copy;
+}
+
+template<typename T, typename Stats>
+bool BinarySearchTree<T, Stats>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur) {
+            cur = cur->right_;
+            is_left = false;
+        } else {
+            return false;
+        }
+    }
+
+    InsertAt(parent, is_left, node);
+    return true;
+}
+
+template<typename T, typename Stats>
+void BinarySearchTree<T, Stats>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    BaseTreeType::LinkNode(parent, is_left, node);
+}
+
+template<typename T, typename Stats>
+typename BinarySearchTree<T, Stats>::TreeNode*
+BinarySearchTree<T, Stats>::SearchInternal(TreeNode* node, const T& target) const {
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
+
+    BaseTreeType::stats_.OnSearch(depth);
+    return node;
+}
+
+template<typename T, typename Stats>
+bool BinarySearchTree<T, Stats>::DeleteInternal(TreeNode* node, const T& target) {
+    while (node && !(*node == target)) {
+        BaseTreeType::stats_.OnCompare();
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    if (!node) return false;
+
+    if (node->left_ && node->right_) {
+        // Has 2 children: copy the inorder preceding node here and unlink that one instead
+        TreeNode *ino_prev = node->left_;
+        while (ino_prev->right_) {
+            ino_prev = ino_prev->right_;
+        }
+        node->data_ = ino_prev->data_;
+        node = ino_prev;
+    }
+
+    // node has at most one child now, splice it out
+    TreeNode *parent = node->parent_;
+    TreeNode *child = (node->left_ ? node->left_ : node->right_);
+    if (!parent) {
+        BaseTreeType::root_ = child;
+    } else {
+        if (parent->left_ == node) parent->left_ = child;
+        else parent->right_ = child;
+    }
+    if (child) {
+        child->parent_ = parent;
+    }
+
+    BaseTreeType::FreeNode(node);
+    return true;
+}
+
+// ------------ Red Black Tree -------------
+
+template<typename T, typename Augment = NoAugment, bool Counted = false>
+struct RBTreeNode : public AugmentStorage<Augment>, public SizeStorage<Counted> {
+    enum class Color {
+        Red = 0,
+        Black,
+    };
+
+    CREATE_BASE_TREETYPE_MEMBERS(RBTreeNode);
+    Color color_;
+    bool dead_;     // Deleted in lazy mode, waiting for Compact()
+
+    RBTreeNode(): left_(nullptr), right_(nullptr),
+                  data_(), parent_(nullptr), color_(Color::Red), dead_(false) {}
+    RBTreeNode(T data): left_(nullptr), right_(nullptr),
+                        data_(std::move(data)), parent_(nullptr), color_(Color::Red), dead_(false) {}
+    RBTreeNode(T data, Color color): left_(nullptr), right_(nullptr),
+                        data_(std::move(data)), parent_(nullptr), color_(color), dead_(false) {}
+
+    inline bool IsRed() const { return color_ == Color::Red; }
+    inline void SetRed() { color_ = Color::Red; }
+    inline void SetBlack() { color_ = Color::Black; }
+    inline void Format(TextWriter& out) const {
+        FormatValue(out, data_);
+        out.Write(color_ == Color::Red ? " R" : " B");
+        if (dead_) out.Write(" X");
+    }
+
+    CREATE_OPERATORS_FOR_TYPE(RBTreeNode);
+};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeAugment<RBTreeNode<T, Augment, Counted>> : CountingUpdater<RBTreeNode<T, Augment, Counted>, Augment> {};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeTombstone<RBTreeNode<T, Augment, Counted>> {
+    static bool IsDead(const RBTreeNode<T, Augment, Counted>* node) { return node->dead_; }
+};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeInvariants<RBTreeNode<T, Augment, Counted>> {
+    static int BlackWeight(const RBTreeNode<T, Augment, Counted>* node) { return node->IsRed() ? 0 : 1; }
+
+    static void CheckRoot(const RBTreeNode<T, Augment, Counted>* node, ValidationReport* report) {
+        if (node->IsRed()) report->Add(ValidationErrorKind::RootColor, node);
+    }
+
+    static void Check(const RBTreeNode<T, Augment, Counted>* node, ValidationReport* report) {
+        if (node->IsRed() &&
+            ((node->left_ && node->left_->IsRed()) ||
+             (node->right_ && node->right_->IsRed()))) {
+            report->Add(ValidationErrorKind::RedRed, node);
+        }
+    }
+};
+
+template<typename T, typename Stats = NoTreeStats, typename Keys = UniqueKeys, typename Augment = NoAugment>
+class RBTree : public BinaryTreeBase<T, RBTreeNode<T, Augment, Keys::kAllowDuplicates>, Stats> {
+ public:
+    RBTree(): lazy_delete_(false), tombstones_(0) {}
+    ~RBTree() {}
+
+    RBTree(RBTree&& other) noexcept;
+    RBTree& operator=(RBTree&& other) noexcept;
+
+    // Same shape and colors, tombstones included, one allocation for all the nodes
+    RBTree Clone() const;
+
+    bool IsTreeValid() const;
+
+    // In lazy mode Delete only flags the node as a tombstone, lookups and
+    // traversals skip it, and the unlinking and rebalancing wait for
+    // Compact(). Inserting the key again revives the slot. Switching the
+    // mode off compacts. Not for augmented trees, the summaries would still
+    // count the tombstones.
+    void SetLazyDelete(bool lazy);
+    bool IsLazyDelete() const { return lazy_delete_; }
+    size_t TombstoneCount() const { return tombstones_; }
+
+    // Unlinks every tombstone, returns how many. When they make up a
+    // quarter of the tree or more, the live nodes are relinked into a
+    // balanced tree in one pass instead.
+    size_t Compact();
+
+ protected:
+    using TreeNode = RBTreeNode<T, Augment, Keys::kAllowDuplicates>;
+    using BaseTreeType = BinaryTreeBase<T, RBTreeNode<T, Augment, Keys::kAllowDuplicates>, Stats>;
+
+    bool lazy_delete_;
+    size_t tombstones_;
+
+    bool AllowsDuplicates() const override { return Keys::kAllowDuplicates; }
+    void OnClear() override { tombstones_ = 0; }
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
+
+    void InsertFixUp(TreeNode* node);
+    void DeleteFixUp(TreeNode* node, TreeNode* parent);
+
+    // Unlinks node from the tree and frees it or the node it swapped keys with
+    void RemoveNode(TreeNode* node);
+    // Puts node in the place of the tombstone dead, which is freed
+    void ReplaceNode(TreeNode* dead, TreeNode* node);
+    TreeNode* FindTombstone(const T& key) const;
+    // Links the nodes, in key order, into a balanced tree with the deepest level red
+    TreeNode* Build(const std::vector<TreeNode*>& nodes);
+};
+
+// Multiset flavour, equal keys are kept in insertion order
+template<typename T, typename Stats = NoTreeStats>
+using MultiRBTree = RBTree<T, Stats, MultiKeys>;
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool RBTree<T, Stats, Keys, Augment>::IsTreeValid() const {
+    return BaseTreeType::Validate().Ok();
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+RBTree<T, Stats, Keys, Augment>::RBTree(RBTree&& other) noexcept:
+    BaseTreeType(std::move(other)), lazy_delete_(other.lazy_delete_), tombstones_(other.tombstones_) {
+    other.tombstones_ = 0;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+RBTree<T, Stats, Keys, Augment>& RBTree<T, Stats, Keys, Augment>::operator=(RBTree&& other) noexcept {
+    if (this == &other) return *this;
+
+    BaseTreeType::operator=(std::move(other));
+    lazy_delete_ = other.lazy_delete_;
+    tombstones_ = other.tombstones_;
+    other.tombstones_ = 0;
+    return *this;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+RBTree<T, Stats, Keys, Augment> RBTree<T, Stats, Keys, Augment>::Clone() const {
+    RBTree copy;
+    BaseTreeType::CloneInto(&copy);
+    copy.lazy_delete_ = lazy_delete_;
+    copy.tombstones_ = tombstones_;
+    return copy;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void RBTree<T, Stats, Keys, Augment>::SetLazyDelete(bool lazy) {
+    if (lazy && Augment::kEnabled) {
+        throw std::runtime_error("Lazy delete on an augmented tree");
+    }
+    if (!lazy) Compact();
+    lazy_delete_ = lazy;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool RBTree<T, Stats, Keys, Augment>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur || Keys::kAllowDuplicates) {
+            // Equal keys go right, after the ones already there
+            cur = cur->right_;
+            is_left = false;
+        } else if (cur->dead_) {
+            ReplaceNode(cur, node);
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    InsertAt(parent, is_left, node);
+    return true;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void RBTree<T, Stats, Keys, Augment>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    BaseTreeType::LinkNode(parent, is_left, node);
+    BaseTreeType::UpdateAugmentPath(node);
+    node->SetRed();
+    InsertFixUp(node);
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename RBTree<T, Stats, Keys, Augment>::TreeNode*
+RBTree<T, Stats, Keys, Augment>::SearchInternal(TreeNode* node, const T& target) const {
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
+
+    BaseTreeType::stats_.OnSearch(depth);
+    if (node && node->dead_) {
+        // A multiset can still hold a live copy elsewhere in the run of equal keys
+        node = (Keys::kAllowDuplicates ? BaseTreeType::LowerBound(target) : nullptr);
+        if (node && target < node->data_) node = nullptr;
+    }
+    return node;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool RBTree<T, Stats, Keys, Augment>::DeleteInternal(TreeNode* node, const T& target) {
+    if (lazy_delete_) {
+        node = BaseTreeType::LowerBound(target);
+        if (!node || target < node->data_) return false;
+        node->dead_ = true;
+        // Subtree sizes count live nodes only
+        BaseTreeType::UpdateAugmentPath(node);
+        ++tombstones_;
+        return true;
+    }
+
+    while (node && !(*node == target)) {
+        BaseTreeType::stats_.OnCompare();
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    if (!node) return false;
+
+    RemoveNode(node);
+    return true;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void RBTree<T, Stats, Keys, Augment>::RemoveNode(TreeNode* node) {
+    if (node->left_ && node->right_) {
+        // Has 2 children: copy the inorder preceding node here and unlink that one instead
+        TreeNode *ino_prev = node->left_;
+        while (ino_prev->right_) {
+            ino_prev = ino_prev->right_;
+        }
+        node->data_ = ino_prev->data_;
+        node->dead_ = ino_prev->dead_;
+        node = ino_prev;
+    }
+
+    // node has at most one child now, splice it out
+    TreeNode *parent = node->parent_;
+    TreeNode *child = (node->left_ ? node->left_ : node->right_);
+    if (!parent) {
+        BaseTreeType::root_ = child;
+    } else {
+        if (parent->left_ == node) parent->left_ = child;
+        else parent->right_ = child;
+    }
+    if (child) {
+        child->parent_ = parent;
+    }
+
+    BaseTreeType::UpdateAugmentPath(parent);
+
+    // Removing a black node breaks the black height of this path
+    if (!node->IsRed()) {
+        DeleteFixUp(child, parent);
+    }
+
+    BaseTreeType::FreeNode(node);
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void RBTree<T, Stats, Keys, Augment>::ReplaceNode(TreeNode* dead, TreeNode* node) {
+    node->color_ = dead->color_;
+    node->left_ = dead->left_;
+    node->right_ = dead->right_;
+    node->parent_ = dead->parent_;
+    if (!node->parent_) BaseTreeType::root_ = node;
+    else if (node->parent_->left_ == dead) node->parent_->left_ = node;
+    else node->parent_->right_ = node;
+    if (node->left_) node->left_->parent_ = node;
+    if (node->right_) node->right_->parent_ = node;
+    BaseTreeType::UpdateAugmentPath(node);
+
+    BaseTreeType::FreeNode(dead);
+    --tombstones_;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename RBTree<T, Stats, Keys, Augment>::TreeNode*
+RBTree<T, Stats, Keys, Augment>::FindTombstone(const T& key) const {
+    TreeNode *node = BaseTreeType::root_;
+    TreeNode *bound = nullptr;
+    while (node) {
+        if (node->data_ < key) {
+            node = node->right_;
+        } else {
+            bound = node;
+            node = node->left_;
+        }
+    }
+    while (bound && !bound->dead_) {
+        bound = BaseTreeType::Successor(bound);
+    }
+    return bound;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+size_t RBTree<T, Stats, Keys, Augment>::Compact() {
+    if (tombstones_ == 0) return 0;
+
+    std::vector<TreeNode*> live;
+    std::vector<TreeNode*> dead;
+    for (TreeNode *node = BaseTreeType::LeftMost(BaseTreeType::root_); node; node = BaseTreeType::Successor(node)) {
+        (node->dead_ ? dead : live).push_back(node);
+    }
+
+    if (dead.size() * 4 >= live.size() + dead.size()) {
+        for (TreeNode *node : dead) {
+            BaseTreeType::FreeNode(node);
+        }
+        BaseTreeType::root_ = Build(live);
+    } else {
+        // Unlinking can move a key into another node, so each tombstone is
+        // looked up again by its key
+        std::vector<T> keys;
+        keys.reserve(dead.size());
+        for (TreeNode *node : dead) {
+            keys.push_back(node->data_);
+        }
+        for (const T& key : keys) {
+            RemoveNode(FindTombstone(key));
+        }
+    }
+
+    tombstones_ = 0;
+    ++BaseTreeType::version_;
+    return dead.size();
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename RBTree<T, Stats, Keys, Augment>::TreeNode*
+RBTree<T, Stats, Keys, Augment>::Build(const std::vector<TreeNode*>& nodes) {
+    if (nodes.empty()) return nullptr;
+
+    // The deepest level of a tree split at the middle is floor(log2(n)).
+    // Every path to a leaf crosses the levels above it, all black.
+    int red_depth = 0;
+    while ((static_cast<size_t>(2) << red_depth) <= nodes.size()) {
+        ++red_depth;
+    }
+
+    // Same range stack as ScapegoatTree::Rebuild, the middle of each range becomes its root
+    struct Range {
+        size_t lo;
+        size_t hi;  // exclusive
+        TreeNode* parent;
+        bool is_left;
+        int depth;
+    };
+    TreeNode *root = nullptr;
+    std::vector<TreeNode*> order;
+    if (NodeAugment<TreeNode>::kEnabled) order.reserve(nodes.size());
+    std::vector<Range> ranges(1, Range{0, nodes.size(), nullptr, false, 0});
+    while (!ranges.empty()) {
+        Range range = ranges.back();
+        ranges.pop_back();
+
+        size_t mid = range.lo + (range.hi - range.lo) / 2;
+        TreeNode *node = nodes[mid];
+        node->parent_ = range.parent;
+        node->left_ = nullptr;
+        node->right_ = nullptr;
+        if (range.depth == red_depth && range.depth > 0) node->SetRed();
+        else node->SetBlack();
+        if (!root) {
+            root = node;
+        } else if (range.is_left) {
+            range.parent->left_ = node;
+        } else {
+            range.parent->right_ = node;
+        }
+        if (NodeAugment<TreeNode>::kEnabled) order.push_back(node);
+
+        if (range.lo < mid) ranges.push_back(Range{range.lo, mid, node, true, range.depth + 1});
+        if (mid + 1 < range.hi) ranges.push_back(Range{mid + 1, range.hi, node, false, range.depth + 1});
+    }
+
+    // Parents were linked before their children, so the reverse order is bottom-up
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        NodeAugment<TreeNode>::Update(*it);
+    }
+    return root;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void RBTree<T, Stats, Keys, Augment>::InsertFixUp(TreeNode* node) {
+    while (true) {
+        BaseTreeType::stats_.OnFixUp();
+        TreeNode *parent = node->parent_;
+        if (parent == nullptr) {
+            // Case 1: Node is root, set it to black;
+            node->SetBlack();
+            return;
+        }
+
+        if (!parent->IsRed()) {
+            // Case 3: Parent node is black, do nothing
+            return;
+        }
+
+        // Case 2: Parent node is red
+        // There must be a grand parent
+        TreeNode* grand_parent = parent->parent_;
+        bool parent_is_left = (parent == grand_parent->left_);
+        bool is_left = (node == parent->left_);
+        TreeNode *uncle = (parent_is_left ? grand_parent->right_ : grand_parent->left_);
+
+        if (uncle && uncle->IsRed()) {
+            // Case 2.1: Uncle node is red
+            // Set parent & uncle to black, set grand parent to red
+            parent->SetBlack();
+            uncle->SetBlack();
+            grand_parent->SetRed();
+
+            // Fixup grandparent
+            node = grand_parent;
+            continue;
+        }
+
+        // Case 2.2: Uncle is black
+        if (parent_is_left && !is_left) {
+            // node is right child, parent is left
+            // left rotate parent, then fix up the old parent
+            BaseTreeType::RotateLeft(parent);
+            node = parent;
+            continue;
+        }
+        if (!parent_is_left && is_left) {
+            // node is left child, parent is right
+            // right rotate parent, then fix up the old parent
+            BaseTreeType::RotateRight(parent);
+            node = parent;
+            continue;
+        }
+
+        // Case 2.3: Uncle is black, node is on the same side as parent
+        // Set parent to black, set grand parent to red
+        parent->SetBlack();
+        grand_parent->SetRed();
+
+        // rotate grand parent
+        if (parent_is_left) {
+            BaseTreeType::RotateRight(grand_parent);
+        } else {
+            BaseTreeType::RotateLeft(grand_parent);
+        }
+        return;
+    }
+}
+
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void RBTree<T, Stats, Keys, Augment>::DeleteFixUp(TreeNode* node, TreeNode *parent) {
+    while (true) {
+        BaseTreeType::stats_.OnFixUp();
+        if (node && node->IsRed()) {
+            // Case 1.1: node is red
+            // Set it black and over
+            node->SetBlack();
+            return;
+        } else if (!parent) {
+            // Case 1.2: node is root
+            return;
+        }
+
+        // Case 2: Node is black or null(also black)
+        bool is_left = (node == parent->left_);
+        TreeNode *sibling = (is_left ? parent->right_ : parent->left_);
+        if (sibling && sibling->IsRed()) {
+            // Case 2.1: sibling node is red
+            sibling->SetBlack();
+            parent->SetRed();
+
+            if (is_left) {
+                BaseTreeType::RotateLeft(parent);
+            } else {
+                BaseTreeType::RotateRight(parent);
+            }
+            continue;
+        }
+
+        TreeNode *near = (sibling ? (is_left ? sibling->left_ : sibling->right_) : nullptr);
+        TreeNode *far = (sibling ? (is_left ? sibling->right_ : sibling->left_) : nullptr);
+        bool near_red = (near && near->IsRed());
+        bool far_red = (far && far->IsRed());
+
+        if (!near_red && !far_red) {
+            // Case 2.2: sibling node is black, and its children are black
+            if (sibling) {
+                sibling->SetRed();
+            }
+
+            node = parent;
+            parent = parent->parent_;
+            continue;
+        }
+
+        if (!far_red) {
+            // Case 2.3: sibling node is black, its far child is black and near is red
+            near->SetBlack();
+            sibling->SetRed();
+            if (is_left) {
+                BaseTreeType::RotateRight(sibling);
+            } else {
+                BaseTreeType::RotateLeft(sibling);
+            }
+            continue;
+        }
+
+        // Case 2.4: sibling node is black, its far child is red and near can be either
+        if (parent->IsRed()) {
+            sibling->SetRed();
+        } else {
+            sibling->SetBlack();
+        }
+
+        parent->SetBlack();
+        far->SetBlack();
+        if (is_left) {
+            BaseTreeType::RotateLeft(parent);
+        } else {
+            BaseTreeType::RotateRight(parent);
+        }
+        return;
+    }
+}
+
+
+// ------------ Interval Tree -------------
+
+// Half-open interval [start, end). Ordered by start, then by end.
+template<typename T>
+struct Interval {
+    T start;
+    T end;
+
+    bool Contains(const T& point) const { return !(point < start) && point < end; }
+    bool Overlaps(const Interval& other) const { return start < other.end && other.start < end; }
+
+    bool operator<(const Interval& rhs) const {
+        return start < rhs.start || (!(rhs.start < start) && end < rhs.end);
+    }
+    bool operator>(const Interval& rhs) const { return rhs < *this; }
+    bool operator<=(const Interval& rhs) const { return !(rhs < *this); }
+    bool operator>=(const Interval& rhs) const { return !(*this < rhs); }
+    bool operator==(const Interval& rhs) const { return !(*this < rhs) && !(rhs < *this); }
+
+    friend std::ostream& operator<<(std::ostream& os, const Interval& interval) {
+        os << "[" << interval.start << ", " << interval.end << ")";
+        return os;
+    }
+};
+
+template<typename T>
+size_t HeapBytes(const Interval<T>& interval) {
+    return HeapBytes(interval.start) + HeapBytes(interval.end);
+}
+
+template<typename T>
+void FormatValue(TextWriter& out, const Interval<T>& interval) {
+    out.Put('[');
+    FormatValue(out, interval.start);
+    out.Write(", ");
+    FormatValue(out, interval.end);
+    out.Put(')');
+}
+
+// Max end point over a subtree of intervals
+template<typename T>
+struct IntervalMaxEnd {
+    static constexpr bool kEnabled = true;
+    using Value = T;
+
+    template<typename Node>
+    static Value Compute(const Node* node) {
+        Value max_end = node->data_.end;
+        if (node->left_ && max_end < node->left_->augment_) max_end = node->left_->augment_;
+        if (node->right_ && max_end < node->right_->augment_) max_end = node->right_->augment_;
+        return max_end;
+    }
+};
+
+// RBTree of intervals augmented with the max end point of every subtree.
+// Equal intervals are all kept.
+template<typename T, typename Stats = NoTreeStats>
+class IntervalTree final : public RBTree<Interval<T>, Stats, MultiKeys, IntervalMaxEnd<T>> {
+ public:
+    using IntervalType = Interval<T>;
+
+    IntervalTree() {}
+    ~IntervalTree() {}
+
+    IntervalTree(IntervalTree&&) = default;
+    IntervalTree& operator=(IntervalTree&&) = default;
+
+    IntervalTree Clone() const;
+
+    // Calls fn(interval) for every stored interval containing point
+    template<typename Fn>
+    void ForEachContaining(const T& point, Fn fn) const;
+    // Calls fn(interval) for every stored interval overlapping [start, end)
+    template<typename Fn>
+    void ForEachOverlapping(const T& start, const T& end, Fn fn) const;
+
+    std::vector<IntervalType> Stab(const T& point) const;
+    std::vector<IntervalType> Overlapping(const T& start, const T& end) const;
+    bool AnyOverlapping(const T& start, const T& end) const;
+
+ protected:
+    using TreeNode = RBTreeNode<Interval<T>, IntervalMaxEnd<T>, true>;
+    using BaseTreeType = BinaryTreeBase<Interval<T>, TreeNode, Stats>;
+
+    // Visits the intervals with start < end_bound (start <= end_bound when
+    // end_inclusive) and end > start_bound, pruning on the subtree max end.
+    // fn returns false to stop early.
+    template<typename Fn>
+    void Query(const T& start_bound, const T& end_bound, bool end_inclusive, Fn fn) const;
+};
+
+template<typename T, typename Stats>
+template<typename Fn>
+void IntervalTree<T, Stats>::Query(const T& start_bound, const T& end_bound, bool end_inclusive, Fn fn) const {
+    std::vector<TreeNode*> stack;
+    if (BaseTreeType::root_) stack.push_back(BaseTreeType::root_);
+    while (!stack.empty()) {
+        TreeNode *node = stack.back();
+        stack.pop_back();
+
+        // Nothing below ends after start_bound
+        BaseTreeType::stats_.OnCompare();
+        if (!(start_bound < node->augment_)) continue;
+
+        if (node->left_) stack.push_back(node->left_);
+
+        // The node and its right subtree start at or after node's start
+        const Interval<T>& interval = node->data_;
+        bool starts_in = end_inclusive ? !(end_bound < interval.start) : interval.start < end_bound;
+        if (!starts_in) continue;
+        if (start_bound < interval.end && !fn(interval)) return;
+        if (node->right_) stack.push_back(node->right_);
+    }
+}
+
+template<typename T, typename Stats>
+IntervalTree<T, Stats> IntervalTree<T, Stats>::Clone() const {
+    IntervalTree copy;
+    BaseTreeType::CloneInto(&copy);
+    return copy;
+}
+
+template<typename T, typename Stats>
+template<typename Fn>
+void IntervalTree<T, Stats>::ForEachContaining(const T& point, Fn fn) const {
+    Query(point, point, true, [&fn](const Interval<T>& interval) {
+        fn(interval);
+        return true;
+    });
+}
+
+template<typename T, typename Stats>
+template<typename Fn>
+void IntervalTree<T, Stats>::ForEachOverlapping(const T& start, const T& end, Fn fn) const {
+    if (!(start < end)) return;
+    Query(start, end, false, [&fn](const Interval<T>& interval) {
+        fn(interval);
+        return true;
+    });
+}
+
+template<typename T, typename Stats>
+std::vector<Interval<T>> IntervalTree<T, Stats>::Stab(const T& point) const {
+    std::vector<Interval<T>> result;
+    ForEachContaining(point, [&result](const Interval<T>& interval) {
+        result.push_back(interval);
+    });
+    return result;
+}
+
+template<typename T, typename Stats>
+std::vector<Interval<T>> IntervalTree<T, Stats>::Overlapping(const T& start, const T& end) const {
+    std::vector<Interval<T>> result;
+    ForEachOverlapping(start, end, [&result](const Interval<T>& interval) {
+        result.push_back(interval);
+    });
+    return result;
+}
+
+template<typename T, typename Stats>
+bool IntervalTree<T, Stats>::AnyOverlapping(const T& start, const T& end) const {
+    bool found = false;
+    if (!(start < end)) return found;
+    Query(start, end, false, [&found](const Interval<T>&) {
+        found = true;
+        return false;
+    });
+    return found;
+}
+
+// ------------ AVL Tree -------------
+
+template<typename T, typename Augment = NoAugment, bool Counted = false>
+struct AVLTreeNode : public AugmentStorage<Augment>, public SizeStorage<Counted> {
+    CREATE_BASE_TREETYPE_MEMBERS(AVLTreeNode);
+    int height_;
+
+    AVLTreeNode(): left_(nullptr), right_(nullptr),
+                  data_(), parent_(nullptr), height_(0) {}
+    AVLTreeNode(T data): left_(nullptr), right_(nullptr),
+                        data_(std::move(data)), parent_(nullptr), height_(0) {}
+    AVLTreeNode(T data, int h): left_(nullptr), right_(nullptr),
+                        data_(std::move(data)), parent_(nullptr), height_(h) {}
+
+    inline int GetHeight() const { return height_; }
+    inline void SetHeight(int h) { height_ = h; }
+
+    inline int GetBalanceFactor() const {
+        int left_height = (left_ ? left_->height_ : 0);
+        int right_height = (right_ ? right_->height_ : 0);
+        return left_height - right_height;
+    }
+
+    inline void Format(TextWriter& out) const {
+        FormatValue(out, data_);
+        out.Put(' ');
+        FormatValue(out, height_);
+    }
+
+    CREATE_OPERATORS_FOR_TYPE(AVLTreeNode);
+};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeAugment<AVLTreeNode<T, Augment, Counted>> : CountingUpdater<AVLTreeNode<T, Augment, Counted>, Augment> {};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeInvariants<AVLTreeNode<T, Augment, Counted>> {
+    static int BlackWeight(const AVLTreeNode<T, Augment, Counted>*) { return 0; }
+    static void CheckRoot(const AVLTreeNode<T, Augment, Counted>*, ValidationReport*) {}
+
+    static void Check(const AVLTreeNode<T, Augment, Counted>* node, ValidationReport* report) {
+        // Checking every node against its children's stored heights is
+        // enough, no subtree heights need to be recomputed
+        int left_height = (node->left_ ? node->left_->height_ : 0);
+        int right_height = (node->right_ ? node->right_->height_ : 0);
+        if (node->height_ != 1 + std::max(left_height, right_height)) {
+            report->Add(ValidationErrorKind::StoredHeight, node);
+        }
+        if (left_height - right_height > 1 || right_height - left_height > 1) {
+            report->Add(ValidationErrorKind::Balance, node);
+        }
+    }
+};
+
+template<typename T, typename Stats = NoTreeStats, typename Keys = UniqueKeys, typename Augment = NoAugment>
+class AVLTree final : public BinaryTreeBase<T, AVLTreeNode<T, Augment, Keys::kAllowDuplicates>, Stats> {
+ public:
+    AVLTree() {}
+    ~AVLTree() {}
+
+    AVLTree(AVLTree&&) = default;
+    AVLTree& operator=(AVLTree&&) = default;
+
+    // Same shape and heights, one allocation for all the nodes
+    AVLTree Clone() const;
+
+    bool IsTreeValid() const;
+
+ protected:
+    using TreeNode = AVLTreeNode<T, Augment, Keys::kAllowDuplicates>;
+    using BaseTreeType = BinaryTreeBase<T, AVLTreeNode<T, Augment, Keys::kAllowDuplicates>, Stats>;
+
+    bool AllowsDuplicates() const override { return Keys::kAllowDuplicates; }
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
+
+    void InsertFixUp(TreeNode* node);
+    void DeleteFixUp(TreeNode* node);
+
+    int GetNodeHeight(TreeNode* node) const;
+
+};
+
+// Multiset flavour, equal keys are kept in insertion order
+template<typename T, typename Stats = NoTreeStats>
+using MultiAVLTree = AVLTree<T, Stats, MultiKeys>;
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+AVLTree<T, Stats, Keys, Augment> AVLTree<T, Stats, Keys, Augment>::Clone() const {
+    AVLTree copy;
+    BaseTreeType::CloneInto(&copy);
+    return copy;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool AVLTree<T, Stats, Keys, Augment>::IsTreeValid() const {
+    return BaseTreeType::Validate().Ok();
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool AVLTree<T, Stats, Keys, Augment>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur || Keys::kAllowDuplicates) {
+            // Equal keys go right, after the ones already there
+            cur = cur->right_;
+            is_left = false;
+        } else {
+            return false;
+        }
+    }
+
+    InsertAt(parent, is_left, node);
+    return true;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void AVLTree<T, Stats, Keys, Augment>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    node->height_ = 1;
+    BaseTreeType::LinkNode(parent, is_left, node);
+    BaseTreeType::UpdateAugmentPath(node);
+    if (parent) {
+        InsertFixUp(parent);
+    }
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename AVLTree<T, Stats, Keys, Augment>::TreeNode*
+AVLTree<T, Stats, Keys, Augment>::SearchInternal(TreeNode* node, const T& target) const {
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
+
+    BaseTreeType::stats_.OnSearch(depth);
+    return node;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool AVLTree<T, Stats, Keys, Augment>::DeleteInternal(TreeNode* node, const T& target) {
+    while (node && !(*node == target)) {
+        BaseTreeType::stats_.OnCompare();
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    if (!node) return false;
+
+    if (node->left_ && node->right_) {
+        // Has 2 children: copy the inorder preceding node here and unlink that one instead
+        TreeNode *ino_prev = node->left_;
+        while (ino_prev->right_) {
+            ino_prev = ino_prev->right_;
+        }
+        node->data_ = ino_prev->data_;
+        node = ino_prev;
+    }
+
+    // node has at most one child now, splice it out
+    TreeNode *parent = node->parent_;
+    TreeNode *child = (node->left_ ? node->left_ : node->right_);
+    if (!parent) {
+        BaseTreeType::root_ = child;
+    } else {
+        if (parent->left_ == node) parent->left_ = child;
+        else parent->right_ = child;
+    }
+    if (child) {
+        child->parent_ = parent;
+    }
+
+    BaseTreeType::FreeNode(node);
+
+    BaseTreeType::UpdateAugmentPath(parent);
+    DeleteFixUp(parent);
+    return true;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void AVLTree<T, Stats, Keys, Augment>::InsertFixUp(TreeNode* node) {
+    while (node) {
+        BaseTreeType::stats_.OnFixUp();
+        int bf = node->GetBalanceFactor();
+        if (bf < -1) {
+            if (node->right_->GetBalanceFactor() >= 1) {
+                node->right_->height_--;
+
+                BaseTreeType::RotateRight(node->right_);
+
+                node->right_->height_++;
+            }
+            BaseTreeType::RotateLeft(node);
+        } else if (bf > 1) {
+            if (node->left_->GetBalanceFactor() <= -1) {
+                node->left_->height_--;
+
+                BaseTreeType::RotateLeft(node->left_);
+
+                node->left_->height_++;
+            }
+            BaseTreeType::RotateRight(node);
+        }
+
+        node->SetHeight(1 + std::max(
+            GetNodeHeight(node->left_), GetNodeHeight(node->right_)));
+
+        // After a rotation node->parent_ is the new subtree root
+        node = node->parent_;
+    }
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void AVLTree<T, Stats, Keys, Augment>::DeleteFixUp(TreeNode* node) {
+    while (node) {
+        BaseTreeType::stats_.OnFixUp();
+        int bf = node->GetBalanceFactor();
+        if (bf < -1) {
+            if (node->right_->GetBalanceFactor() >= 1) {
+                node->right_->height_--;
+
+                BaseTreeType::RotateRight(node->right_);
+
+                node->right_->height_++;
+            }
+            BaseTreeType::RotateLeft(node);
+        } else if (bf > 1) {
+            if (node->left_->GetBalanceFactor() <= -1) {
+                node->left_->height_--;
+
+                BaseTreeType::RotateLeft(node->left_);
+
+                node->left_->height_++;
+            }
+            BaseTreeType::RotateRight(node);
+        }
+
+        node->SetHeight(1 + std::max(
+            GetNodeHeight(node->left_), GetNodeHeight(node->right_)));
+
+        // After a rotation node->parent_ is the new subtree root
+        node = node->parent_;
+    }
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+int AVLTree<T, Stats, Keys, Augment>::GetNodeHeight(TreeNode* node) const {
+    if (!node) return 0;
+
+    return node->GetHeight();
+}
+
+// ------------ AA Tree -------------
+
+// Red black tree where only right children can be red, kept as a level
+// per node. A red child sits on its parent's level. Every imbalance is
+// repaired by the same two steps, Skew (rotate a same-level left child up)
+// and Split (rotate up over two same-level right children), so there are
+// no mirrored cases to branch between.
+template<typename T, typename Augment = NoAugment, bool Counted = false>
+struct AATreeNode : public AugmentStorage<Augment>, public SizeStorage<Counted> {
+    CREATE_BASE_TREETYPE_MEMBERS(AATreeNode);
+    int level_;     // 1 at the leaves
+
+    AATreeNode(): left_(nullptr), right_(nullptr),
+                  data_(), parent_(nullptr), level_(1) {}
+    AATreeNode(T data): left_(nullptr), right_(nullptr),
+                        data_(std::move(data)), parent_(nullptr), level_(1) {}
+    AATreeNode(T data, int level): left_(nullptr), right_(nullptr),
+                        data_(std::move(data)), parent_(nullptr), level_(level) {}
+
+    inline void Format(TextWriter& out) const {
+        FormatValue(out, data_);
+        out.Put(' ');
+        FormatValue(out, level_);
+    }
+
+    CREATE_OPERATORS_FOR_TYPE(AATreeNode);
+};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeAugment<AATreeNode<T, Augment, Counted>> : CountingUpdater<AATreeNode<T, Augment, Counted>, Augment> {};
+
+template<typename T, typename Augment, bool Counted>
+struct NodeInvariants<AATreeNode<T, Augment, Counted>> {
+    static int BlackWeight(const AATreeNode<T, Augment, Counted>*) { return 0; }
+    static void CheckRoot(const AATreeNode<T, Augment, Counted>*, ValidationReport*) {}
+
+    static void Check(const AATreeNode<T, Augment, Counted>* node, ValidationReport* report) {
+        // A missing child counts as level 0, so this also catches a node
+        // above level 1 with a child missing
+        int level = node->level_;
+        int left_level = (node->left_ ? node->left_->level_ : 0);
+        int right_level = (node->right_ ? node->right_->level_ : 0);
+        int right_right_level = (node->right_ && node->right_->right_ ? node->right_->right_->level_ : 0);
+        if (left_level != level - 1 ||
+            (right_level != level && right_level != level - 1) ||
+            right_right_level >= level) {
+            report->Add(ValidationErrorKind::Level, node);
+        }
+    }
+};
+
+template<typename T, typename Stats = NoTreeStats, typename Keys = UniqueKeys, typename Augment = NoAugment>
+class AATree final : public BinaryTreeBase<T, AATreeNode<T, Augment, Keys::kAllowDuplicates>, Stats> {
+ public:
+    AATree() {}
+    ~AATree() {}
+
+    AATree(AATree&&) = default;
+    AATree& operator=(AATree&&) = default;
+
+    // Same shape and levels, one allocation for all the nodes
+    AATree Clone() const;
+
+    bool IsTreeValid() const;
+
+ protected:
+    using TreeNode = AATreeNode<T, Augment, Keys::kAllowDuplicates>;
+    using BaseTreeType = BinaryTreeBase<T, AATreeNode<T, Augment, Keys::kAllowDuplicates>, Stats>;
+
+    bool AllowsDuplicates() const override { return Keys::kAllowDuplicates; }
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
+
+    void InsertFixUp(TreeNode* node);
+    void DeleteFixUp(TreeNode* node);
+
+    // Both return the root of the subtree node was the root of
+    TreeNode* Skew(TreeNode* node);
+    TreeNode* Split(TreeNode* node);
+
+    static int Level(const TreeNode* node) { return node ? node->level_ : 0; }
+};
+
+// Multiset flavour, equal keys are kept in insertion order
+template<typename T, typename Stats = NoTreeStats>
+using MultiAATree = AATree<T, Stats, MultiKeys>;
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+AATree<T, Stats, Keys, Augment> AATree<T, Stats, Keys, Augment>::Clone() const {
+    AATree copy;
+    BaseTreeType::CloneInto(&copy);
+    return copy;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool AATree<T, Stats, Keys, Augment>::IsTreeValid() const {
+    return BaseTreeType::Validate().Ok();
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool AATree<T, Stats, Keys, Augment>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur || Keys::kAllowDuplicates) {
+            // Equal keys go right, after the ones already there
+            cur = cur->right_;
+            is_left = false;
+        } else {
+            return false;
+        }
+    }
+
+    InsertAt(parent, is_left, node);
+    return true;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void AATree<T, Stats, Keys, Augment>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    node->level_ = 1;
+    BaseTreeType::LinkNode(parent, is_left, node);
+    BaseTreeType::UpdateAugmentPath(node);
+    if (parent) {
+        InsertFixUp(parent);
+    }
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename AATree<T, Stats, Keys, Augment>::TreeNode*
+AATree<T, Stats, Keys, Augment>::SearchInternal(TreeNode* node, const T& target) const {
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
+
+    BaseTreeType::stats_.OnSearch(depth);
+    return node;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+bool AATree<T, Stats, Keys, Augment>::DeleteInternal(TreeNode* node, const T& target) {
+    while (node && !(*node == target)) {
+        BaseTreeType::stats_.OnCompare();
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    if (!node) return false;
+
+    if (node->left_ && node->right_) {
+        // Has 2 children: copy the inorder preceding node here and unlink that one instead
+        TreeNode *ino_prev = node->left_;
+        while (ino_prev->right_) {
+            ino_prev = ino_prev->right_;
+        }
+        node->data_ = ino_prev->data_;
+        node = ino_prev;
+    }
+
+    // node is on level 1 now with at most a right child, splice it out
+    TreeNode *parent = node->parent_;
+    TreeNode *child = (node->left_ ? node->left_ : node->right_);
+    if (!parent) {
+        BaseTreeType::root_ = child;
+    } else {
+        if (parent->left_ == node) parent->left_ = child;
+        else parent->right_ = child;
+    }
+    if (child) {
+        child->parent_ = parent;
+    }
+
+    BaseTreeType::FreeNode(node);
+
+    BaseTreeType::UpdateAugmentPath(parent);
+    DeleteFixUp(parent);
+    return true;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename AATree<T, Stats, Keys, Augment>::TreeNode*
+AATree<T, Stats, Keys, Augment>::Skew(TreeNode* node) {
+    if (!node->left_ || node->left_->level_ != node->level_) return node;
+
+    BaseTreeType::RotateRight(node);
+    return node->parent_;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+typename AATree<T, Stats, Keys, Augment>::TreeNode*
+AATree<T, Stats, Keys, Augment>::Split(TreeNode* node) {
+    TreeNode *right = node->right_;
+    if (!right || !right->right_ || right->right_->level_ != node->level_) return node;
+
+    BaseTreeType::RotateLeft(node);
+    ++right->level_;
+    return right;
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void AATree<T, Stats, Keys, Augment>::InsertFixUp(TreeNode* node) {
+    // A quiet step can still leave its parent with two same-level right
+    // children, so the walk stops after two quiet steps in a row
+    int quiet = 0;
+    while (node && quiet < 2) {
+        BaseTreeType::stats_.OnFixUp();
+        TreeNode *skewed = Skew(node);
+        TreeNode *top = Split(skewed);
+        quiet = (skewed == node && top == node ? quiet + 1 : 0);
+        node = top->parent_;
+    }
+}
+
+template<typename T, typename Stats, typename Keys, typename Augment>
+void AATree<T, Stats, Keys, Augment>::DeleteFixUp(TreeNode* node) {
+    // Same stop rule as insert: after two steps in a row that neither lower
+    // a level nor rotate, nothing above can have changed
+    int quiet = 0;
+    while (node && quiet < 2) {
+        BaseTreeType::stats_.OnFixUp();
+        uint64_t version = BaseTreeType::version_;
+        bool lowered = false;
+        int level = std::min(Level(node->left_), Level(node->right_)) + 1;
+        if (level < node->level_) {
+            node->level_ = level;
+            if (node->right_ && node->right_->level_ > level) {
+                node->right_->level_ = level;
+            }
+            lowered = true;
+        }
+
+        // Lowering the level can leave up to three nodes on it along the
+        // right spine, each skewed and then split back into shape
+        node = Skew(node);
+        if (node->right_) {
+            Skew(node->right_);
+            if (node->right_->right_) Skew(node->right_->right_);
+        }
+        node = Split(node);
+        if (node->right_) Split(node->right_);
+
+        quiet = (!lowered && version == BaseTreeType::version_ ? quiet + 1 : 0);
+        node = node->parent_;
+    }
+}
+
+// ------------ Treap -------------
+
+template<typename T>
+struct TreapNode {
+    CREATE_BASE_TREETYPE_MEMBERS(TreapNode);
+    uint32_t priority_;
+
+    TreapNode(): left_(nullptr), right_(nullptr),
+                 data_(), parent_(nullptr), priority_(0) {}
+    TreapNode(T data): left_(nullptr), right_(nullptr),
+                       data_(std::move(data)), parent_(nullptr), priority_(0) {}
+    TreapNode(T data, uint32_t priority): left_(nullptr), right_(nullptr),
+                       data_(std::move(data)), parent_(nullptr), priority_(priority) {}
+
+    inline void Format(TextWriter& out) const {
+        FormatValue(out, data_);
+        out.Put(' ');
+        FormatValue(out, priority_);
+    }
+
+    CREATE_OPERATORS_FOR_TYPE(TreapNode);
+};
+
+// Xorshift32, enough randomness for treap priorities
+class TreapPriorityGenerator {
+ public:
+    explicit TreapPriorityGenerator(uint32_t seed): state_(seed ? seed : 0x9e3779b9u) {}
+
+    inline uint32_t Next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+ private:
+    uint32_t state_;
+};
+
+template<typename T>
+struct NodeInvariants<TreapNode<T>> {
+    static int BlackWeight(const TreapNode<T>*) { return 0; }
+    static void CheckRoot(const TreapNode<T>*, ValidationReport*) {}
+
+    static void Check(const TreapNode<T>* node, ValidationReport* report) {
+        if ((node->left_ && node->left_->priority_ > node->priority_) ||
+            (node->right_ && node->right_->priority_ > node->priority_)) {
+            report->Add(ValidationErrorKind::HeapOrder, node);
+        }
+    }
+};
+
+template<typename T, typename Stats = NoTreeStats>
+class Treap final : public BinaryTreeBase<T, TreapNode<T>, Stats> {
+ public:
+    explicit Treap(uint32_t seed = 0x9e3779b9u): priorities_(seed) {}
+    ~Treap() {}
+
+    Treap(Treap&&) = default;
+    Treap& operator=(Treap&&) = default;
+
+    // Same shape and priorities, one allocation for all the nodes
+    Treap Clone() const;
+
+    // Moves all keys >= key into greater, which must be empty
+    void Split(const T& key, Treap* greater);
+    // Appends all keys of other, which must be greater than every key here
+    void Merge(Treap& other);
+
+    bool IsTreeValid() const;
+
+ protected:
+    using TreeNode = TreapNode<T>;
+    using BaseTreeType = BinaryTreeBase<T, TreapNode<T>, Stats>;
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
+
+    static TreeNode* MergeInternal(TreeNode* left, TreeNode* right);
+
+    TreapPriorityGenerator priorities_;
+
+};
+
+template<typename T, typename Stats>
+bool Treap<T, Stats>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur) {
+            cur = cur->right_;
+            is_left = false;
+        } else {
+            return false;
+        }
+    }
+
+    InsertAt(parent, is_left, node);
+    return true;
+}
+
+template<typename T, typename Stats>
+void Treap<T, Stats>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    node->priority_ = priorities_.Next();
+    BaseTreeType::LinkNode(parent, is_left, node);
+
+    // Rotate up until the heap order on priorities holds
+    while (node->parent_ && node->parent_->priority_ < node->priority_) {
+        BaseTreeType::stats_.OnFixUp();
+        if (node->parent_->left_ == node) {
+            BaseTreeType::RotateRight(node->parent_);
+        } else {
+            BaseTreeType::RotateLeft(node->parent_);
+        }
+    }
+}
+
+template<typename T, typename Stats>
+typename Treap<T, Stats>::TreeNode*
+Treap<T, Stats>::SearchInternal(TreeNode* node, const T& target) const {
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
+
+    BaseTreeType::stats_.OnSearch(depth);
+    return node;
+}
+
+template<typename T, typename Stats>
+bool Treap<T, Stats>::DeleteInternal(TreeNode* node, const T& target) {
+    while (node && !(*node == target)) {
+        BaseTreeType::stats_.OnCompare();
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    if (!node) return false;
+
+    // Rotate down towards the child with higher priority until at most one child is left
+    while (node->left_ && node->right_) {
+        BaseTreeType::stats_.OnFixUp();
+        if (node->left_->priority_ > node->right_->priority_) {
+            BaseTreeType::RotateRight(node);
+        } else {
+            BaseTreeType::RotateLeft(node);
+        }
+    }
+
+    TreeNode *parent = node->parent_;
+    TreeNode *child = (node->left_ ? node->left_ : node->right_);
+    if (!parent) {
+        BaseTreeType::root_ = child;
+    } else {
+        if (parent->left_ == node) parent->left_ = child;
+        else parent->right_ = child;
+    }
+    if (child) {
+        child->parent_ = parent;
+    }
+
+    BaseTreeType::FreeNode(node);
+    return true;
+}
+
+template<typename T, typename Stats>
+void Treap<T, Stats>::Split(const T& key, Treap* greater) {
+    if (!greater || greater == this) {
+        throw std::runtime_error("Treap Split Failed, with invalid destination");
+    }
+    if (greater->root_) {
+        throw std::runtime_error("Treap Split Failed, destination is not empty");
+    }
+    if (greater->resource_ != BaseTreeType::resource_) {
+        throw std::runtime_error("Treap Split Failed, destination uses another memory resource");
+    }
+
+    // Walk down once, hanging each node on the right spine of the lower
+    // part or the left spine of the upper part
+    TreeNode *lower = nullptr, *upper = nullptr;
+    TreeNode **lower_slot = &lower, **upper_slot = &upper;
+    TreeNode *lower_parent = nullptr, *upper_parent = nullptr;
+    TreeNode *cur = BaseTreeType::root_;
+    while (cur) {
+        TreeNode *next = nullptr;
+        if (*cur < key) {
+            *lower_slot = cur;
+            cur->parent_ = lower_parent;
+            lower_parent = cur;
+            next = cur->right_;
+            lower_slot = &(cur->right_);
+        } else {
+            *upper_slot = cur;
+            cur->parent_ = upper_parent;
+            upper_parent = cur;
+            next = cur->left_;
+            upper_slot = &(cur->left_);
+        }
+        cur = next;
+    }
+    *lower_slot = nullptr;
+    *upper_slot = nullptr;
+
+    BaseTreeType::root_ = lower;
+    greater->root_ = upper;
+    BaseTreeType::ShareCloneBlocks(greater);
+    ++BaseTreeType::version_;
+    ++greater->version_;
+}
+
+template<typename T, typename Stats>
+void Treap<T, Stats>::Merge(Treap& other) {
+    if (&other == this || !other.root_) return;
+    if (other.resource_ != BaseTreeType::resource_) {
+        throw std::runtime_error("Treap Merge Failed, trees use different memory resources");
+    }
+
+    if (BaseTreeType::root_) {
+        TreeNode *max_node = BaseTreeType::root_;
+        while (max_node->right_) max_node = max_node->right_;
+        TreeNode *min_node = other.root_;
+        while (min_node->left_) min_node = min_node->left_;
+        if (!(*max_node < *min_node)) {
+            throw std::runtime_error("Treap Merge Failed, key ranges overlap");
+        }
+    }
+
+    BaseTreeType::root_ = MergeInternal(BaseTreeType::root_, other.root_);
+    other.root_ = nullptr;
+    other.ShareCloneBlocks(this);
+    other.clone_blocks_.clear();
+    ++BaseTreeType::version_;
+    ++other.version_;
+}
+
+template<typename T, typename Stats>
+typename Treap<T, Stats>::TreeNode* Treap<T, Stats>::MergeInternal(TreeNode* left, TreeNode* right) {
+    // Zip the right spine of left with the left spine of right by priority
+    TreeNode *root = nullptr;
+    TreeNode **slot = &root;
+    TreeNode *parent = nullptr;
+    while (left && right) {
+        if (left->priority_ > right->priority_) {
+            *slot = left;
+            left->parent_ = parent;
+            parent = left;
+            slot = &(left->right_);
+            left = left->right_;
+        } else {
+            *slot = right;
+            right->parent_ = parent;
+            parent = right;
+            slot = &(right->left_);
+            right = right->left_;
+        }
+    }
 
-    // Case 3: Parent node is black, do nothing
-    return;
+    TreeNode *rest = (left ? left : right);
+    *slot = rest;
+    if (rest) rest->parent_ = parent;
+    return root;
 }
 
+template<typename T, typename Stats>
+Treap<T, Stats> Treap<T, Stats>::Clone() const {
+    Treap copy;
+    BaseTreeType::CloneInto(&copy);
+    copy.priorities_ = priorities_;
+    return copy;
+}
+
+template<typename T, typename Stats>
+bool Treap<T, Stats>::IsTreeValid() const {
+    return BaseTreeType::Validate().Ok();
+}
+
+// ------------ Implicit Treap -------------
 
 template<typename T>
-void RBTree<T>::DeleteFixUp(TreeNode* node, TreeNode *parent) {
-    if (node && node->IsRed()) {
-        // Case 1.1: node is red
-        // Set it black and over 
-        node->SetBlack();
-        return;
-    } else if (!parent) {
-        // Case 1.2: node is root
-        return;
+struct ImplicitTreapNode {
+    CREATE_BASE_TREETYPE_MEMBERS(ImplicitTreapNode);
+    uint32_t priority_;
+    size_t size_;
+
+    ImplicitTreapNode(T data, uint32_t priority): left_(nullptr), right_(nullptr),
+                       data_(std::move(data)), parent_(nullptr), priority_(priority), size_(1) {}
+
+    inline void Update() {
+        size_ = 1 + (left_ ? left_->size_ : 0) + (right_ ? right_->size_ : 0);
     }
+};
 
-    // Case 2: Node is black or null(also black)
-    TreeNode *sibling = (parent->left_ == node ? parent->right_ : parent->left_);
-    bool is_left = (node == parent->left_);
-    if (is_left) {
-        if (sibling && sibling->IsRed()) {
-            // Case 2.1: sibling node is red
-            sibling->SetBlack();
-            parent->SetRed();
+// A sequence keyed by position instead of value, with O(log n) expected
+// insert, erase, split and concatenation anywhere in the sequence
+template<typename T>
+class ImplicitTreap {
+ public:
+    using TreeNodeType = ImplicitTreapNode<T>;
 
-            LeftRotate(parent, &(BaseTreeType::root_));
+    explicit ImplicitTreap(uint32_t seed = 0x9e3779b9u): root_(nullptr), priorities_(seed) {}
 
-            DeleteFixUp(node, parent);
-        } else {
-            if (!sibling ||
-                ((!sibling->left_ || !sibling->left_->IsRed()) &&
-                 (!sibling->right_ || !sibling->right_->IsRed()))) {
-                // Case 2.2: sibling node is black, and its children are black
-                if (sibling) {
-                    sibling->SetRed();
-                }
+    ImplicitTreap(const ImplicitTreap&) = delete;
+    ImplicitTreap& operator=(const ImplicitTreap&) = delete;
 
-                DeleteFixUp(parent, parent->parent_);
-            } else if (!sibling->right_ || !sibling->right_->IsRed()) {
-                // Case 2.3: sibling node is black, its right child is black and left is red
-                sibling->left_->SetBlack();
-                sibling->SetRed();
-                RightRotate(sibling, &(BaseTreeType::root_));
-                
-                DeleteFixUp(node, parent);
-            } else {
-                // Case 2.4: sibling node is black, its right child is red and left can be either
-                if (parent->IsRed()) {
-                    sibling->SetRed();
-                } else {
-                    sibling->SetBlack();
-                }
+    // Moves take the nodes, the source is left empty
+    ImplicitTreap(ImplicitTreap&& other) noexcept: root_(other.root_), priorities_(other.priorities_) {
+        other.root_ = nullptr;
+    }
+    ImplicitTreap& operator=(ImplicitTreap&& other) noexcept;
 
-                parent->SetBlack();
-                sibling->right_->SetBlack();
-                LeftRotate(parent, &(BaseTreeType::root_));
+    ~ImplicitTreap() {
+        Destroy(root_);
+    }
 
-                return;
-            }
-        }
+    // Same sequence, shape and priorities
+    ImplicitTreap Clone() const;
 
-    } else {
-        if (sibling && sibling->IsRed()) {
-            // Case 2.1: sibling node is red
-            sibling->SetBlack();
-            parent->SetRed();
+    size_t Size() const { return root_ ? root_->size_ : 0; }
 
-            RightRotate(parent, &(BaseTreeType::root_));
+    T& At(size_t pos);
+    const T& At(size_t pos) const;
 
-            DeleteFixUp(node, parent);
-        } else {
-            if (!sibling ||
-                ((!sibling->left_ || !sibling->left_->IsRed()) &&
-                 (!sibling->right_ || !sibling->right_->IsRed()))) {
-                // Case 2.2: sibling node is black, and its children are black
-                if (sibling) {
-                    sibling->SetRed();
-                }
+    void Insert(size_t pos, const T& data);
+    void PushBack(const T& data) { Insert(Size(), data); }
+    void Erase(size_t pos);
 
-                DeleteFixUp(parent, parent->parent_);
-            } else if (!sibling->left_ || !sibling->left_->IsRed()) {
-                // Case 2.3: sibling node is black, its left child is black and right is red
-                sibling->right_->SetBlack();
-                sibling->SetRed();
-                LeftRotate(sibling, &(BaseTreeType::root_));
-                
-                DeleteFixUp(node, parent);
-            } else {
-                // Case 2.4: sibling node is black, its right child is red and left can be either
-                if (parent->IsRed()) {
-                    sibling->SetRed();
-                } else {
-                    sibling->SetBlack();
-                }
+    // Moves the elements at [pos, Size()) to the front of tail, which must be empty
+    void Split(size_t pos, ImplicitTreap* tail);
+    // Appends all elements of other
+    void Merge(ImplicitTreap& other);
 
-                parent->SetBlack();
-                sibling->left_->SetBlack();
-                RightRotate(parent, &(BaseTreeType::root_));
+    void Clear();
+    std::vector<T> ToVector() const;
 
-                return;
-            }
-        }
+    // Same accounting as the search trees, O(n)
+    TreeMemoryUsage MemoryUsage() const;
 
-    }
+ protected:
+    using TreeNode = ImplicitTreapNode<T>;
 
-}
+    TreeNode *root_;
+    TreapPriorityGenerator priorities_;
 
+    TreeNode* NodeAt(size_t pos) const;
 
-// ------------ AVL Tree -------------
+    static void SplitInternal(TreeNode* node, size_t pos, TreeNode** lower, TreeNode** upper);
+    static TreeNode* MergeInternal(TreeNode* left, TreeNode* right);
+    static void UpdateToRoot(TreeNode* node);
+    static void Destroy(TreeNode* node);
+};
 
 template<typename T>
-struct AVLTreeNode {
-    int height_;
+ImplicitTreap<T>& ImplicitTreap<T>::operator=(ImplicitTreap&& other) noexcept {
+    if (this == &other) return *this;
 
-    CREATE_BASE_TREETYPE_MEMBERS(AVLTreeNode);
+    Destroy(root_);
+    root_ = other.root_;
+    priorities_ = other.priorities_;
+    other.root_ = nullptr;
+    return *this;
+}
 
-    AVLTreeNode(): height_(0), data_(),
-                  left_(nullptr), right_(nullptr),
-                  parent_(nullptr) {}
-    AVLTreeNode(T data): height_(0), data_(data),
-                        left_(nullptr), right_(nullptr),
-                        parent_(nullptr) {}
-    AVLTreeNode(T data, int h): height_(h), data_(data),
-                        left_(nullptr), right_(nullptr),
-                        parent_(nullptr) {}
+template<typename T>
+ImplicitTreap<T> ImplicitTreap<T>::Clone() const {
+    ImplicitTreap copy;
+    copy.priorities_ = priorities_;
+    if (!root_) return copy;
+
+    // Every node is linked into copy as soon as it exists, so a throwing
+    // copy of T leaves a partial tree that copy's destructor frees
+    auto clone = [](const TreeNode* node, TreeNode* parent) -> TreeNode* {
+        TreeNode *cloned = new TreeNode(node->data_, node->priority_);
+        cloned->size_ = node->size_;
+        cloned->parent_ = parent;
+        return cloned;
+    };
+    copy.root_ = clone(root_, nullptr);
+
+    std::vector<std::pair<const TreeNode*, TreeNode*>> stack;
+    stack.emplace_back(root_, copy.root_);
+    while (!stack.empty()) {
+        const TreeNode *node = stack.back().first;
+        TreeNode *cloned = stack.back().second;
+        stack.pop_back();
+        if (node->left_) {
+            cloned->left_ = clone(node->left_, cloned);
+            stack.emplace_back(node->left_, cloned->left_);
+        }
+        if (node->right_) {
+            cloned->right_ = clone(node->right_, cloned);
+            stack.emplace_back(node->right_, cloned->right_);
+        }
+    }
+    return copy;
+}
 
-    inline int GetHeight() const { return height_; }
-    inline void SetHeight(int h) { height_ = h; }
+template<typename T>
+typename ImplicitTreap<T>::TreeNode* ImplicitTreap<T>::NodeAt(size_t pos) const {
+    if (pos >= Size()) {
+        throw std::out_of_range("ImplicitTreap position out of range");
+    }
 
-    inline int GetBalanceFactor() const {
-        int left_height = (left_ ? left_->height_ : 0);
-        int right_height = (right_ ? right_->height_ : 0);
-        return left_height - right_height;
+    TreeNode *node = root_;
+    while (true) {
+        size_t left_size = (node->left_ ? node->left_->size_ : 0);
+        if (pos < left_size) {
+            node = node->left_;
+        } else if (pos == left_size) {
+            return node;
+        } else {
+            pos -= left_size + 1;
+            node = node->right_;
+        }
     }
+}
+
+template<typename T>
+T& ImplicitTreap<T>::At(size_t pos) {
+    return NodeAt(pos)->data_;
+}
+
+template<typename T>
+const T& ImplicitTreap<T>::At(size_t pos) const {
+    return NodeAt(pos)->data_;
+}
 
-    inline std::string ToString() const {
-        return std::to_string(data_) + " " + std::to_string(height_);
+template<typename T>
+void ImplicitTreap<T>::Insert(size_t pos, const T& data) {
+    if (pos > Size()) {
+        throw std::out_of_range("ImplicitTreap position out of range");
     }
 
-    CREATE_OPERATORS_FOR_TYPE(AVLTreeNode);
-};
+    // Copy the value before touching the sequence, split and merge can't
+    // throw, so a throwing copy leaves everything as it was
+    TreeNode *node = new TreeNode(data, 0);
+    node->priority_ = priorities_.Next();
+
+    TreeNode *lower = nullptr, *upper = nullptr;
+    SplitInternal(root_, pos, &lower, &upper);
+    root_ = MergeInternal(MergeInternal(lower, node), upper);
+}
 
 template<typename T>
-class AVLTree final : public BinaryTreeBase<T, AVLTreeNode<T>> {
- public:
-    AVLTree() {}
-    ~AVLTree() {}
+void ImplicitTreap<T>::Erase(size_t pos) {
+    if (pos >= Size()) {
+        throw std::out_of_range("ImplicitTreap position out of range");
+    }
 
-    bool IsTreeValid() const;
+    TreeNode *lower = nullptr, *rest = nullptr, *node = nullptr, *upper = nullptr;
+    SplitInternal(root_, pos, &lower, &rest);
+    SplitInternal(rest, 1, &node, &upper);
+    delete node;
+    root_ = MergeInternal(lower, upper);
+}
 
- protected:
-    using TreeNode = AVLTreeNode<T>;
-    using BaseTreeType = BinaryTreeBase<T, AVLTreeNode<T>>;
+template<typename T>
+void ImplicitTreap<T>::Split(size_t pos, ImplicitTreap* tail) {
+    if (!tail || tail == this) {
+        throw std::runtime_error("ImplicitTreap Split Failed, with invalid destination");
+    }
+    if (tail->root_) {
+        throw std::runtime_error("ImplicitTreap Split Failed, destination is not empty");
+    }
+    if (pos > Size()) {
+        throw std::out_of_range("ImplicitTreap position out of range");
+    }
 
-    bool InsertRecursively(TreeNode*& parent, TreeNode* node) override;
-    TreeNode* SearchRecursively(TreeNode* node, const T& target) const override;
-    bool DeleteRecursively(TreeNode* node, const T& target) override;
+    TreeNode *lower = nullptr, *upper = nullptr;
+    SplitInternal(root_, pos, &lower, &upper);
+    root_ = lower;
+    tail->root_ = upper;
+}
 
-    void InsertFixUp(TreeNode* node);
-    void DeleteFixUp(TreeNode* node);
+template<typename T>
+void ImplicitTreap<T>::Merge(ImplicitTreap& other) {
+    if (&other == this) return;
 
-    int GetNodeHeight(TreeNode* node) const;
-    bool CheckTreeBalanced(TreeNode* node) const;
+    root_ = MergeInternal(root_, other.root_);
+    other.root_ = nullptr;
+}
 
-};
+template<typename T>
+void ImplicitTreap<T>::Clear() {
+    Destroy(root_);
+    root_ = nullptr;
+}
 
 template<typename T>
-bool AVLTree<T>::IsTreeValid() const {
-    return CheckTreeBalanced(BaseTreeType::root_);
+std::vector<T> ImplicitTreap<T>::ToVector() const {
+    std::vector<T> result;
+    result.reserve(Size());
+
+    std::vector<TreeNode*> stack;
+    TreeNode *node = root_;
+    while (node || !stack.empty()) {
+        while (node) {
+            stack.push_back(node);
+            node = node->left_;
+        }
+        node = stack.back();
+        stack.pop_back();
+        result.push_back(node->data_);
+        node = node->right_;
+    }
+    return result;
 }
 
 template<typename T>
-bool AVLTree<T>::InsertRecursively(TreeNode*& parent, TreeNode* node) {
-    if (!parent) {
-        parent = node;
-        node->height_ = 1;
-        return true;
+TreeMemoryUsage ImplicitTreap<T>::MemoryUsage() const {
+    TreeMemoryUsage usage;
+    usage.node_size = sizeof(TreeNode);
+    usage.nodes = Size();
+    usage.node_bytes = usage.nodes * sizeof(TreeNode);
+    usage.allocator_slack = usage.nodes * (HeapAllocationSize(sizeof(TreeNode)) - sizeof(TreeNode));
+
+    std::vector<TreeNode*> stack;
+    if (root_) stack.push_back(root_);
+    while (!stack.empty()) {
+        TreeNode *node = stack.back();
+        stack.pop_back();
+        usage.payload_bytes += HeapBytes(node->data_);
+        if (node->left_) stack.push_back(node->left_);
+        if (node->right_) stack.push_back(node->right_);
     }
+    return usage;
+}
 
-    if (*node < *parent) {
-        if (parent->left_) {
-            return InsertRecursively(parent->left_, node);
+template<typename T>
+void ImplicitTreap<T>::SplitInternal(TreeNode* node, size_t pos, TreeNode** lower, TreeNode** upper) {
+    // Same single pass as Treap<T, Stats>::Split, ranking by subtree sizes.
+    // Only the nodes on the two spines change children, their sizes are
+    // refreshed bottom-up afterwards.
+    TreeNode **lower_slot = lower, **upper_slot = upper;
+    TreeNode *lower_parent = nullptr, *upper_parent = nullptr;
+    while (node) {
+        size_t left_size = (node->left_ ? node->left_->size_ : 0);
+        TreeNode *next = nullptr;
+        if (pos > left_size) {
+            pos -= left_size + 1;
+            *lower_slot = node;
+            node->parent_ = lower_parent;
+            lower_parent = node;
+            next = node->right_;
+            lower_slot = &(node->right_);
+        } else {
+            *upper_slot = node;
+            node->parent_ = upper_parent;
+            upper_parent = node;
+            next = node->left_;
+            upper_slot = &(node->left_);
         }
+        node = next;
+    }
+    *lower_slot = nullptr;
+    *upper_slot = nullptr;
 
-        node->parent_ = parent;
-        parent->left_ = node;
-        node->height_ = 1;
+    UpdateToRoot(lower_parent);
+    UpdateToRoot(upper_parent);
+}
 
-        InsertFixUp(parent);
-        return true;
-    } else if (*node > *parent) {
-        if (parent->right_) {
-            return InsertRecursively(parent->right_, node);
+template<typename T>
+typename ImplicitTreap<T>::TreeNode* ImplicitTreap<T>::MergeInternal(TreeNode* left, TreeNode* right) {
+    TreeNode *root = nullptr;
+    TreeNode **slot = &root;
+    TreeNode *parent = nullptr;
+    while (left && right) {
+        if (left->priority_ > right->priority_) {
+            *slot = left;
+            left->parent_ = parent;
+            parent = left;
+            slot = &(left->right_);
+            left = left->right_;
+        } else {
+            *slot = right;
+            right->parent_ = parent;
+            parent = right;
+            slot = &(right->left_);
+            right = right->left_;
         }
+    }
 
-        node->parent_ = parent;
-        parent->right_ = node;
-        node->height_ = 1;
+    TreeNode *rest = (left ? left : right);
+    *slot = rest;
+    if (rest) rest->parent_ = parent;
 
-        InsertFixUp(parent);
-        return true;
-    }
-    return false;
+    UpdateToRoot(parent);
+    return root;
 }
 
 template<typename T>
-typename AVLTree<T>::TreeNode*
-AVLTree<T>::SearchRecursively(TreeNode* node, const T& target) const {
-    if (!node) return nullptr;
-    if (*node == target) return node;
-    else if (*node > target) {
-        return SearchRecursively(node->left_, target);
-    } else {
-        return SearchRecursively(node->right_, target);
+void ImplicitTreap<T>::UpdateToRoot(TreeNode* node) {
+    for (; node; node = node->parent_) {
+        node->Update();
     }
-
-    return nullptr;
 }
 
 template<typename T>
-bool AVLTree<T>::DeleteRecursively(TreeNode* node, const T& target) {
-    if (!node) return false;
-
-    if (*node > target) {
-        return DeleteRecursively(node->left_, target);
-    } else if (*node < target) {
-        return DeleteRecursively(node->right_, target);
-    } else {
-        TreeNode *parent = node->parent_;
-        bool is_root = (parent == nullptr);
-        bool is_left_child = (!is_root && (parent->left_ == node));
+void ImplicitTreap<T>::Destroy(TreeNode* node) {
+    if (!node) return;
 
-        if (!node->left_ && !node->right_) {
-            delete node;
-            if (is_root) BaseTreeType::root_ = nullptr;
-            else {
-                if (is_left_child) parent->left_ = nullptr;
+    TreeNode* stop = node->parent_;
+    while (node != stop) {
+        if (node->left_) {
+            node = node->left_;
+        } else if (node->right_) {
+            node = node->right_;
+        } else {
+            TreeNode* parent = node->parent_;
+            if (parent != stop) {
+                if (parent->left_ == node) parent->left_ = nullptr;
                 else parent->right_ = nullptr;
             }
-
-            DeleteFixUp(parent);
-        } else if (!node->right_) {
-            TreeNode *l_node = node->left_;
-            if (is_root) {
-                BaseTreeType::root_ = l_node;
-            } else {
-                if (is_left_child) parent->left_ = l_node;
-                else parent->right_ = l_node;
-            }
-            l_node->parent_ = parent;
-            delete node;
-
-            DeleteFixUp(parent);
-        } else if (!node->left_) {
-            TreeNode *r_node = node->right_;
-            if (is_root) {
-                BaseTreeType::root_ = r_node;
-            } else {
-                if (is_left_child) parent->left_ = r_node;
-                else parent->right_ = r_node;
-            }
-            r_node->parent_ = parent;
             delete node;
+            node = parent;
+        }
+    }
+}
 
-            DeleteFixUp(parent);
-        } else {
-            TreeNode *ino_prev = node->left_;
-            while (ino_prev->right_) {
-                ino_prev = ino_prev->right_;
-            }
-            node->data_ = ino_prev->data_;
+// ------------ Scapegoat Tree -------------
 
-            return DeleteRecursively(ino_prev, ino_prev->data_);
+// Keeps no balance data in the nodes. A subtree is rebuilt into perfect
+// balance whenever an insert lands deeper than log_{1/alpha}(n), and the
+// whole tree once deletes shrink it below alpha * max size.
+template<typename T, typename Stats = NoTreeStats>
+class ScapegoatTree final : public BinaryTreeBase<T, TreeNodeBase<T>, Stats> {
+ public:
+    explicit ScapegoatTree(double alpha = 0.7): alpha_(alpha), size_(0), max_size_(0) {
+        if (!(alpha > 0.5 && alpha < 1.0)) {
+            throw std::runtime_error("ScapegoatTree alpha must be in (0.5, 1)");
         }
+    }
+    ~ScapegoatTree() {}
+
+    ScapegoatTree(ScapegoatTree&& other) noexcept;
+    ScapegoatTree& operator=(ScapegoatTree&& other) noexcept;
+
+    // Same shape, one allocation for all the nodes
+    ScapegoatTree Clone() const;
+
+    size_t Size() const { return size_; }
+    double GetAlpha() const { return alpha_; }
+
+    bool IsTreeValid() const;
+
+ protected:
+    using BaseTreeType = BinaryTreeBase<T, TreeNodeBase<T>, Stats>;
+    using TreeNode = typename BaseTreeType::TreeNodeType;
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
 
+    bool GetTrackedSize(size_t* size) const override {
+        *size = size_;
         return true;
     }
-    return false;
+    void OnClear() override {
+        size_ = 0;
+        max_size_ = 0;
+    }
+
+    int MaxDepth(size_t size) const;
+    static size_t SubtreeSize(TreeNode* node);
+    void Rebuild(TreeNode* node);
+
+    double alpha_;
+    size_t size_;
+    size_t max_size_;
+
+};
+
+template<typename T, typename Stats>
+ScapegoatTree<T, Stats>::ScapegoatTree(ScapegoatTree&& other) noexcept:
+    BaseTreeType(std::move(other)), alpha_(other.alpha_), size_(other.size_), max_size_(other.max_size_) {
+    other.size_ = 0;
+    other.max_size_ = 0;
 }
 
-template<typename T>
-void AVLTree<T>::InsertFixUp(TreeNode* node) {
-    if (!node) return;
+template<typename T, typename Stats>
+ScapegoatTree<T, Stats>& ScapegoatTree<T, Stats>::operator=(ScapegoatTree&& other) noexcept {
+    if (this == &other) return *this;
+
+    BaseTreeType::operator=(std::move(other));
+    alpha_ = other.alpha_;
+    size_ = other.size_;
+    max_size_ = other.max_size_;
+    other.size_ = 0;
+    other.max_size_ = 0;
+    return *this;
+}
+
+template<typename T, typename Stats>
+ScapegoatTree<T, Stats> ScapegoatTree<T, Stats>::Clone() const {
+    ScapegoatTree copy(alpha_);
+    BaseTreeType::CloneInto(&copy);
+    copy.size_ = size_;
+    copy.max_size_ = max_size_;
+    return copy;
+}
+
+template<typename T, typename Stats>
+int ScapegoatTree<T, Stats>::MaxDepth(size_t size) const {
+    // floor(log_{1/alpha}(size)), in edges
+    return static_cast<int>(std::floor(std::log(static_cast<double>(size)) / std::log(1.0 / alpha_)));
+}
+
+template<typename T, typename Stats>
+bool ScapegoatTree<T, Stats>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur) {
+            cur = cur->right_;
+            is_left = false;
+        } else {
+            return false;
+        }
+    }
+
+    InsertAt(parent, is_left, node);
+    return true;
+}
+
+template<typename T, typename Stats>
+void ScapegoatTree<T, Stats>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    BaseTreeType::LinkNode(parent, is_left, node);
 
-    int bf = node->GetBalanceFactor();
-    if (bf < -1) {
-        if (node->right_->GetBalanceFactor() >= 1) {
-            node->right_->height_--;
+    ++size_;
+    max_size_ = std::max(max_size_, size_);
 
-            RightRotate(node->right_, &(BaseTreeType::root_));
+    int depth = 0;
+    for (TreeNode *cur = node->parent_; cur; cur = cur->parent_) {
+        ++depth;
+    }
 
-            node->right_->height_++;
+    if (depth > MaxDepth(size_)) {
+        // Too deep: some ancestor is alpha-weight-unbalanced, rebuild at the lowest one
+        TreeNode *child = node;
+        size_t child_size = 1;
+        for (TreeNode *ancestor = node->parent_; ancestor; ancestor = ancestor->parent_) {
+            TreeNode *sibling = (ancestor->left_ == child ? ancestor->right_ : ancestor->left_);
+            size_t ancestor_size = child_size + SubtreeSize(sibling) + 1;
+            if (static_cast<double>(child_size) > alpha_ * static_cast<double>(ancestor_size)) {
+                Rebuild(ancestor);
+                break;
+            }
+            child = ancestor;
+            child_size = ancestor_size;
         }
-        LeftRotate(node, &(BaseTreeType::root_));
-    } else if (bf > 1) {
-        if (node->left_->GetBalanceFactor() <= -1) {
-            node->left_->height_--;
+    }
+}
+
+template<typename T, typename Stats>
+typename ScapegoatTree<T, Stats>::TreeNode*
+ScapegoatTree<T, Stats>::SearchInternal(TreeNode* node, const T& target) const {
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
 
-            LeftRotate(node->left_, &(BaseTreeType::root_));
+    BaseTreeType::stats_.OnSearch(depth);
+    return node;
+}
+
+template<typename T, typename Stats>
+bool ScapegoatTree<T, Stats>::DeleteInternal(TreeNode* node, const T& target) {
+    while (node && !(*node == target)) {
+        BaseTreeType::stats_.OnCompare();
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    if (!node) return false;
 
-            node->left_->height_++;
+    if (node->left_ && node->right_) {
+        TreeNode *ino_prev = node->left_;
+        while (ino_prev->right_) {
+            ino_prev = ino_prev->right_;
         }
-        RightRotate(node, &(BaseTreeType::root_));
+        node->data_ = ino_prev->data_;
+        node = ino_prev;
     }
 
-    node->SetHeight(1 + std::max(
-        GetNodeHeight(node->left_), GetNodeHeight(node->right_)));
+    TreeNode *parent = node->parent_;
+    TreeNode *child = (node->left_ ? node->left_ : node->right_);
+    if (!parent) {
+        BaseTreeType::root_ = child;
+    } else {
+        if (parent->left_ == node) parent->left_ = child;
+        else parent->right_ = child;
+    }
+    if (child) {
+        child->parent_ = parent;
+    }
+
+    BaseTreeType::FreeNode(node);
+    --size_;
 
-    if (node->parent_) {
-        InsertFixUp(node->parent_);
+    if (static_cast<double>(size_) < alpha_ * static_cast<double>(max_size_)) {
+        Rebuild(BaseTreeType::root_);
+        max_size_ = size_;
     }
+    return true;
 }
 
-template<typename T>
-void AVLTree<T>::DeleteFixUp(TreeNode* node) {
-    if (!node) return;
+template<typename T, typename Stats>
+size_t ScapegoatTree<T, Stats>::SubtreeSize(TreeNode* node) {
+    if (!node) return 0;
 
-    int bf = node->GetBalanceFactor();
-    if (bf < -1) {
-        if (node->right_->GetBalanceFactor() >= 1) {
-            node->right_->height_--;
+    size_t count = 0;
+    std::vector<TreeNode*> stack(1, node);
+    while (!stack.empty()) {
+        TreeNode *cur = stack.back();
+        stack.pop_back();
+        ++count;
+        if (cur->left_) stack.push_back(cur->left_);
+        if (cur->right_) stack.push_back(cur->right_);
+    }
+    return count;
+}
 
-            RightRotate(node->right_, &(BaseTreeType::root_));
+template<typename T, typename Stats>
+void ScapegoatTree<T, Stats>::Rebuild(TreeNode* node) {
+    if (!node) return;
+    BaseTreeType::stats_.OnFixUp();
 
-            node->right_->height_++;
+    TreeNode *parent = node->parent_;
+    bool is_left = (parent && parent->left_ == node);
+
+    // Flatten in order, reusing the nodes
+    std::vector<TreeNode*> nodes;
+    std::vector<TreeNode*> stack;
+    TreeNode *cur = node;
+    while (cur || !stack.empty()) {
+        while (cur) {
+            stack.push_back(cur);
+            cur = cur->left_;
         }
-        LeftRotate(node, &(BaseTreeType::root_));
-    } else if (bf > 1) {
-        if (node->left_->GetBalanceFactor() <= -1) {
-            node->left_->height_--;
-
-            LeftRotate(node->left_, &(BaseTreeType::root_));
+        cur = stack.back();
+        stack.pop_back();
+        nodes.push_back(cur);
+        cur = cur->right_;
+    }
 
-            node->left_->height_++;
+    // Relink as a perfectly balanced tree, the middle of each range becomes its root
+    struct Range {
+        size_t lo;
+        size_t hi;  // exclusive
+        TreeNode* parent;
+        bool is_left;
+    };
+    TreeNode *new_root = nullptr;
+    std::vector<Range> ranges(1, Range{0, nodes.size(), parent, is_left});
+    while (!ranges.empty()) {
+        Range range = ranges.back();
+        ranges.pop_back();
+
+        size_t mid = range.lo + (range.hi - range.lo) / 2;
+        TreeNode *sub_root = nodes[mid];
+        sub_root->parent_ = range.parent;
+        sub_root->left_ = nullptr;
+        sub_root->right_ = nullptr;
+        if (!new_root) {
+            new_root = sub_root;
+        } else if (range.is_left) {
+            range.parent->left_ = sub_root;
+        } else {
+            range.parent->right_ = sub_root;
         }
-        RightRotate(node, &(BaseTreeType::root_));
+
+        if (range.lo < mid) ranges.push_back(Range{range.lo, mid, sub_root, true});
+        if (mid + 1 < range.hi) ranges.push_back(Range{mid + 1, range.hi, sub_root, false});
     }
 
-    node->SetHeight(1 + std::max(
-        GetNodeHeight(node->left_), GetNodeHeight(node->right_)));
+    if (!parent) BaseTreeType::root_ = new_root;
+    else if (is_left) parent->left_ = new_root;
+    else parent->right_ = new_root;
+}
+
+template<typename T, typename Stats>
+bool ScapegoatTree<T, Stats>::IsTreeValid() const {
+    if (!BaseTreeType::Validate().Ok()) return false;
+
+    // Height stays within the alpha bound of the largest size since the last full rebuild
+    return !BaseTreeType::root_ || BaseTreeType::GetHeight() - 1 <= MaxDepth(max_size_) + 1;
+}
+
+
+// ------------ Splay Tree -------------
+
+template<typename T, typename Stats = NoTreeStats>
+class SplayTree final : public BinaryTreeBase<T, TreeNodeBase<T>, Stats> {
+ public:
+    SplayTree() {}
+    ~SplayTree() {}
+
+    SplayTree(SplayTree&&) = default;
+    SplayTree& operator=(SplayTree&&) = default;
+
+    // Same shape, one allocation for all the nodes
+    SplayTree Clone() const;
+
+    // Splays the node found, or the last node visited on a miss, to the
+    // root. Lookups through a const tree or the base class leave the shape
+    // alone, like the other read-only paths.
+    TreeNodeBase<T>* Search(const T& target);
+    using BinaryTreeBase<T, TreeNodeBase<T>, Stats>::Search;
+
+ protected:
+    using BaseTreeType = BinaryTreeBase<T, TreeNodeBase<T>, Stats>;
+    using TreeNode = typename BaseTreeType::TreeNodeType;
+
+    bool InsertInternal(TreeNode*& root, TreeNode* node) override;
+    void InsertAt(TreeNode* parent, bool is_left, TreeNode* node) override;
+    TreeNode* SearchInternal(TreeNode* node, const T& target) const override;
+    bool DeleteInternal(TreeNode* node, const T& target) override;
+
+    // Descends from node, *last is the last node visited
+    TreeNode* Descend(TreeNode* node, const T& target, TreeNode** last) const;
+    void Splay(TreeNode* node, TreeNode** root);
+
+};
+
+template<typename T, typename Stats>
+SplayTree<T, Stats> SplayTree<T, Stats>::Clone() const {
+    SplayTree copy;
+    BaseTreeType::CloneInto(&copy);
+    return copy;
+}
+
+template<typename T, typename Stats>
+void SplayTree<T, Stats>::Splay(TreeNode* node, TreeNode** root) {
+    // Bottom-up splaying on parent_ links, two levels per step
+    while (node->parent_) {
+        BaseTreeType::stats_.OnFixUp();
+        TreeNode *parent = node->parent_;
+        TreeNode *grand_parent = parent->parent_;
+        bool is_left = (parent->left_ == node);
+
+        if (!grand_parent) {
+            // Zig
+            if (is_left) BaseTreeType::RotateRight(parent, root);
+            else BaseTreeType::RotateLeft(parent, root);
+        } else {
+            bool parent_is_left = (grand_parent->left_ == parent);
+            if (is_left && parent_is_left) {
+                // Zig-zig
+                BaseTreeType::RotateRight(grand_parent, root);
+                BaseTreeType::RotateRight(parent, root);
+            } else if (!is_left && !parent_is_left) {
+                // Zig-zig
+                BaseTreeType::RotateLeft(grand_parent, root);
+                BaseTreeType::RotateLeft(parent, root);
+            } else if (!is_left && parent_is_left) {
+                // Zig-zag
+                BaseTreeType::RotateLeft(parent, root);
+                BaseTreeType::RotateRight(grand_parent, root);
+            } else {
+                // Zig-zag
+                BaseTreeType::RotateRight(parent, root);
+                BaseTreeType::RotateLeft(grand_parent, root);
+            }
+        }
+    }
+}
 
-    if (node->parent_) {
-        DeleteFixUp(node->parent_);
+template<typename T, typename Stats>
+bool SplayTree<T, Stats>::InsertInternal(TreeNode*& root, TreeNode* node) {
+    TreeNode* parent = nullptr;
+    TreeNode* cur = root;
+    bool is_left = false;
+    while (cur) {
+        BaseTreeType::stats_.OnCompare();
+        parent = cur;
+        if (*node < *cur) {
+            cur = cur->left_;
+            is_left = true;
+        } else if (*node > *cur) {
+            cur = cur->right_;
+            is_left = false;
+        } else {
+            Splay(cur, &root);
+            return false;
+        }
     }
 
+    InsertAt(parent, is_left, node);
+    return true;
 }
 
-template<typename T>
-int AVLTree<T>::GetNodeHeight(TreeNode* node) const {
-    if (!node) return 0;
+template<typename T, typename Stats>
+void SplayTree<T, Stats>::InsertAt(TreeNode* parent, bool is_left, TreeNode* node) {
+    BaseTreeType::LinkNode(parent, is_left, node);
+    Splay(node, &(BaseTreeType::root_));
+}
 
-    return node->GetHeight();
+template<typename T, typename Stats>
+typename SplayTree<T, Stats>::TreeNode*
+SplayTree<T, Stats>::Descend(TreeNode* node, const T& target, TreeNode** last) const {
+    *last = nullptr;
+    int depth = 0;
+    while (node) {
+        ++depth;
+        BaseTreeType::stats_.OnCompare();
+        *last = node;
+        if (*node == target) break;
+        node = (*node > target ? node->left_ : node->right_);
+    }
+    BaseTreeType::stats_.OnSearch(depth);
+    return node;
 }
 
-template<typename T>
-bool AVLTree<T>::CheckTreeBalanced(TreeNode* node) const {
-    if (!node) return true;
+template<typename T, typename Stats>
+TreeNodeBase<T>* SplayTree<T, Stats>::Search(const T& target) {
+    TreeNode *last = nullptr;
+    TreeNode *node = Descend(BaseTreeType::root_, target, &last);
+    // A miss splays the last node visited to keep the amortized bound
+    if (last) Splay(last, &(BaseTreeType::root_));
+    return node;
+}
 
-    int bf = node->GetBalanceFactor();
-    if (bf > 1 || bf < -1) {
-        return false;
+template<typename T, typename Stats>
+typename SplayTree<T, Stats>::TreeNode*
+SplayTree<T, Stats>::SearchInternal(TreeNode* node, const T& target) const {
+    TreeNode *last = nullptr;
+    return Descend(node, target, &last);
+}
+
+template<typename T, typename Stats>
+bool SplayTree<T, Stats>::DeleteInternal(TreeNode* node, const T& target) {
+    TreeNode *last = nullptr;
+    TreeNode *found = Descend(node, target, &last);
+    if (last) Splay(last, &(BaseTreeType::root_));
+    if (!found) return false;
+
+    // The target is the root now, join its two subtrees
+    TreeNode *root = BaseTreeType::root_;
+    TreeNode *l_node = root->left_;
+    TreeNode *r_node = root->right_;
+    BaseTreeType::FreeNode(root);
+
+    if (!l_node) {
+        BaseTreeType::root_ = r_node;
+        if (r_node) r_node->parent_ = nullptr;
+        return true;
+    }
+
+    // Splay the maximum of the left subtree to its top, it has no right child then
+    l_node->parent_ = nullptr;
+    TreeNode *max_node = l_node;
+    while (max_node->right_) {
+        max_node = max_node->right_;
     }
+    Splay(max_node, &l_node);
 
-    return CheckTreeBalanced(node->left_) && CheckTreeBalanced(node->right_);
+    l_node->right_ = r_node;
+    if (r_node) r_node->parent_ = l_node;
+    BaseTreeType::root_ = l_node;
+    return true;
 }
 
 }  // namespace binary_tree
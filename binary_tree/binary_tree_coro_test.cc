@@ -0,0 +1,104 @@
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "binary_tree.hpp"
+
+class Timer {
+private:
+    std::chrono::time_point<std::chrono::steady_clock> start_;
+    int64_t &duration_us_;
+
+public:
+    explicit Timer(int64_t &dur) : duration_us_(dur) {
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    ~Timer() {
+        auto end = std::chrono::steady_clock::now();
+        duration_us_ = std::chrono::duration_cast<std::chrono::microseconds>(end - start_).count();
+    }
+};
+
+class CoroSearchTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        std::mt19937 rng(kRandomSeed);
+        keys.resize(kNKeys);
+        for (auto &key : keys) {
+            key = static_cast<int>(rng() % kNKeys);
+        }
+        queries.resize(kNKeys);
+        for (auto &query : queries) {
+            query = static_cast<int>(rng() % (2 * kNKeys)) - kNKeys / 2;
+        }
+    }
+
+    static constexpr const int kNKeys = 1000000;
+    static constexpr const int kRandomSeed = 1234;
+    std::vector<int> keys;
+    std::vector<int> queries;
+};
+
+TEST_F(CoroSearchTest, SearchMany) {
+    binary_tree::RBTree<int> rbt;
+    binary_tree::AVLTree<int> avl;
+    for (auto key : keys) {
+        rbt.Insert(key);
+        avl.Insert(key);
+    }
+
+    for (size_t in_flight : {0, 1, 3, 16, 64}) {
+        auto results = rbt.SearchMany(queries, in_flight);
+        ASSERT_EQ(results.size(), queries.size());
+        for (size_t i = 0; i < queries.size(); i += 101) {
+            EXPECT_EQ(results[i], rbt.Search(queries[i]));
+        }
+    }
+    auto avl_results = avl.SearchMany(queries);
+    for (size_t i = 0; i < queries.size(); i += 101) {
+        EXPECT_EQ(avl_results[i], avl.Search(queries[i]));
+    }
+
+    binary_tree::RBTree<int> empty;
+    EXPECT_TRUE(empty.SearchMany(std::vector<int>()).empty());
+    EXPECT_EQ(empty.SearchMany(std::vector<int>{1, 2, 3})[1], nullptr);
+
+    int64_t search_time = 0;
+    size_t search_hits = 0;
+    {
+        Timer _(search_time);
+        for (auto query : queries) {
+            search_hits += (rbt.Search(query) != nullptr);
+        }
+    }
+    int64_t multi_time = 0;
+    size_t multi_hits = 0;
+    {
+        Timer _(multi_time);
+        for (auto node : rbt.MultiSearch(queries)) {
+            multi_hits += (node != nullptr);
+        }
+    }
+    int64_t coro_time = 0;
+    size_t coro_hits = 0;
+    {
+        Timer _(coro_time);
+        for (auto node : rbt.SearchMany(queries)) {
+            coro_hits += (node != nullptr);
+        }
+    }
+    EXPECT_EQ(multi_hits, search_hits);
+    EXPECT_EQ(coro_hits, search_hits);
+
+    std::cout << "RBT random search " << queries.size() << " times, Search: " << search_time
+              << " us, MultiSearch: " << multi_time << " us, SearchMany: " << coro_time << " us" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -3,10 +3,55 @@
 #include <iostream>
 #include <chrono>
 #include <set>
+#include <sstream>
+#include <random>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <cstdlib>
+#include <new>
+#include <string>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 #include <gtest/gtest.h>
 
 #include "binary_tree.hpp"
+#include "flat_set.hpp"
+#include "sharded_tree.hpp"
+
+// Counts heap allocations, for the paths that promise to make none. Kept
+// out of line so the compiler does not pair the inlined free with new.
+#if defined(__GNUC__) || defined(__clang__)
+#define TEST_NOINLINE __attribute__((noinline))
+#else
+#define TEST_NOINLINE
+#endif
+
+static std::atomic<size_t> g_allocations(0);
+
+TEST_NOINLINE void* operator new(std::size_t size) {
+    ++g_allocations;
+    void *memory = std::malloc(size ? size : 1);
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+
+// The standard algorithms take temporary buffers through this one
+TEST_NOINLINE void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    ++g_allocations;
+    return std::malloc(size ? size : 1);
+}
+
+TEST_NOINLINE void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+TEST_NOINLINE void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
 
 class Timer {
 private:
@@ -24,6 +69,31 @@ public:
     }
 };
 
+// Draws ranks in [0, n) with P(rank) proportional to 1 / (rank + 1)^s
+class ZipfGenerator {
+private:
+    std::vector<double> cdf_;
+    std::mt19937 rng_;
+    std::uniform_real_distribution<double> uniform_;
+
+public:
+    ZipfGenerator(int n, double s, unsigned seed) : cdf_(n), rng_(seed), uniform_(0.0, 1.0) {
+        double sum = 0;
+        for (int i = 0; i < n; ++i) {
+            sum += 1.0 / std::pow(i + 1, s);
+            cdf_[i] = sum;
+        }
+        for (auto &c : cdf_) {
+            c /= sum;
+        }
+    }
+
+    int Next() {
+        auto it = std::lower_bound(cdf_.begin(), cdf_.end(), uniform_(rng_));
+        return (it == cdf_.end() ? static_cast<int>(cdf_.size()) - 1 : static_cast<int>(it - cdf_.begin()));
+    }
+};
+
 class BstTest : public ::testing::Test {
  protected:
     void SetUp() override {
@@ -84,6 +154,94 @@ TEST_F(BstTest, BSTreePrint) {
     std::cout << bst << std::endl;
 }
 
+TEST_F(BstTest, TreeDump) {
+    binary_tree::RBTree<int> rbt;
+    for (auto x : {49, 45, 25, 65}) {
+        rbt.Insert(x);
+    }
+
+    std::ostringstream text;
+    rbt.Dump(text);
+    EXPECT_EQ(text.str(),
+              "└──45 B\n"
+              "    ├──25 B\n"
+              "    │   ├──nil\n"
+              "    │   └──nil\n"
+              "    └──49 B\n"
+              "        ├──nil\n"
+              "        └──65 R\n"
+              "            ├──nil\n"
+              "            └──nil\n");
+
+    std::ostringstream limited;
+    rbt.Dump(limited, binary_tree::DumpOptions(binary_tree::DumpFormat::Text, 1));
+    EXPECT_EQ(limited.str(),
+              "└──45 B\n"
+              "    ├──25 B\n"
+              "    └──49 B\n"
+              "        └──...\n");
+
+    std::ostringstream dot;
+    rbt.Dump(dot, binary_tree::DumpOptions(binary_tree::DumpFormat::Dot));
+    EXPECT_EQ(dot.str(),
+              "digraph BinaryTree {\n"
+              "  n0 [label=\"45 B\"];\n"
+              "  n1 [label=\"25 B\"];\n"
+              "  n0 -> n1 [label=\"L\"];\n"
+              "  n2 [label=\"49 B\"];\n"
+              "  n0 -> n2 [label=\"R\"];\n"
+              "  n3 [label=\"65 R\"];\n"
+              "  n2 -> n3 [label=\"R\"];\n"
+              "}\n");
+
+    std::ostringstream json;
+    rbt.Dump(json, binary_tree::DumpOptions(binary_tree::DumpFormat::Json, -1, 2));
+    EXPECT_EQ(json.str(),
+              "{\"nodes\":[\n"
+              "{\"id\":0,\"parent\":-1,\"side\":\"root\",\"value\":\"45 B\"},\n"
+              "{\"id\":1,\"parent\":0,\"side\":\"left\",\"value\":\"25 B\"}\n"
+              "],\"truncated\":true}\n");
+
+    // Control characters in values must not break the JSON string
+    binary_tree::RBTree<std::string> words;
+    words.Insert("a\nb");
+    words.Insert("c\t\"d\"\x01");
+    std::ostringstream escaped;
+    words.Dump(escaped, binary_tree::DumpOptions(binary_tree::DumpFormat::Json));
+    EXPECT_EQ(escaped.str(),
+              "{\"nodes\":[\n"
+              "{\"id\":0,\"parent\":-1,\"side\":\"root\",\"value\":\"a\\nb B\"},\n"
+              "{\"id\":1,\"parent\":0,\"side\":\"right\",\"value\":\"c\\t\\\"d\\\"\\u0001 R\"}\n"
+              "],\"truncated\":false}\n");
+
+    // Degenerated tree: one path of kNPerfData nodes
+    binary_tree::BinarySearchTree<int> bst;
+    int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        bst.Insert(i);
+    }
+    std::ostringstream deep;
+    EXPECT_NO_THROW(bst.Dump(deep, binary_tree::DumpOptions(binary_tree::DumpFormat::Json)));
+    std::ostringstream head;
+    bst.Dump(head, binary_tree::DumpOptions(binary_tree::DumpFormat::Text, -1, 3));
+    EXPECT_EQ(head.str(),
+              "└──0\n"
+              "    ├──nil\n"
+              "    └──1\n"
+              "        ├──nil\n"
+              "        └──2\n"
+              "            ├──nil\n"
+              "...(truncated)\n");
+
+    // A limit of exactly the node count elides nothing
+    std::ostringstream exact;
+    rbt.Dump(exact, binary_tree::DumpOptions(binary_tree::DumpFormat::Text, -1, 4));
+    EXPECT_EQ(exact.str(), text.str());
+    std::ostringstream exact_json;
+    rbt.Dump(exact_json, binary_tree::DumpOptions(binary_tree::DumpFormat::Json, -1, 4));
+    EXPECT_NE(exact_json.str().find("\"truncated\":false"), std::string::npos);
+}
+
 TEST_F(BstTest, BSTreeInsert) {
     ASSERT_GE(n_data, 10);
     using Node = binary_tree::BinarySearchTree<int>::TreeNodeType;
@@ -256,6 +414,31 @@ TEST_F(BstTest, BSTreeDelete) {
     }
 }
 
+TEST_F(BstTest, BSTreeDegenerated) {
+    // Sorted input turns the BST into a single path, nothing may recurse per level
+    binary_tree::BinarySearchTree<int> bst;
+    int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        EXPECT_NE(bst.Insert(i), nullptr);
+    }
+    EXPECT_EQ(bst.GetHeight(), samples);
+
+    for (int i = 0; i < samples; i += 2) {
+        EXPECT_TRUE(bst.Delete(i));
+    }
+    EXPECT_EQ(bst.GetHeight(), samples / 2);
+    for (int i = 0; i < samples; ++i) {
+        EXPECT_EQ(bst.Search(i) != nullptr, i % 2 == 1);
+    }
+    EXPECT_NO_THROW(bst.Clear());
+    EXPECT_EQ(bst.GetHeight(), 0);
+
+    for (int i = samples; i > 0; --i) {
+        bst.Insert(i);
+    }
+    EXPECT_EQ(bst.GetHeight(), samples);
+}
+
 TEST_F(BstTest, RBTreePrint) {
     binary_tree::RBTree<int> rbt;
     for (auto x : data) {
@@ -667,6 +850,2395 @@ TEST_F(BstTest, AVLTreeDelete) {
     }
 }
 
+template<typename Tree>
+binary_tree::TreeStatsSnapshot CollectStats(const std::vector<int>& keys) {
+    Tree tree;
+    for (auto x : keys) {
+        tree.Insert(x);
+    }
+    for (auto x : keys) {
+        tree.Search(x);
+    }
+    for (auto x : keys) {
+        tree.Delete(x);
+    }
+    return tree.StatsSnapshot();
+}
+
+TEST_F(BstTest, TreeStatistics) {
+    binary_tree::RBTree<int, binary_tree::TreeStats> rbt;
+    // Bound by reference, so this links at -O0 only with the definitions
+    EXPECT_TRUE(binary_tree::TreeStats::kEnabled);
+    EXPECT_FALSE(binary_tree::NoTreeStats::kEnabled);
+
+    // Ascending keys keep rotating at the right spine
+    for (int i = 0; i < 3; ++i) {
+        rbt.Insert(i);
+    }
+    auto snapshot = rbt.StatsSnapshot();
+    EXPECT_EQ(snapshot.allocations, 3u);
+    EXPECT_EQ(snapshot.rotations, 1u);
+    EXPECT_EQ(snapshot.comparisons, 3u);
+
+    // Per operation cost through deltas
+    auto before = rbt.StatsSnapshot();
+    EXPECT_EQ(rbt.Insert(1), nullptr);
+    auto delta = rbt.StatsSnapshot().Delta(before);
+    EXPECT_EQ(delta.allocations, 1u);
+    EXPECT_EQ(delta.deallocations, 1u);
+    EXPECT_EQ(delta.rotations, 0u);
+    EXPECT_EQ(delta.fixup_steps, 0u);
+
+    before = rbt.StatsSnapshot();
+    rbt.Search(1);
+    rbt.Search(0);
+    rbt.Search(100);
+    delta = rbt.StatsSnapshot().Delta(before);
+    EXPECT_EQ(delta.searches, 3u);
+    EXPECT_EQ(delta.depth_histogram[1], 1u);
+    EXPECT_EQ(delta.depth_histogram[2], 2u);
+    EXPECT_EQ(delta.comparisons, 5u);
+
+    rbt.ResetStats();
+    EXPECT_EQ(rbt.StatsSnapshot().comparisons, 0u);
+
+    // Every tree counts through the same policy
+    std::vector<int> keys(perf_data, perf_data + (kNPerfData > 10000 ? 10000 : kNPerfData));
+    auto print = [](const char* name, const binary_tree::TreeStatsSnapshot& stats) {
+        std::cout << name << " comparisons: " << stats.comparisons << ", rotations: " << stats.rotations
+                  << ", fix-up steps: " << stats.fixup_steps << ", allocations: " << stats.allocations
+                  << ", deallocations: " << stats.deallocations << std::endl;
+        EXPECT_EQ(stats.allocations, stats.deallocations);
+    };
+    print("BST", CollectStats<binary_tree::BinarySearchTree<int, binary_tree::TreeStats>>(keys));
+    print("RBT", CollectStats<binary_tree::RBTree<int, binary_tree::TreeStats>>(keys));
+    print("AVL tree", CollectStats<binary_tree::AVLTree<int, binary_tree::TreeStats>>(keys));
+    print("AA tree", CollectStats<binary_tree::AATree<int, binary_tree::TreeStats>>(keys));
+    print("Treap", CollectStats<binary_tree::Treap<int, binary_tree::TreeStats>>(keys));
+    print("Scapegoat tree", CollectStats<binary_tree::ScapegoatTree<int, binary_tree::TreeStats>>(keys));
+    print("Splay tree", CollectStats<binary_tree::SplayTree<int, binary_tree::TreeStats>>(keys));
+
+    // Disabled stats report nothing
+    auto disabled = CollectStats<binary_tree::RBTree<int>>(keys);
+    EXPECT_EQ(disabled.comparisons, 0u);
+    EXPECT_EQ(disabled.allocations, 0u);
+
+    // Perf
+    binary_tree::RBTree<int, binary_tree::TreeStats> counted;
+    int64_t counted_insertion_time = 0;
+    {
+        Timer _(counted_insertion_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            counted.Insert(perf_data[i]);
+        }
+    }
+    std::cout << "RBT with stats insert " << kNPerfData << " items time: "
+              << counted_insertion_time << " us" << std::endl;
+}
+
+TEST_F(BstTest, TreeValidate) {
+    using RBNode = binary_tree::RBTree<int>::TreeNodeType;
+    using binary_tree::ValidationErrorKind;
+    auto has_error = [](const binary_tree::ValidationReport& report, ValidationErrorKind kind) {
+        for (auto& error : report.errors) {
+            if (error.kind == kind) return true;
+        }
+        return false;
+    };
+
+    binary_tree::RBTree<int> rbt;
+    std::vector<RBNode*> nodes;
+    for (auto x : data) {
+        RBNode* node = rbt.Insert(x);
+        if (node) nodes.push_back(node);
+    }
+    auto report = rbt.Validate();
+    EXPECT_TRUE(report.Ok());
+    EXPECT_EQ(report.nodes_checked, nodes.size());
+
+    // Break the order
+    RBNode* node = rbt.Search(13);
+    ASSERT_EQ(node->left_, nullptr);
+    ASSERT_EQ(node->right_, nullptr);
+    node->data_ = 100;
+    report = rbt.Validate();
+    EXPECT_TRUE(has_error(report, ValidationErrorKind::Order));
+    EXPECT_EQ(report.errors[0].node, node);
+    node->data_ = 13;
+
+    // Break the colors
+    for (auto n : nodes) {
+        n->SetRed();
+    }
+    report = rbt.Validate();
+    EXPECT_TRUE(has_error(report, ValidationErrorKind::RootColor));
+    EXPECT_TRUE(has_error(report, ValidationErrorKind::RedRed));
+    EXPECT_FALSE(rbt.IsTreeValid());
+    for (auto n : nodes) {
+        n->SetBlack();
+    }
+    EXPECT_TRUE(has_error(rbt.Validate(), ValidationErrorKind::BlackHeight));
+    rbt.Clear();
+
+    // AVL stored heights are checked, not trusted
+    binary_tree::AVLTree<int> avl;
+    for (auto x : data) {
+        avl.Insert(x);
+    }
+    EXPECT_TRUE(avl.Validate().Ok());
+    avl.Search(13)->height_ = 2;
+    EXPECT_TRUE(has_error(avl.Validate(), ValidationErrorKind::StoredHeight));
+    avl.Search(13)->height_ = 1;
+    EXPECT_TRUE(avl.IsTreeValid());
+
+    // Parallel over subtrees, same result as sequential
+    for (int i = 0; i < kNPerfData; ++i) {
+        rbt.Insert(perf_data[i]);
+    }
+    auto sequential = rbt.Validate();
+    auto parallel = rbt.Validate(binary_tree::ValidateOptions(4));
+    EXPECT_TRUE(sequential.Ok());
+    EXPECT_TRUE(parallel.Ok());
+    EXPECT_EQ(parallel.nodes_checked, sequential.nodes_checked);
+
+    RBNode* leaf = rbt.Search(perf_data[kNPerfData / 2]);
+    while (leaf->left_) leaf = leaf->left_;
+    // Flipping any color on a single path breaks the black height
+    leaf->color_ = (leaf->color_ == RBNode::Color::Red ? RBNode::Color::Black : RBNode::Color::Red);
+    EXPECT_FALSE(rbt.Validate(binary_tree::ValidateOptions(4)).Ok());
+    EXPECT_FALSE(rbt.Validate().Ok());
+    leaf->color_ = (leaf->color_ == RBNode::Color::Red ? RBNode::Color::Black : RBNode::Color::Red);
+    EXPECT_TRUE(rbt.Validate(binary_tree::ValidateOptions(3)).Ok());
+
+    int64_t sequential_time = 0, parallel_time = 0;
+    {
+        Timer _(sequential_time);
+        rbt.Validate();
+    }
+    {
+        Timer _(parallel_time);
+        rbt.Validate(binary_tree::ValidateOptions(4));
+    }
+    std::cout << "RBT validate " << sequential.nodes_checked << " nodes takes: " << sequential_time
+              << " us, with 4 threads: " << parallel_time << " us" << std::endl;
+
+    // Incremental, in chunks
+    binary_tree::RBTree<int>::IncrementalValidator validator(rbt);
+    int steps = 1;
+    while (!validator.Step(10000)) {
+        ++steps;
+        if (steps == 10) {
+            // The tree changed, the walk starts over
+            rbt.Insert(-1);
+        }
+    }
+    EXPECT_TRUE(validator.Report().Ok());
+    EXPECT_EQ(validator.Report().nodes_checked, sequential.nodes_checked + 1);
+    EXPECT_GT(steps, static_cast<int>(sequential.nodes_checked / 10000) + 9);
+    EXPECT_TRUE(validator.Step(1));
+
+    validator.Restart();
+    while (!validator.StepFor(std::chrono::microseconds(100))) {}
+    EXPECT_TRUE(validator.Report().Ok());
+
+    // Scapegoat tree counts its nodes, a lost node is a size error
+    binary_tree::ScapegoatTree<int> sgt;
+    for (auto x : data) {
+        sgt.Insert(x);
+    }
+    EXPECT_TRUE(sgt.Validate().Ok());
+    auto* sgt_leaf = sgt.Search(13);
+    sgt_leaf->parent_->left_ = nullptr;
+    EXPECT_TRUE(has_error(sgt.Validate(), ValidationErrorKind::Size));
+    sgt_leaf->parent_->left_ = sgt_leaf;
+}
+
+TEST_F(BstTest, TreapOperations) {
+    binary_tree::Treap<int> tree;
+    std::set<int> expected;
+
+    for (auto x : data) {
+        EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+        EXPECT_TRUE(tree.IsTreeValid());
+    }
+    for (auto x : data) {
+        EXPECT_NE(tree.Search(x), nullptr);
+    }
+    EXPECT_EQ(tree.Search(100), nullptr);
+
+    int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        int x = perf_data[i] % 1000;
+        if (i % 3 == 2) {
+            EXPECT_EQ(tree.Delete(x), expected.erase(x) == 1);
+        } else {
+            EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+        }
+    }
+    EXPECT_TRUE(tree.IsTreeValid());
+
+    // Split and merge back
+    binary_tree::Treap<int> greater;
+    tree.Split(500, &greater);
+    EXPECT_TRUE(tree.IsTreeValid());
+    EXPECT_TRUE(greater.IsTreeValid());
+    for (int x = 0; x < 1000; ++x) {
+        bool present = expected.count(x) == 1;
+        EXPECT_EQ(tree.Search(x) != nullptr, present && x < 500);
+        EXPECT_EQ(greater.Search(x) != nullptr, present && x >= 500);
+    }
+    EXPECT_THROW(tree.Split(0, &greater), std::runtime_error);
+    EXPECT_THROW(greater.Merge(tree), std::runtime_error);
+
+    tree.Merge(greater);
+    EXPECT_EQ(greater.Search(*expected.rbegin()), nullptr);
+    EXPECT_TRUE(tree.IsTreeValid());
+    for (int x = 0; x < 1000; ++x) {
+        EXPECT_EQ(tree.Search(x) != nullptr, expected.count(x) == 1);
+    }
+
+    // Perf
+    tree.Clear();
+    int64_t treap_random_insertion_time = 0;
+    {
+        Timer _(treap_random_insertion_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            tree.Insert(perf_data[i]);
+        }
+    }
+    std::cout << "Treap insert " << kNPerfData << " items time: "
+              << treap_random_insertion_time << " us, height: " << tree.GetHeight() << std::endl;
+
+    int64_t treap_split_merge_time = 0;
+    {
+        Timer _(treap_split_merge_time);
+        for (int i = 0; i < 1000; ++i) {
+            tree.Split(perf_data[i], &greater);
+            tree.Merge(greater);
+        }
+    }
+    std::cout << "Treap split and merge 1000 times takes: "
+              << treap_split_merge_time << " us" << std::endl;
+}
+
+// Copying throws while fail is set
+struct ThrowingCopy {
+    static bool fail;
+    int value;
+
+    ThrowingCopy(int v = 0): value(v) {}
+    ThrowingCopy(const ThrowingCopy& other): value(other.value) {
+        if (fail) throw std::runtime_error("copy failed");
+    }
+    ThrowingCopy& operator=(const ThrowingCopy&) = default;
+    bool operator==(const ThrowingCopy& rhs) const { return value == rhs.value; }
+};
+bool ThrowingCopy::fail = false;
+
+TEST_F(BstTest, ImplicitTreapOperations) {
+    binary_tree::ImplicitTreap<int> seq;
+    std::vector<int> expected;
+
+    int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        size_t pos = perf_data[i] % (expected.size() + 1);
+        if (i % 4 == 3 && !expected.empty()) {
+            pos %= expected.size();
+            seq.Erase(pos);
+            expected.erase(expected.begin() + pos);
+        } else {
+            seq.Insert(pos, i);
+            expected.insert(expected.begin() + pos, i);
+        }
+    }
+    ASSERT_EQ(seq.Size(), expected.size());
+    EXPECT_EQ(seq.ToVector(), expected);
+    for (size_t i = 0; i < expected.size(); i += 97) {
+        EXPECT_EQ(seq.At(i), expected[i]);
+    }
+    EXPECT_THROW(seq.At(expected.size()), std::out_of_range);
+
+    binary_tree::ImplicitTreap<int> tail;
+    size_t half = expected.size() / 2;
+    seq.Split(half, &tail);
+    EXPECT_EQ(seq.Size(), half);
+    EXPECT_EQ(tail.Size(), expected.size() - half);
+    EXPECT_EQ(tail.At(0), expected[half]);
+
+    // Move the front half behind the back half
+    tail.Merge(seq);
+    EXPECT_EQ(seq.Size(), 0u);
+    std::rotate(expected.begin(), expected.begin() + half, expected.end());
+    EXPECT_EQ(tail.ToVector(), expected);
+
+    // A failed insert leaves the sequence untouched
+    binary_tree::ImplicitTreap<ThrowingCopy> guarded;
+    for (int i = 0; i < 100; ++i) {
+        guarded.PushBack(ThrowingCopy(i));
+    }
+    std::vector<ThrowingCopy> before = guarded.ToVector();
+    ThrowingCopy::fail = true;
+    EXPECT_THROW(guarded.Insert(50, ThrowingCopy(-1)), std::runtime_error);
+    ThrowingCopy::fail = false;
+    EXPECT_EQ(guarded.Size(), before.size());
+    EXPECT_EQ(guarded.ToVector(), before);
+}
+
+TEST_F(BstTest, ScapegoatTreeOperations) {
+    EXPECT_THROW(binary_tree::ScapegoatTree<int>(0.5), std::runtime_error);
+
+    for (double alpha : {0.6, 0.75, 0.9}) {
+        binary_tree::ScapegoatTree<int> tree(alpha);
+        std::set<int> expected;
+
+        for (auto x : data) {
+            EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+            EXPECT_TRUE(tree.IsTreeValid());
+        }
+
+        int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+        for (int i = 0; i < samples; ++i) {
+            int x = perf_data[i] % 1000;
+            if (i % 3 == 2) {
+                EXPECT_EQ(tree.Delete(x), expected.erase(x) == 1);
+            } else {
+                EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+            }
+            if (i % 100 == 0) {
+                EXPECT_TRUE(tree.IsTreeValid());
+            }
+        }
+        EXPECT_EQ(tree.Size(), expected.size());
+        for (int x = 0; x < 1000; ++x) {
+            EXPECT_EQ(tree.Search(x) != nullptr, expected.count(x) == 1);
+        }
+
+        // Sorted input is rebalanced on the way
+        tree.Clear();
+        EXPECT_EQ(tree.Size(), 0u);
+        for (int i = 0; i < samples; ++i) {
+            tree.Insert(i);
+        }
+        EXPECT_TRUE(tree.IsTreeValid());
+        for (int i = 0; i < samples; i += 2) {
+            EXPECT_TRUE(tree.Delete(i));
+        }
+        EXPECT_TRUE(tree.IsTreeValid());
+
+        // Clearing through the base resets the node count too
+        binary_tree::BinaryTreeBase<int, binary_tree::TreeNodeBase<int>, binary_tree::NoTreeStats>& base = tree;
+        base.Clear();
+        EXPECT_EQ(tree.Size(), 0u);
+        EXPECT_TRUE(tree.Validate().Ok());
+        for (int i = 0; i < 100; ++i) {
+            tree.Insert(i);
+        }
+        EXPECT_EQ(tree.Size(), 100u);
+        EXPECT_TRUE(tree.IsTreeValid());
+    }
+}
+
+TEST_F(BstTest, BalancedTreesCompare) {
+    binary_tree::ScapegoatTree<int> sgt;
+    binary_tree::RBTree<int> rbt;
+    binary_tree::AVLTree<int> avl;
+
+    std::cout << "Node size, scapegoat tree: " << sizeof(binary_tree::ScapegoatTree<int>::TreeNodeType)
+              << " B, RBT: " << sizeof(binary_tree::RBTree<int>::TreeNodeType)
+              << " B, AVL tree: " << sizeof(binary_tree::AVLTree<int>::TreeNodeType) << " B" << std::endl;
+
+    int64_t sgt_insert_time = 0, rbt_insert_time = 0, avl_insert_time = 0;
+    {
+        Timer _(sgt_insert_time);
+        for (int i = 0; i < kNPerfData; ++i) sgt.Insert(perf_data[i]);
+    }
+    {
+        Timer _(rbt_insert_time);
+        for (int i = 0; i < kNPerfData; ++i) rbt.Insert(perf_data[i]);
+    }
+    {
+        Timer _(avl_insert_time);
+        for (int i = 0; i < kNPerfData; ++i) avl.Insert(perf_data[i]);
+    }
+    std::cout << "Insert " << kNPerfData << " items, scapegoat tree: " << sgt_insert_time
+              << " us, RBT: " << rbt_insert_time << " us, AVL tree: " << avl_insert_time << " us" << std::endl;
+
+    int64_t sgt_search_time = 0, rbt_search_time = 0, avl_search_time = 0;
+    {
+        Timer _(sgt_search_time);
+        for (int i = 0; i < kNPerfData; ++i) sgt.Search(perf_data[i]);
+    }
+    {
+        Timer _(rbt_search_time);
+        for (int i = 0; i < kNPerfData; ++i) rbt.Search(perf_data[i]);
+    }
+    {
+        Timer _(avl_search_time);
+        for (int i = 0; i < kNPerfData; ++i) avl.Search(perf_data[i]);
+    }
+    std::cout << "Search " << kNPerfData << " times, scapegoat tree: " << sgt_search_time
+              << " us, RBT: " << rbt_search_time << " us, AVL tree: " << avl_search_time << " us" << std::endl;
+    std::cout << "Height, scapegoat tree: " << sgt.GetHeight() << ", RBT: " << rbt.GetHeight()
+              << ", AVL tree: " << avl.GetHeight() << std::endl;
+}
+
+TEST_F(BstTest, AATreeOperations) {
+    binary_tree::AATree<int> tree;
+    std::set<int> expected;
+    for (auto x : data) {
+        EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+        EXPECT_TRUE(tree.IsTreeValid());
+    }
+
+    // Leaves are on level 1
+    auto *leaf = tree.Search(13);
+    ASSERT_NE(leaf, nullptr);
+    ASSERT_EQ(leaf->left_, nullptr);
+    EXPECT_EQ(leaf->ToString(), "13 1");
+
+    int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        int x = perf_data[i] % 1000;
+        if (i % 3 == 2) {
+            EXPECT_EQ(tree.Delete(x), expected.erase(x) == 1);
+        } else {
+            EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+        }
+        if (i % 100 == 0) {
+            EXPECT_TRUE(tree.IsTreeValid());
+        }
+    }
+    for (int x = 0; x < 1000; ++x) {
+        EXPECT_EQ(tree.Search(x) != nullptr, expected.count(x) == 1);
+    }
+    while (!expected.empty()) {
+        int x = *expected.begin();
+        EXPECT_TRUE(tree.Delete(x));
+        expected.erase(expected.begin());
+        if (expected.size() % 50 == 0) {
+            EXPECT_TRUE(tree.IsTreeValid());
+        }
+    }
+    EXPECT_EQ(tree.GetHeight(), 0);
+
+    // Sorted input, the right spine keeps splitting
+    for (int i = 0; i < samples; ++i) {
+        tree.Insert(i);
+    }
+    EXPECT_TRUE(tree.IsTreeValid());
+    EXPECT_LE(tree.GetHeight(), 2 * static_cast<int>(std::log2(samples + 1)) + 1);
+    for (int i = 0; i < samples; i += 2) {
+        EXPECT_TRUE(tree.Delete(i));
+    }
+    EXPECT_TRUE(tree.IsTreeValid());
+
+    // A node whose level does not fit its children is reported
+    auto *node = tree.Search(1);
+    ++node->level_;
+    auto report = tree.Validate();
+    ASSERT_FALSE(report.Ok());
+    EXPECT_EQ(report.errors[0].kind, binary_tree::ValidationErrorKind::Level);
+    --node->level_;
+    EXPECT_TRUE(tree.IsTreeValid());
+}
+
+// Warms the tree with keys[0, n), then churns: every step deletes a key and inserts another
+template<typename Tree>
+void TimeChurn(Tree& tree, const int* keys, int n, int64_t* insert_time, int64_t* churn_time) {
+    {
+        Timer _(*insert_time);
+        for (int i = 0; i < n; ++i) {
+            tree.Insert(keys[i]);
+        }
+    }
+    Timer _(*churn_time);
+    for (int i = 0; i < n; ++i) {
+        tree.Delete(keys[i]);
+        tree.Insert(keys[n + i]);
+    }
+}
+
+TEST_F(BstTest, AATreeVsRBTree) {
+    const int n = kNPerfData / 2;
+    int64_t rbt_insert_time = 0, rbt_churn_time = 0, aa_insert_time = 0, aa_churn_time = 0;
+    {
+        binary_tree::RBTree<int> rbt;
+        TimeChurn(rbt, perf_data, n, &rbt_insert_time, &rbt_churn_time);
+        EXPECT_TRUE(rbt.IsTreeValid());
+    }
+    {
+        binary_tree::AATree<int> aa;
+        TimeChurn(aa, perf_data, n, &aa_insert_time, &aa_churn_time);
+        EXPECT_TRUE(aa.IsTreeValid());
+    }
+    std::cout << "Insert " << n << " items, RBT: " << rbt_insert_time << " us, AA tree: "
+              << aa_insert_time << " us" << std::endl;
+    std::cout << "Delete and insert " << n << " times, RBT: " << rbt_churn_time << " us, AA tree: "
+              << aa_churn_time << " us" << std::endl;
+
+    // Same churn counted, the AA tree rotates more but each step is one of two cases
+    std::vector<int> keys(perf_data, perf_data + (kNPerfData > 20000 ? 20000 : kNPerfData));
+    binary_tree::RBTree<int, binary_tree::TreeStats> rbt;
+    binary_tree::AATree<int, binary_tree::TreeStats> aa;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        rbt.Insert(keys[i]);
+        aa.Insert(keys[i]);
+        if (i % 2 == 1) {
+            rbt.Delete(keys[i / 2]);
+            aa.Delete(keys[i / 2]);
+        }
+    }
+    size_t rbt_size = 0, aa_size = 0;
+    rbt.ForEach([&](int) { ++rbt_size; });
+    aa.ForEach([&](int) { ++aa_size; });
+    EXPECT_EQ(rbt_size, aa_size);
+    auto rbt_stats = rbt.StatsSnapshot();
+    auto aa_stats = aa.StatsSnapshot();
+    std::cout << "Mixed " << keys.size() << " ops, RBT rotations: " << rbt_stats.rotations
+              << ", fix-up steps: " << rbt_stats.fixup_steps << ", height: " << rbt.GetHeight()
+              << "; AA tree rotations: " << aa_stats.rotations << ", fix-up steps: " << aa_stats.fixup_steps
+              << ", height: " << aa.GetHeight() << std::endl;
+}
+
+TEST_F(BstTest, SplayTreeOperations) {
+    using Node = binary_tree::SplayTree<int>::TreeNodeType;
+    binary_tree::SplayTree<int> tree;
+    Node *res = nullptr;
+
+    for (auto x : data) {
+        tree.Insert(x);
+    }
+
+    // The last accessed key is moved to the root
+    for (auto x : data) {
+        res = tree.Search(x);
+        EXPECT_NE(res, nullptr);
+        EXPECT_EQ(*res, x);
+
+        std::ostringstream top;
+        tree.Dump(top, binary_tree::DumpOptions(binary_tree::DumpFormat::Text, 0));
+        EXPECT_EQ(top.str(), "└──" + std::to_string(x) + "\n" + (tree.GetHeight() > 1 ? "    └──...\n" : ""));
+    }
+    EXPECT_EQ(tree.Search(100), nullptr);
+    EXPECT_EQ(tree.Insert(data[0]), nullptr);
+
+    // Lookups through a const tree do not reshape it
+    binary_tree::SplayTree<int, binary_tree::TreeStats> counted;
+    for (auto x : data) {
+        counted.Insert(x);
+    }
+    const auto& const_tree = counted;
+    std::ostringstream before, after;
+    const_tree.Dump(before);
+    uint64_t rotations = counted.StatsSnapshot().rotations;
+    for (auto x : data) {
+        EXPECT_EQ(*const_tree.Search(x), x);
+    }
+    EXPECT_EQ(const_tree.Search(100), nullptr);
+    const_tree.Dump(after);
+    EXPECT_EQ(before.str(), after.str());
+    EXPECT_EQ(counted.StatsSnapshot().rotations, rotations);
+    EXPECT_EQ(*counted.Search(data[0]), data[0]);
+    EXPECT_GT(counted.StatsSnapshot().rotations, rotations);
+
+    std::ostringstream inorder;
+    inorder << tree;
+    EXPECT_EQ(inorder.str().substr(0, inorder.str().find(']') + 1), "[ 13 25 31 41 45 49 58 65 ]");
+
+    // Random mixed operations against std::set
+    tree.Clear();
+    std::set<int> expected;
+    int samples = (kNPerfData > 10000 ? 10000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        int x = perf_data[i] % 1000;
+        if (i % 3 == 2) {
+            EXPECT_EQ(tree.Delete(x), expected.erase(x) == 1);
+        } else {
+            EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+        }
+    }
+    for (int x = 0; x < 1000; ++x) {
+        EXPECT_EQ(tree.Search(x) != nullptr, expected.count(x) == 1);
+    }
+
+    // Sorted input and sequential access stay cheap
+    tree.Clear();
+    for (int i = 0; i < kNPerfData; ++i) {
+        tree.Insert(i);
+    }
+    int64_t splay_ordered_search_time = 0;
+    {
+        Timer _(splay_ordered_search_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            tree.Search(i);
+        }
+    }
+    std::cout << "Splay tree search ordered " << kNPerfData << " times takes: "
+              << splay_ordered_search_time << " us" << std::endl;
+}
+
+TEST_F(BstTest, ZipfianSearch) {
+    binary_tree::SplayTree<int> splay;
+    binary_tree::RBTree<int> rbt;
+    binary_tree::AVLTree<int> avl;
+    for (int i = 0; i < kNPerfData; ++i) {
+        splay.Insert(perf_data[i]);
+        rbt.Insert(perf_data[i]);
+        avl.Insert(perf_data[i]);
+    }
+
+    // Hot keys are spread over the key space
+    ZipfGenerator zipf(kNPerfData, 1.0, kRandomSeed);
+    std::vector<int> queries(kNPerfData);
+    for (auto &q : queries) {
+        q = perf_data[zipf.Next()];
+    }
+
+    int64_t splay_time = 0;
+    {
+        Timer _(splay_time);
+        for (auto q : queries) {
+            splay.Search(q);
+        }
+    }
+    int64_t rbt_time = 0;
+    {
+        Timer _(rbt_time);
+        for (auto q : queries) {
+            rbt.Search(q);
+        }
+    }
+    int64_t avl_time = 0;
+    {
+        Timer _(avl_time);
+        for (auto q : queries) {
+            avl.Search(q);
+        }
+    }
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_NE(splay.Search(queries[i]), nullptr);
+    }
+
+    std::cout << "Zipfian search " << kNPerfData << " times, splay tree: " << splay_time
+              << " us, RBT: " << rbt_time << " us, AVL tree: " << avl_time << " us" << std::endl;
+}
+
+template<typename Tree>
+void CheckHintInsert(const std::vector<int>& keys) {
+    Tree tree;
+    std::set<int> expected;
+    typename Tree::TreeNodeType *hint = nullptr;
+    for (auto x : keys) {
+        auto node = tree.InsertHint(hint, x);
+        EXPECT_EQ(node != nullptr, expected.insert(x).second);
+        if (node) hint = node;
+    }
+    EXPECT_TRUE(tree.Validate().Ok());
+
+    // Finger search from the last insert, from the smallest key and from a miss
+    auto first = tree.Search(*expected.begin());
+    for (int x = -5; x < static_cast<int>(keys.size()) + 5; ++x) {
+        bool present = expected.count(x) == 1;
+        EXPECT_EQ(tree.Search(hint, x) != nullptr, present);
+        EXPECT_EQ(tree.Search(first, x) != nullptr, present);
+        if (present) {
+            EXPECT_EQ(tree.Search(tree.Search(x), x)->data_, x);
+        }
+    }
+    EXPECT_TRUE(tree.Validate().Ok());
+}
+
+TEST_F(BstTest, InsertHint) {
+    // Nearly sorted: runs of ascending keys with a few swaps and duplicates
+    std::vector<int> keys;
+    for (int i = 0; i < 2000; ++i) {
+        keys.push_back(i);
+    }
+    std::mt19937 rng(kRandomSeed);
+    for (int i = 0; i < 100; ++i) {
+        int pos = rng() % (keys.size() - 8);
+        std::swap(keys[pos], keys[pos + rng() % 8]);
+        keys.push_back(rng() % 2000);
+    }
+    std::shuffle(keys.end() - 20, keys.end(), rng);
+
+    CheckHintInsert<binary_tree::BinarySearchTree<int>>(std::vector<int>(keys.begin(), keys.begin() + 500));
+    CheckHintInsert<binary_tree::RBTree<int>>(keys);
+    CheckHintInsert<binary_tree::AVLTree<int>>(keys);
+    CheckHintInsert<binary_tree::AATree<int>>(keys);
+    CheckHintInsert<binary_tree::Treap<int>>(keys);
+    CheckHintInsert<binary_tree::ScapegoatTree<int>>(keys);
+    CheckHintInsert<binary_tree::SplayTree<int>>(keys);
+
+    // Random keys make every hint a miss, the tree must still come out right
+    std::vector<int> random_keys(perf_data, perf_data + 5000);
+    for (auto &x : random_keys) {
+        x %= 10000;
+    }
+    CheckHintInsert<binary_tree::RBTree<int>>(random_keys);
+    CheckHintInsert<binary_tree::AVLTree<int>>(random_keys);
+    CheckHintInsert<binary_tree::AATree<int>>(random_keys);
+
+    // Hinted insert of nearly sorted data against plain insert
+    std::vector<int> nearly_sorted(kNPerfData);
+    for (int i = 0; i < kNPerfData; ++i) {
+        nearly_sorted[i] = i;
+    }
+    for (int i = 0; i + 4 < kNPerfData; i += 64) {
+        std::swap(nearly_sorted[i], nearly_sorted[i + 3]);
+    }
+    binary_tree::RBTree<int, binary_tree::TreeStats> plain;
+    binary_tree::RBTree<int, binary_tree::TreeStats> hinted;
+    int64_t plain_time = 0;
+    {
+        Timer _(plain_time);
+        for (auto x : nearly_sorted) {
+            plain.Insert(x);
+        }
+    }
+    int64_t hinted_time = 0;
+    {
+        Timer _(hinted_time);
+        binary_tree::RBTreeNode<int> *hint = nullptr;
+        for (auto x : nearly_sorted) {
+            hint = hinted.InsertHint(hint, x);
+        }
+    }
+    EXPECT_TRUE(hinted.IsTreeValid());
+    EXPECT_EQ(hinted.GetHeight(), plain.GetHeight());
+    auto hinted_stats = hinted.StatsSnapshot();
+    EXPECT_LT(hinted_stats.comparisons, plain.StatsSnapshot().comparisons);
+    // O(1) amortized: links followed plus rotations per key stay a small
+    // constant, where a climb to the root would cost about the height, 20+
+    double per_key = static_cast<double>(hinted_stats.hops + hinted_stats.rotations) / kNPerfData;
+    EXPECT_LT(per_key, 4.0);
+
+    std::cout << "Nearly sorted insertion " << kNPerfData << " times, RBT Insert: " << plain_time
+              << " us (" << plain.StatsSnapshot().comparisons << " comparisons), InsertHint: "
+              << hinted_time << " us (" << hinted_stats.comparisons << " comparisons, "
+              << per_key << " hops + rotations per key)" << std::endl;
+}
+
+// Ordered by key only, seq tells equal keys apart
+struct Stamped {
+    int key;
+    int seq;
+
+    bool operator<(const Stamped& rhs) const { return key < rhs.key; }
+    bool operator>(const Stamped& rhs) const { return key > rhs.key; }
+    bool operator==(const Stamped& rhs) const { return key == rhs.key; }
+};
+
+template<typename Node>
+Node* NextNode(Node* node) {
+    if (node->right_) {
+        node = node->right_;
+        while (node->left_) node = node->left_;
+        return node;
+    }
+    while (node->parent_ && node->parent_->right_ == node) {
+        node = node->parent_;
+    }
+    return node->parent_;
+}
+
+template<typename Tree>
+Tree BuildTree(const int* keys, int n) {
+    Tree tree;
+    for (int i = 0; i < n; ++i) {
+        tree.Insert(keys[i]);
+    }
+    return tree;
+}
+
+template<typename Tree>
+void CheckCloneAndMove(const int* keys, int n) {
+    Tree tree = BuildTree<Tree>(keys, n);
+    Tree copy = tree.Clone();
+    EXPECT_TRUE(copy.Validate().Ok());
+
+    // Same shape and balance data
+    std::ostringstream original_dump, copy_dump;
+    tree.Dump(original_dump);
+    copy.Dump(copy_dump);
+    EXPECT_EQ(original_dump.str(), copy_dump.str());
+
+    // The copy has its own nodes, all in one block
+    std::vector<const char*> addresses;
+    tree.ForEach([&](int key) {
+        auto original = tree.Search(key);
+        auto cloned = copy.Search(key);
+        ASSERT_NE(cloned, nullptr);
+        EXPECT_NE(original, cloned);
+        addresses.push_back(reinterpret_cast<const char*>(cloned));
+    });
+    auto bounds = std::minmax_element(addresses.begin(), addresses.end());
+    EXPECT_EQ(static_cast<size_t>(*bounds.second - *bounds.first),
+              (addresses.size() - 1) * sizeof(typename Tree::TreeNodeType));
+
+    // Changing one leaves the other alone
+    for (int i = 0; i < n; i += 2) {
+        copy.Delete(keys[i]);
+    }
+    copy.Insert(-1);
+    EXPECT_TRUE(copy.Validate().Ok());
+    EXPECT_TRUE(tree.Validate().Ok());
+    EXPECT_EQ(tree.Search(-1), nullptr);
+    for (int i = 0; i < n; ++i) {
+        EXPECT_NE(tree.Search(keys[i]), nullptr);
+    }
+
+    // Moves hand the nodes over and leave an empty tree behind
+    std::vector<Tree> trees;
+    trees.push_back(std::move(tree));
+    trees.push_back(std::move(copy));
+    trees.push_back(BuildTree<Tree>(keys, 10));
+    EXPECT_EQ(tree.GetHeight(), 0);
+    EXPECT_TRUE(tree.Validate().Ok());
+    EXPECT_NE(tree.Insert(keys[0]), nullptr);
+    EXPECT_EQ(trees[1].Search(-1)->data_, -1);
+
+    tree = std::move(trees[0]);
+    EXPECT_TRUE(tree.Validate().Ok());
+    EXPECT_NE(tree.Search(keys[n - 1]), nullptr);
+    EXPECT_EQ(trees[0].GetHeight(), 0);
+    trees[2] = std::move(trees[1]);
+    EXPECT_TRUE(trees[2].Validate().Ok());
+    tree.Clear();
+    trees.clear();
+}
+
+namespace app {
+
+// A key type with its own formatting, found by ADL
+struct Version {
+    int major;
+    int minor;
+
+    bool operator<(const Version& rhs) const { return major < rhs.major || (major == rhs.major && minor < rhs.minor); }
+    bool operator>(const Version& rhs) const { return rhs < *this; }
+    bool operator==(const Version& rhs) const { return major == rhs.major && minor == rhs.minor; }
+};
+
+inline void FormatValue(binary_tree::TextWriter& out, const Version& version) {
+    out.Put('v');
+    FormatValue(out, version.major);
+    out.Put('.');
+    FormatValue(out, version.minor);
+}
+
+}  // namespace app
+
+// A row much wider than a cache line, ordered by its leading key
+struct WideRow {
+    int key;
+    char columns[252];
+
+    WideRow(int k = 0): key(k), columns() {}
+    WideRow(int k, char fill): key(k) { std::fill(columns, columns + sizeof(columns), fill); }
+    bool operator<(const WideRow& rhs) const { return key < rhs.key; }
+    bool operator>(const WideRow& rhs) const { return rhs.key < key; }
+    bool operator==(const WideRow& rhs) const { return key == rhs.key; }
+};
+
+// Same row with the key at the far end. Its key never shares a line with
+// the links, which is what every wide row looked like when nodes put the
+// value before the links.
+struct TailKeyRow {
+    char columns[252];
+    int key;
+
+    TailKeyRow(int k = 0): columns(), key(k) {}
+    TailKeyRow(int k, char fill): key(k) { std::fill(columns, columns + sizeof(columns), fill); }
+    bool operator<(const TailKeyRow& rhs) const { return key < rhs.key; }
+    bool operator>(const TailKeyRow& rhs) const { return rhs.key < key; }
+    bool operator==(const TailKeyRow& rhs) const { return key == rhs.key; }
+};
+
+// Bytes from the start of the node to the end of member
+template<typename Node, typename Member>
+long EndOffset(const Node& node, const Member& member) {
+    return static_cast<long>(reinterpret_cast<const char*>(&member) + sizeof(Member) - reinterpret_cast<const char*>(&node));
+}
+
+template<typename Node>
+void CheckHotLine(const Node& node) {
+    // Links and key on the first line, parent further out
+    EXPECT_LE(EndOffset(node, node.left_), 64);
+    EXPECT_LE(EndOffset(node, node.right_), 64);
+    EXPECT_LE(EndOffset(node, node.data_.key), 64);
+    EXPECT_GT(EndOffset(node, node.parent_), 64);
+}
+
+template<typename T>
+std::string Formatted(const T& value) {
+    std::ostringstream os;
+    {
+        binary_tree::TextWriter out(os);
+        FormatValue(out, value);
+    }
+    return os.str();
+}
+
+template<typename Tree>
+void CheckMultiset(const int* keys, int n) {
+    Tree tree;
+    std::multiset<int> expected;
+    for (int i = 0; i < n; ++i) {
+        int x = keys[i] % 100;
+        EXPECT_NE(tree.Insert(x), nullptr);
+        expected.insert(x);
+    }
+    EXPECT_TRUE(tree.IsTreeValid());
+    for (int i = 0; i < n; i += 3) {
+        int x = keys[i] % 100;
+        EXPECT_TRUE(tree.Delete(x));
+        expected.erase(expected.find(x));
+    }
+    EXPECT_TRUE(tree.IsTreeValid());
+
+    for (int x = -1; x <= 100; ++x) {
+        EXPECT_EQ(tree.Count(x), expected.count(x));
+        EXPECT_EQ(tree.Search(x) != nullptr, expected.count(x) > 0);
+        auto range = tree.EqualRange(x);
+        auto lower = expected.lower_bound(x);
+        auto upper = expected.upper_bound(x);
+        EXPECT_EQ(range.first ? range.first->data_ : -1, lower != expected.end() ? *lower : -1);
+        EXPECT_EQ(range.second ? range.second->data_ : -1, upper != expected.end() ? *upper : -1);
+    }
+
+    // Hinted inserts of equal keys land after the ones already there
+    auto hint = tree.LowerBound(50);
+    for (int i = 0; i < 10; ++i) {
+        hint = tree.InsertHint(hint, 50);
+        expected.insert(50);
+    }
+    EXPECT_EQ(tree.Count(50), expected.count(50));
+    EXPECT_TRUE(tree.IsTreeValid());
+}
+
+TEST_F(BstTest, MultisetTrees) {
+    int samples = (kNPerfData > 20000 ? 20000 : kNPerfData);
+    CheckMultiset<binary_tree::MultiRBTree<int>>(perf_data, samples);
+    CheckMultiset<binary_tree::MultiAVLTree<int>>(perf_data, samples);
+    CheckMultiset<binary_tree::MultiAATree<int>>(perf_data, samples);
+
+    // Equal keys come back in insertion order
+    binary_tree::MultiRBTree<Stamped> rbt;
+    binary_tree::MultiAVLTree<Stamped> avl;
+    for (int i = 0; i < samples; ++i) {
+        Stamped s = {perf_data[i] % 50, i};
+        rbt.Insert(s);
+        avl.Insert(s);
+    }
+    EXPECT_TRUE(rbt.IsTreeValid());
+    EXPECT_TRUE(avl.IsTreeValid());
+    for (int key = 0; key < 50; ++key) {
+        Stamped probe = {key, 0};
+        auto rbt_range = rbt.EqualRange(probe);
+        auto avl_range = avl.EqualRange(probe);
+        int rbt_last = -1, avl_last = -1;
+        for (auto node = rbt_range.first; node != rbt_range.second; node = NextNode(node)) {
+            EXPECT_EQ(node->data_.key, key);
+            EXPECT_GT(node->data_.seq, rbt_last);
+            rbt_last = node->data_.seq;
+        }
+        for (auto node = avl_range.first; node != avl_range.second; node = NextNode(node)) {
+            EXPECT_EQ(node->data_.key, key);
+            EXPECT_GT(node->data_.seq, avl_last);
+            avl_last = node->data_.seq;
+        }
+        EXPECT_EQ(rbt.Count(probe), avl.Count(probe));
+    }
+
+    // Count is two rank descents, however long the run of equal keys
+    binary_tree::MultiRBTree<int, binary_tree::TreeStats> runs;
+    binary_tree::MultiAVLTree<int, binary_tree::TreeStats> avl_runs;
+    for (int i = 0; i < samples; ++i) {
+        runs.Insert(i % 4 == 0 ? 7 : perf_data[i]);
+        avl_runs.Insert(i % 4 == 0 ? 7 : perf_data[i]);
+    }
+    size_t sevens = 0;
+    for (int i = 0; i < samples; ++i) {
+        sevens += (i % 4 == 0 || perf_data[i] == 7);
+    }
+    auto before = runs.StatsSnapshot();
+    EXPECT_EQ(runs.Count(7), sevens);
+    EXPECT_LE(runs.StatsSnapshot().Delta(before).comparisons, 2u * runs.GetHeight());
+    before = avl_runs.StatsSnapshot();
+    EXPECT_EQ(avl_runs.Count(7), sevens);
+    EXPECT_LE(avl_runs.StatsSnapshot().Delta(before).comparisons, 2u * avl_runs.GetHeight());
+    EXPECT_TRUE(runs.Validate().Ok());
+
+    // Tombstones drop out of the counts
+    runs.SetLazyDelete(true);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(runs.Delete(7));
+    }
+    EXPECT_EQ(runs.Count(7), sevens - 100);
+    EXPECT_TRUE(runs.Validate().Ok());
+    runs.Compact();
+    EXPECT_EQ(runs.Count(7), sevens - 100);
+    EXPECT_TRUE(runs.Validate().Ok());
+
+    // The unique-key trees still reject duplicates
+    binary_tree::RBTree<int> unique;
+    EXPECT_NE(unique.Insert(1), nullptr);
+    EXPECT_EQ(unique.Insert(1), nullptr);
+    EXPECT_EQ(unique.Count(1), 1u);
+    EXPECT_EQ(unique.Count(2), 0u);
+}
+
+TEST_F(BstTest, IntervalTree) {
+    using binary_tree::Interval;
+    binary_tree::IntervalTree<int> tree;
+    std::vector<Interval<int>> expected;
+
+    int samples = (kNPerfData > 20000 ? 20000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        int start = perf_data[i] % 100000;
+        Interval<int> interval = {start, start + 1 + perf_data[(i + 1) % kNPerfData] % 500};
+        EXPECT_NE(tree.Insert(interval), nullptr);
+        expected.push_back(interval);
+    }
+    EXPECT_TRUE(tree.IsTreeValid());
+
+    // Deletes keep the max end of every subtree up to date
+    for (int i = 0; i < samples; i += 4) {
+        EXPECT_TRUE(tree.Delete(expected[i]));
+    }
+    std::vector<Interval<int>> kept;
+    for (int i = 0; i < samples; ++i) {
+        if (i % 4 != 0) kept.push_back(expected[i]);
+    }
+    std::sort(kept.begin(), kept.end());
+    EXPECT_TRUE(tree.IsTreeValid());
+
+    for (int point = -10; point < 100600; point += 97) {
+        std::vector<Interval<int>> brute;
+        for (auto& interval : kept) {
+            if (interval.Contains(point)) brute.push_back(interval);
+        }
+        auto found = tree.Stab(point);
+        std::sort(found.begin(), found.end());
+        EXPECT_EQ(found.size(), brute.size());
+        EXPECT_TRUE(std::equal(found.begin(), found.end(), brute.begin()));
+    }
+    for (int start = 0; start < 100000; start += 1013) {
+        int end = start + 50;
+        size_t brute = 0;
+        for (auto& interval : kept) {
+            if (interval.Overlaps(Interval<int>{start, end})) ++brute;
+        }
+        EXPECT_EQ(tree.Overlapping(start, end).size(), brute);
+        EXPECT_EQ(tree.AnyOverlapping(start, end), brute > 0);
+    }
+    EXPECT_TRUE(tree.Overlapping(5, 5).empty());
+
+    // Half-open ends and duplicates
+    binary_tree::IntervalTree<int> small;
+    small.Insert({1, 3});
+    small.Insert({1, 3});
+    small.Insert({3, 4});
+    EXPECT_EQ(small.Stab(3).size(), 1u);
+    EXPECT_EQ(small.Stab(1).size(), 2u);
+    EXPECT_EQ(small.Count({1, 3}), 2u);
+    EXPECT_FALSE(small.AnyOverlapping(4, 10));
+
+    int64_t tree_time = 0;
+    size_t tree_hits = 0;
+    {
+        Timer _(tree_time);
+        for (int point = 0; point < 100000; point += 10) {
+            tree.ForEachContaining(point, [&tree_hits](const Interval<int>&) { ++tree_hits; });
+        }
+    }
+    int64_t scan_time = 0;
+    size_t scan_hits = 0;
+    {
+        Timer _(scan_time);
+        for (int point = 0; point < 100000; point += 10) {
+            for (auto& interval : kept) {
+                if (interval.Contains(point)) ++scan_hits;
+            }
+        }
+    }
+    EXPECT_EQ(tree_hits, scan_hits);
+    std::cout << "Stabbing " << kept.size() << " intervals 10000 times, interval tree: " << tree_time
+              << " us, linear scan: " << scan_time << " us" << std::endl;
+}
+
+// Not commutative: keeps the first key of the range
+struct FirstKeyMonoid {
+    using Value = std::pair<bool, int>;
+    static Value Identity() { return Value(false, 0); }
+    static Value Lift(int data) { return Value(true, data); }
+    static Value Combine(const Value& a, const Value& b) { return a.first ? a : b; }
+};
+
+struct Sample {
+    int timestamp;
+    int value;
+
+    bool operator<(const Sample& rhs) const { return timestamp < rhs.timestamp; }
+    bool operator>(const Sample& rhs) const { return timestamp > rhs.timestamp; }
+    bool operator==(const Sample& rhs) const { return timestamp == rhs.timestamp; }
+};
+
+struct SampleSum {
+    using Value = int64_t;
+    static Value Identity() { return 0; }
+    static Value Lift(const Sample& sample) { return sample.value; }
+    static Value Combine(Value a, Value b) { return a + b; }
+};
+
+template<typename Tree, typename Monoid>
+void CheckAggregate(const int* keys, int n) {
+    Tree tree;
+    std::set<int> expected;
+    for (int i = 0; i < n; ++i) {
+        int x = keys[i] % 5000;
+        EXPECT_EQ(tree.Insert(x) != nullptr, expected.insert(x).second);
+    }
+    for (int i = 0; i < n; i += 3) {
+        int x = keys[i] % 5000;
+        EXPECT_EQ(tree.Delete(x), expected.erase(x) == 1);
+    }
+    EXPECT_TRUE(tree.Validate().Ok());
+
+    for (int lo = -10; lo < 5100; lo += 37) {
+        for (int hi : {lo - 1, lo, lo + 1, lo + 50, lo + 4000}) {
+            auto value = Monoid::Identity();
+            for (auto it = expected.lower_bound(lo); it != expected.end() && *it < hi; ++it) {
+                value = Monoid::Combine(value, Monoid::Lift(*it));
+            }
+            EXPECT_EQ(tree.Aggregate(lo, hi), value);
+        }
+    }
+}
+
+TEST_F(BstTest, RangeAggregate) {
+    using namespace binary_tree;
+    int samples = (kNPerfData > 20000 ? 20000 : kNPerfData);
+    CheckAggregate<RBTree<int, NoTreeStats, UniqueKeys, MonoidAugment<SumMonoid<int>>>, SumMonoid<int>>(perf_data, samples);
+    CheckAggregate<AVLTree<int, NoTreeStats, UniqueKeys, MonoidAugment<SumMonoid<int>>>, SumMonoid<int>>(perf_data, samples);
+    CheckAggregate<RBTree<int, NoTreeStats, UniqueKeys, MonoidAugment<MinMonoid<int>>>, MinMonoid<int>>(perf_data, samples);
+    CheckAggregate<AVLTree<int, NoTreeStats, UniqueKeys, MonoidAugment<MaxMonoid<int>>>, MaxMonoid<int>>(perf_data, samples);
+    CheckAggregate<RBTree<int, NoTreeStats, UniqueKeys, MonoidAugment<FirstKeyMonoid>>, FirstKeyMonoid>(perf_data, samples);
+    CheckAggregate<AVLTree<int, NoTreeStats, UniqueKeys, MonoidAugment<FirstKeyMonoid>>, FirstKeyMonoid>(perf_data, samples);
+
+    // Values keyed by timestamp, several samples per timestamp
+    RBTree<Sample, TreeStats, MultiKeys, MonoidAugment<SampleSum>> series;
+    std::vector<int64_t> prefix(1001, 0);
+    for (int i = 0; i < samples; ++i) {
+        Sample sample = {perf_data[i] % 1000, i % 100};
+        series.Insert(sample);
+        prefix[sample.timestamp + 1] += sample.value;
+    }
+    for (int t = 0; t < 1000; ++t) {
+        prefix[t + 1] += prefix[t];
+    }
+    EXPECT_TRUE(series.IsTreeValid());
+
+    series.ResetStats();
+    int queries = 0;
+    for (int lo = 0; lo < 1000; lo += 7, ++queries) {
+        int hi = std::min(1000, lo + 300);
+        EXPECT_EQ(series.Aggregate(Sample{lo, 0}, Sample{hi, 0}), prefix[hi] - prefix[lo]);
+    }
+    std::cout << "Range sums over " << samples << " samples: "
+              << series.StatsSnapshot().comparisons / queries << " comparisons per query" << std::endl;
+}
+
+TEST_F(BstTest, FlatSet) {
+    binary_tree::FlatSet<int> flat;
+    std::set<int> expected;
+    for (auto x : data) {
+        EXPECT_EQ(flat.Insert(x) != nullptr, expected.insert(x).second);
+    }
+    EXPECT_TRUE(std::equal(flat.begin(), flat.end(), expected.begin()));
+
+    int samples = (kNPerfData > 5000 ? 5000 : kNPerfData);
+    for (int i = 0; i < samples; ++i) {
+        int x = perf_data[i] % 1000;
+        if (i % 3 == 2) {
+            EXPECT_EQ(flat.Delete(x), expected.erase(x) == 1);
+        } else {
+            EXPECT_EQ(flat.Insert(x) != nullptr, expected.insert(x).second);
+        }
+    }
+    EXPECT_EQ(flat.Size(), expected.size());
+    for (int x = -1; x <= 1000; ++x) {
+        auto found = flat.Search(x);
+        EXPECT_EQ(found != nullptr, expected.count(x) == 1);
+        if (found) {
+            EXPECT_EQ(*found, x);
+        }
+    }
+
+    // Batches merge in, duplicates inside the batch and against the set are dropped
+    std::vector<int> batch(perf_data + samples, perf_data + 2 * samples);
+    for (auto &x : batch) {
+        x %= 2000;
+    }
+    size_t before = expected.size();
+    expected.insert(batch.begin(), batch.end());
+    EXPECT_EQ(flat.InsertBatch(batch), expected.size() - before);
+    EXPECT_EQ(flat.Size(), expected.size());
+    EXPECT_TRUE(std::equal(flat.begin(), flat.end(), expected.begin()));
+
+    flat.Clear();
+    EXPECT_TRUE(flat.Empty());
+    EXPECT_EQ(flat.Search(1), nullptr);
+
+    // The adaptive set switches to a tree past the threshold and keeps its keys
+    binary_tree::AdaptiveSet<int> adaptive(64);
+    expected.clear();
+    for (int i = 0; i < 1000; ++i) {
+        int x = perf_data[i] % 500;
+        EXPECT_EQ(adaptive.Insert(x) != nullptr, expected.insert(x).second);
+        EXPECT_EQ(adaptive.IsPromoted(), expected.size() > 64);
+        if (adaptive.IsPromoted()) break;
+    }
+    EXPECT_TRUE(adaptive.IsPromoted());
+    EXPECT_TRUE(adaptive.Tree().IsTreeValid());
+    for (int i = 0; i < 2000; ++i) {
+        int x = perf_data[i] % 500;
+        if (i % 2) {
+            EXPECT_EQ(adaptive.Delete(x), expected.erase(x) == 1);
+        } else {
+            EXPECT_EQ(adaptive.Insert(x) != nullptr, expected.insert(x).second);
+        }
+    }
+    EXPECT_EQ(adaptive.Size(), expected.size());
+    for (int x = 0; x < 500; ++x) {
+        EXPECT_EQ(adaptive.Search(x) != nullptr, expected.count(x) == 1);
+    }
+    adaptive.Clear();
+    EXPECT_FALSE(adaptive.IsPromoted());
+    EXPECT_EQ(adaptive.Size(), 0u);
+
+    // Lookups in a small set
+    const int kSmall = 500;
+    binary_tree::FlatSet<int> small_flat;
+    binary_tree::RBTree<int> small_rbt;
+    for (int i = 0; i < kSmall; ++i) {
+        small_flat.Insert(perf_data[i]);
+        small_rbt.Insert(perf_data[i]);
+    }
+    int64_t flat_time = 0;
+    size_t flat_hits = 0;
+    {
+        Timer _(flat_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            flat_hits += (small_flat.Search(perf_data[i % (2 * kSmall)]) != nullptr);
+        }
+    }
+    int64_t rbt_time = 0;
+    size_t rbt_hits = 0;
+    {
+        Timer _(rbt_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            rbt_hits += (small_rbt.Search(perf_data[i % (2 * kSmall)]) != nullptr);
+        }
+    }
+    EXPECT_EQ(flat_hits, rbt_hits);
+    std::cout << "Search " << kSmall << " keys " << kNPerfData << " times, flat set: " << flat_time
+              << " us, RBT: " << rbt_time << " us" << std::endl;
+}
+
+TEST_F(BstTest, PrefetchSearch) {
+    binary_tree::RBTree<int> rbt;
+    binary_tree::AVLTree<int> avl;
+    for (int i = 0; i < kNPerfData; ++i) {
+        rbt.Insert(perf_data[i]);
+        avl.Insert(perf_data[i]);
+    }
+
+    // Half hits, half misses
+    std::vector<int> queries(kNPerfData);
+    std::mt19937 rng(kRandomSeed);
+    for (auto &q : queries) {
+        q = static_cast<int>(rng() % (2 * kNPerfData)) - kNPerfData / 2;
+    }
+
+    int64_t search_time = 0;
+    std::vector<binary_tree::RBTreeNode<int>*> expected(queries.size());
+    {
+        Timer _(search_time);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            expected[i] = rbt.Search(queries[i]);
+        }
+    }
+    int64_t prefetch_time = 0;
+    std::vector<binary_tree::RBTreeNode<int>*> prefetched(queries.size());
+    {
+        Timer _(prefetch_time);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            prefetched[i] = rbt.SearchPrefetch(queries[i]);
+        }
+    }
+    int64_t multi_time = 0;
+    std::vector<binary_tree::RBTreeNode<int>*> batched;
+    {
+        Timer _(multi_time);
+        batched = rbt.MultiSearch(queries);
+    }
+    EXPECT_TRUE(prefetched == expected);
+    EXPECT_TRUE(batched == expected);
+
+    auto avl_batched = avl.MultiSearch(queries);
+    for (size_t i = 0; i < queries.size(); i += 97) {
+        EXPECT_EQ(avl_batched[i], avl.Search(queries[i]));
+        EXPECT_EQ(avl.SearchPrefetch(queries[i]), avl.Search(queries[i]));
+    }
+
+    // Odd batch sizes and an empty tree
+    EXPECT_TRUE(rbt.MultiSearch(std::vector<int>()).empty());
+    std::vector<int> odd(queries.begin(), queries.begin() + 37);
+    auto odd_results = rbt.MultiSearch(odd);
+    EXPECT_TRUE(std::equal(odd_results.begin(), odd_results.end(), expected.begin()));
+    binary_tree::RBTree<int> empty;
+    EXPECT_EQ(empty.SearchPrefetch(1), nullptr);
+    EXPECT_EQ(empty.MultiSearch(odd), std::vector<binary_tree::RBTreeNode<int>*>(odd.size(), nullptr));
+
+    std::cout << "RBT random search " << queries.size() << " times, Search: " << search_time
+              << " us, SearchPrefetch: " << prefetch_time << " us, MultiSearch: " << multi_time
+              << " us" << std::endl;
+}
+
+TEST_F(BstTest, ShardedTree) {
+    using Sharded = binary_tree::ShardedTree<binary_tree::RBTree<int>>;
+    EXPECT_THROW(Sharded(0, std::vector<int>()), std::runtime_error);
+
+    const int kThreads = 4;
+    const int kKeys = 200000;
+    std::vector<int> sample(perf_data, perf_data + 1000);
+    for (auto &x : sample) {
+        x %= kKeys;
+    }
+
+    Sharded sharded(8, sample);
+    EXPECT_EQ(sharded.ShardCount(), 8u);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kThreads; ++t) {
+        writers.push_back(std::thread([&sharded, t, kThreads, kKeys]() {
+            for (int x = t; x < kKeys; x += kThreads) {
+                sharded.Insert(x);
+            }
+        }));
+    }
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    EXPECT_EQ(sharded.Size(), static_cast<size_t>(kKeys));
+    EXPECT_TRUE(sharded.IsTreeValid());
+    EXPECT_FALSE(sharded.Insert(5));
+    EXPECT_TRUE(sharded.Contains(kKeys - 1));
+    EXPECT_FALSE(sharded.Contains(kKeys));
+
+    // Ordered across shards
+    int expected = 0;
+    bool ordered = true;
+    sharded.ForEach([&](int x) {
+        ordered = ordered && (x == expected++);
+    });
+    EXPECT_TRUE(ordered);
+    EXPECT_EQ(expected, kKeys);
+
+    auto range = sharded.RangeQuery(12345, 54321);
+    EXPECT_EQ(range.size(), static_cast<size_t>(54321 - 12345));
+    EXPECT_EQ(range.front(), 12345);
+    EXPECT_EQ(range.back(), 54320);
+    EXPECT_TRUE(sharded.RangeQuery(10, 10).empty());
+
+    // Skew everything into the upper shards, then rebalance while readers run
+    for (int x = 0; x < kKeys * 3 / 4; ++x) {
+        EXPECT_TRUE(sharded.Delete(x));
+    }
+    auto sizes = sharded.ShardSizes();
+    EXPECT_GT(*std::max_element(sizes.begin(), sizes.end()), 2 * sharded.Size() / sharded.ShardCount());
+
+    std::atomic<bool> stop(false);
+    std::atomic<int> missing(0);
+    std::thread reader([&]() {
+        while (!stop) {
+            for (int x = kKeys * 3 / 4; x < kKeys; x += 101) {
+                if (!sharded.Contains(x)) ++missing;
+            }
+        }
+    });
+    EXPECT_TRUE(sharded.Rebalance());
+    stop = true;
+    reader.join();
+    EXPECT_EQ(missing, 0);
+    EXPECT_TRUE(sharded.IsTreeValid());
+    EXPECT_EQ(sharded.Size(), static_cast<size_t>(kKeys / 4));
+    sizes = sharded.ShardSizes();
+    EXPECT_LE(*std::max_element(sizes.begin(), sizes.end()), 2 * sharded.Size() / sharded.ShardCount());
+    EXPECT_FALSE(sharded.Rebalance());
+    EXPECT_EQ(sharded.RangeQuery(0, kKeys).size(), static_cast<size_t>(kKeys / 4));
+
+    // Write throughput, one thread against kThreads threads on disjoint keys
+    auto timed_insert = [&](int n_threads) {
+        Sharded tree(16, sample);
+        int64_t time = 0;
+        {
+            Timer _(time);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < n_threads; ++t) {
+                threads.push_back(std::thread([&tree, t, n_threads, kKeys]() {
+                    for (int x = t; x < kKeys; x += n_threads) {
+                        tree.Insert(x);
+                    }
+                }));
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+        }
+        return time;
+    };
+    int64_t one_thread_time = timed_insert(1);
+    int64_t many_threads_time = timed_insert(kThreads);
+    std::cout << "Sharded RBT insert " << kKeys << " items, 1 thread: " << one_thread_time
+              << " us, " << kThreads << " threads: " << many_threads_time << " us ("
+              << std::thread::hardware_concurrency() << " cores)" << std::endl;
+}
+
+TEST_F(BstTest, EpochReclamation) {
+    // Readers walk nodes unlinked by a writer, pinned they never see one reclaimed
+    struct Payload {
+        int value;
+        int check;
+        Payload(int v): value(v), check(~v) {}
+        ~Payload() { check = value; }
+    };
+    {
+        binary_tree::EpochManager epoch;
+        auto make_payload = [&epoch](int value) {
+            return new (epoch.Allocate(sizeof(Payload))) Payload(value);
+        };
+        std::atomic<Payload*> current(make_payload(0));
+        std::atomic<bool> stop(false);
+        std::atomic<int> torn(0);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t) {
+            readers.push_back(std::thread([&]() {
+                while (!stop) {
+                    auto guard = epoch.Pin();
+                    Payload *payload = current.load();
+                    for (int i = 0; i < 10; ++i) {
+                        if (payload->check != ~payload->value) ++torn;
+                    }
+                }
+            }));
+        }
+        for (int i = 1; i <= 20000; ++i) {
+            Payload *old = current.exchange(make_payload(i));
+            epoch.Retire(old, sizeof(Payload), [](void* object) {
+                static_cast<Payload*>(object)->~Payload();
+            });
+        }
+        stop = true;
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        EXPECT_EQ(torn, 0);
+        EXPECT_GT(epoch.Epoch(), 0u);
+        // With the readers gone two collections reclaim everything
+        epoch.Collect();
+        epoch.Collect();
+        EXPECT_EQ(epoch.PendingCount(), 0u);
+        Payload *last = current.load();
+        last->~Payload();
+        ::operator delete(last);
+    }
+
+    // A tree freeing through the manager
+    binary_tree::EpochManager epoch;
+    binary_tree::RBTree<int, binary_tree::TreeStats> rbt;
+    rbt.SetReclaimer(&epoch);
+    EXPECT_EQ(rbt.GetReclaimer(), &epoch);
+    for (int i = 0; i < 1000; ++i) {
+        rbt.Insert(i);
+    }
+    EXPECT_THROW(rbt.SetReclaimer(nullptr), std::runtime_error);
+
+    std::unordered_set<const void*> nodes;
+    for (int i = 0; i < 1000; ++i) {
+        nodes.insert(rbt.Search(i));
+    }
+    {
+        // Nothing is reclaimed while this thread stays pinned
+        auto guard = epoch.Pin();
+        for (int i = 0; i < 1000; i += 2) {
+            EXPECT_TRUE(rbt.Delete(i));
+        }
+        for (int i = 0; i < 5; ++i) {
+            epoch.Collect();
+        }
+        EXPECT_EQ(epoch.PendingCount(), 500u);
+    }
+    EXPECT_TRUE(rbt.IsTreeValid());
+
+    size_t reclaimed = 0;
+    for (int i = 0; i < 5; ++i) {
+        reclaimed += epoch.Collect();
+    }
+    EXPECT_EQ(reclaimed, 500u);
+    EXPECT_EQ(epoch.PendingCount(), 0u);
+
+    // New nodes reuse the reclaimed memory
+    size_t reused = 0;
+    for (int i = 0; i < 1000; i += 2) {
+        reused += nodes.count(rbt.Insert(i));
+    }
+    EXPECT_EQ(reused, 500u);
+    EXPECT_TRUE(rbt.IsTreeValid());
+    auto stats = rbt.StatsSnapshot();
+    EXPECT_EQ(stats.allocations, 1500u);
+    EXPECT_EQ(stats.deallocations, 500u);
+}
+
+TEST_F(BstTest, LazyDelete) {
+    const int n = 10000;
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; ++i) {
+        keys[i] = i;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(kRandomSeed));
+
+    binary_tree::RBTree<int, binary_tree::TreeStats> rbt;
+    for (int key : keys) {
+        rbt.Insert(key);
+    }
+    rbt.SetLazyDelete(true);
+    EXPECT_TRUE(rbt.IsLazyDelete());
+    int height = rbt.GetHeight();
+    for (int i = 0; i < n; i += 2) {
+        EXPECT_TRUE(rbt.Delete(i));
+    }
+    EXPECT_FALSE(rbt.Delete(0));
+    EXPECT_EQ(rbt.TombstoneCount(), static_cast<size_t>(n / 2));
+    // Nothing moved
+    EXPECT_EQ(rbt.GetHeight(), height);
+    EXPECT_TRUE(rbt.IsTreeValid());
+
+    // Tombstones are invisible to lookups and traversals
+    EXPECT_EQ(rbt.Search(4), nullptr);
+    EXPECT_EQ(rbt.SearchPrefetch(4), nullptr);
+    EXPECT_EQ(rbt.Search(rbt.Search(7), 4), nullptr);
+    ASSERT_NE(rbt.Search(5), nullptr);
+    EXPECT_EQ(rbt.LowerBound(4)->data_, 5);
+    EXPECT_EQ(rbt.UpperBound(3)->data_, 5);
+    EXPECT_EQ(rbt.LowerBound(0)->data_, 1);
+    EXPECT_EQ(rbt.Count(4), 0u);
+    EXPECT_EQ(rbt.Count(5), 1u);
+    auto found = rbt.MultiSearch(std::vector<int>{2, 3, 4, 5});
+    EXPECT_EQ(found[0], nullptr);
+    EXPECT_EQ(found[1]->data_, 3);
+    EXPECT_EQ(found[2], nullptr);
+    EXPECT_EQ(found[3]->data_, 5);
+    std::vector<int> visited;
+    rbt.ForEach([&visited](int key) { visited.push_back(key); });
+    ASSERT_EQ(visited.size(), static_cast<size_t>(n / 2));
+    for (size_t i = 0; i < visited.size(); ++i) {
+        EXPECT_EQ(visited[i], static_cast<int>(2 * i + 1));
+    }
+    visited.clear();
+    rbt.ForEachInRange(10, 20, [&visited](int key) { visited.push_back(key); });
+    EXPECT_EQ(visited, (std::vector<int>{11, 13, 15, 17, 19}));
+
+    // Inserting a deleted key takes its slot back
+    ASSERT_NE(rbt.Insert(4), nullptr);
+    EXPECT_EQ(rbt.Insert(4), nullptr);
+    ASSERT_NE(rbt.InsertHint(rbt.Search(5), 6), nullptr);
+    EXPECT_EQ(rbt.Search(6)->data_, 6);
+    EXPECT_EQ(rbt.TombstoneCount(), static_cast<size_t>(n / 2 - 2));
+    EXPECT_TRUE(rbt.IsTreeValid());
+
+    // Half the tree is tombstones, Compact relinks what is left
+    EXPECT_EQ(rbt.Compact(), static_cast<size_t>(n / 2 - 2));
+    EXPECT_EQ(rbt.TombstoneCount(), 0u);
+    EXPECT_TRUE(rbt.IsTreeValid());
+    EXPECT_LE(rbt.GetHeight(), height);
+    auto stats = rbt.StatsSnapshot();
+    EXPECT_EQ(stats.allocations - stats.deallocations, static_cast<uint64_t>(n / 2 + 2));
+
+    // A few tombstones are unlinked one by one
+    for (int i = 1; i < 100; i += 10) {
+        EXPECT_TRUE(rbt.Delete(i));
+    }
+    EXPECT_EQ(rbt.Compact(), 10u);
+    EXPECT_TRUE(rbt.IsTreeValid());
+    EXPECT_EQ(rbt.Search(11), nullptr);
+    EXPECT_NE(rbt.Search(13), nullptr);
+
+    // Clearing through the base drops the tombstone count with the nodes
+    {
+        binary_tree::RBTree<int> cleared;
+        cleared.SetLazyDelete(true);
+        for (int i = 0; i < 100; ++i) {
+            cleared.Insert(i);
+        }
+        for (int i = 0; i < 50; ++i) {
+            cleared.Delete(i);
+        }
+        EXPECT_EQ(cleared.TombstoneCount(), 50u);
+        binary_tree::BinaryTreeBase<int, binary_tree::RBTreeNode<int>, binary_tree::NoTreeStats>& base = cleared;
+        base.Clear();
+        EXPECT_EQ(cleared.TombstoneCount(), 0u);
+        EXPECT_EQ(cleared.Compact(), 0u);
+    }
+
+    // Turning it off compacts
+    EXPECT_TRUE(rbt.Delete(13));
+    rbt.SetLazyDelete(false);
+    EXPECT_EQ(rbt.TombstoneCount(), 0u);
+    EXPECT_TRUE(rbt.Delete(15));
+    EXPECT_TRUE(rbt.IsTreeValid());
+
+    // Multiset: a tombstone hides one copy
+    binary_tree::MultiRBTree<int> multi;
+    multi.SetLazyDelete(true);
+    for (int copy = 0; copy < 5; ++copy) {
+        for (int i = 0; i < 100; ++i) {
+            multi.Insert(i);
+        }
+    }
+    EXPECT_TRUE(multi.Delete(42));
+    EXPECT_TRUE(multi.Delete(42));
+    EXPECT_EQ(multi.Count(42), 3u);
+    EXPECT_NE(multi.Search(42), nullptr);
+    for (int copy = 0; copy < 3; ++copy) {
+        EXPECT_TRUE(multi.Delete(42));
+    }
+    EXPECT_FALSE(multi.Delete(42));
+    EXPECT_EQ(multi.Search(42), nullptr);
+    EXPECT_EQ(multi.LowerBound(42)->data_, 43);
+    EXPECT_EQ(multi.Compact(), 5u);
+    EXPECT_EQ(multi.Count(43), 5u);
+    EXPECT_TRUE(multi.IsTreeValid());
+
+    // Summaries would still count tombstones
+    binary_tree::RBTree<int, binary_tree::NoTreeStats, binary_tree::UniqueKeys,
+                        binary_tree::MonoidAugment<binary_tree::SumMonoid<int>>> summed;
+    EXPECT_THROW(summed.SetLazyDelete(true), std::runtime_error);
+
+    // Random mix against std::set
+    std::mt19937 rng(kRandomSeed);
+    binary_tree::RBTree<int> mixed;
+    mixed.SetLazyDelete(true);
+    std::set<int> reference;
+    for (int round = 0; round < 20000; ++round) {
+        int key = static_cast<int>(rng() % 2000);
+        if (rng() % 2) {
+            EXPECT_EQ(mixed.Insert(key) != nullptr, reference.insert(key).second);
+        } else {
+            EXPECT_EQ(mixed.Delete(key), reference.erase(key) == 1);
+        }
+        if (round % 3000 == 0) mixed.Compact();
+    }
+    std::vector<int> contents;
+    mixed.ForEach([&contents](int key) { contents.push_back(key); });
+    EXPECT_EQ(contents, std::vector<int>(reference.begin(), reference.end()));
+    mixed.Compact();
+    EXPECT_TRUE(mixed.IsTreeValid());
+    contents.clear();
+    mixed.ForEach([&contents](int key) { contents.push_back(key); });
+    EXPECT_EQ(contents, std::vector<int>(reference.begin(), reference.end()));
+
+    // Latency of the delete calls
+    {
+        int64_t eager_time = 0, lazy_time = 0, compact_time = 0;
+        binary_tree::RBTree<int> eager, lazy;
+        lazy.SetLazyDelete(true);
+        for (int i = 0; i < kNPerfData; ++i) {
+            eager.Insert(perf_data[i]);
+            lazy.Insert(perf_data[i]);
+        }
+        {
+            Timer _(eager_time);
+            for (int i = 0; i < kNPerfData; i += 2) {
+                eager.Delete(perf_data[i]);
+            }
+        }
+        {
+            Timer _(lazy_time);
+            for (int i = 0; i < kNPerfData; i += 2) {
+                lazy.Delete(perf_data[i]);
+            }
+        }
+        {
+            Timer _(compact_time);
+            lazy.Compact();
+        }
+        std::cout << "Eager delete time: " << eager_time << "us" << std::endl;
+        std::cout << "Lazy delete time: " << lazy_time << "us, compact: " << compact_time << "us" << std::endl;
+    }
+}
+
+TEST_F(BstTest, CloneAndMove) {
+    const int n = 2000;
+    CheckCloneAndMove<binary_tree::BinarySearchTree<int>>(perf_data, n);
+    CheckCloneAndMove<binary_tree::RBTree<int>>(perf_data, n);
+    CheckCloneAndMove<binary_tree::AVLTree<int>>(perf_data, n);
+    CheckCloneAndMove<binary_tree::AATree<int>>(perf_data, n);
+    CheckCloneAndMove<binary_tree::Treap<int>>(perf_data, n);
+    CheckCloneAndMove<binary_tree::ScapegoatTree<int>>(perf_data, n);
+    CheckCloneAndMove<binary_tree::SplayTree<int>>(perf_data, n);
+
+    // Tombstones and tracked sizes come along
+    binary_tree::RBTree<int> lazy = BuildTree<binary_tree::RBTree<int>>(perf_data, n);
+    lazy.SetLazyDelete(true);
+    lazy.Delete(perf_data[0]);
+    binary_tree::RBTree<int> lazy_copy = lazy.Clone();
+    EXPECT_TRUE(lazy_copy.IsLazyDelete());
+    EXPECT_EQ(lazy_copy.TombstoneCount(), 1u);
+    EXPECT_EQ(lazy_copy.Search(perf_data[0]), nullptr);
+    EXPECT_EQ(lazy_copy.Compact(), 1u);
+    binary_tree::RBTree<int> lazy_moved(std::move(lazy));
+    EXPECT_EQ(lazy.TombstoneCount(), 0u);
+    EXPECT_EQ(lazy_moved.TombstoneCount(), 1u);
+
+    binary_tree::ScapegoatTree<int> sgt(0.6);
+    for (int i = 0; i < 100; ++i) {
+        sgt.Insert(i);
+    }
+    binary_tree::ScapegoatTree<int> sgt_copy = sgt.Clone();
+    EXPECT_EQ(sgt_copy.Size(), 100u);
+    EXPECT_EQ(sgt_copy.GetAlpha(), 0.6);
+    binary_tree::ScapegoatTree<int> sgt_moved(std::move(sgt));
+    EXPECT_EQ(sgt.Size(), 0u);
+    EXPECT_TRUE(sgt.Validate().Ok());
+    EXPECT_TRUE(sgt_moved.Validate().Ok());
+
+    binary_tree::IntervalTree<int> intervals;
+    intervals.Insert({1, 5});
+    intervals.Insert({3, 9});
+    binary_tree::IntervalTree<int> intervals_copy = intervals.Clone();
+    intervals.Clear();
+    EXPECT_EQ(intervals_copy.Stab(4).size(), 2u);
+    EXPECT_TRUE(intervals_copy.Validate().Ok());
+
+    // Counters move with the nodes, moves can't throw
+    binary_tree::RBTree<int, binary_tree::TreeStats> counted =
+        BuildTree<binary_tree::RBTree<int, binary_tree::TreeStats>>(perf_data, n);
+    size_t comparisons = counted.StatsSnapshot().comparisons;
+    binary_tree::RBTree<int, binary_tree::TreeStats> counted_moved(std::move(counted));
+    EXPECT_EQ(counted.StatsSnapshot().comparisons, 0u);
+    EXPECT_EQ(counted_moved.StatsSnapshot().comparisons, comparisons);
+    counted = std::move(counted_moved);
+    EXPECT_EQ(counted_moved.StatsSnapshot().allocations, 0u);
+    EXPECT_EQ(counted.StatsSnapshot().comparisons, comparisons);
+    static_assert(std::is_nothrow_move_constructible<binary_tree::RBTree<int>>::value, "");
+    static_assert(std::is_nothrow_move_assignable<binary_tree::Treap<int>>::value, "");
+    static_assert(std::is_nothrow_move_assignable<binary_tree::ScapegoatTree<int>>::value, "");
+    static_assert(std::is_nothrow_move_constructible<binary_tree::ImplicitTreap<int>>::value, "");
+
+    binary_tree::ImplicitTreap<int> seq;
+    for (int i = 0; i < n; ++i) {
+        seq.Insert(perf_data[i] % (seq.Size() + 1), i);
+    }
+    std::vector<int> order = seq.ToVector();
+    binary_tree::ImplicitTreap<int> seq_copy = seq.Clone();
+    seq.Erase(0);
+    EXPECT_EQ(seq_copy.ToVector(), order);
+    binary_tree::ImplicitTreap<int> seq_moved(std::move(seq_copy));
+    EXPECT_EQ(seq_copy.Size(), 0u);
+    EXPECT_EQ(seq_moved.ToVector(), order);
+    seq = std::move(seq_moved);
+    EXPECT_EQ(seq_moved.Size(), 0u);
+    EXPECT_EQ(seq.ToVector(), order);
+
+    // Cloned treap nodes can move to another treap
+    binary_tree::Treap<int> treap = BuildTree<binary_tree::Treap<int>>(perf_data, n);
+    binary_tree::Treap<int> lower = treap.Clone();
+    binary_tree::Treap<int> upper;
+    lower.Split(kNPerfData / 2, &upper);
+    lower.Clear();
+    EXPECT_TRUE(upper.IsTreeValid());
+    for (int i = 0; i < n; ++i) {
+        upper.Delete(perf_data[i]);
+    }
+    EXPECT_EQ(upper.GetHeight(), 0);
+    binary_tree::Treap<int> left = treap.Clone(), right;
+    left.Split(kNPerfData / 2, &right);
+    left.Merge(right);
+    right.Clear();
+    EXPECT_TRUE(left.IsTreeValid());
+    for (int i = 0; i < n; ++i) {
+        EXPECT_NE(left.Search(perf_data[i]), nullptr);
+    }
+
+    // A clone against building the same tree again
+    {
+        int64_t insert_time = 0, clone_time = 0;
+        binary_tree::RBTree<int> rbt = BuildTree<binary_tree::RBTree<int>>(perf_data, kNPerfData);
+        {
+            Timer _(insert_time);
+            binary_tree::RBTree<int> rebuilt = BuildTree<binary_tree::RBTree<int>>(perf_data, kNPerfData);
+        }
+        {
+            Timer _(clone_time);
+            binary_tree::RBTree<int> cloned = rbt.Clone();
+        }
+        std::cout << "RB Tree rebuild time: " << insert_time << "us" << std::endl;
+        std::cout << "RB Tree clone time: " << clone_time << "us" << std::endl;
+    }
+}
+
+namespace app {
+
+// Owns a heap buffer, reported through the HeapBytes customization point
+struct Blob {
+    int key;
+    std::vector<char> bytes;
+
+    bool operator<(const Blob& rhs) const { return key < rhs.key; }
+    bool operator>(const Blob& rhs) const { return rhs.key < key; }
+    bool operator==(const Blob& rhs) const { return key == rhs.key; }
+};
+
+inline size_t HeapBytes(const Blob& blob) {
+    return blob.bytes.capacity() ? binary_tree::HeapAllocationSize(blob.bytes.capacity()) : 0;
+}
+
+}  // namespace app
+
+TEST_F(BstTest, MemoryUsage) {
+    using binary_tree::HeapAllocationSize;
+    const int n = 10000;
+
+    binary_tree::AVLTree<int> avl;
+    for (int i = 0; i < n; ++i) {
+        avl.Insert(i);
+    }
+    const size_t avl_node = sizeof(binary_tree::AVLTree<int>::TreeNodeType);
+    auto usage = avl.MemoryUsage();
+    EXPECT_EQ(usage.nodes, static_cast<size_t>(n));
+    EXPECT_EQ(usage.node_size, avl_node);
+    EXPECT_EQ(usage.node_bytes, n * avl_node);
+    EXPECT_EQ(usage.allocator_slack, n * (HeapAllocationSize(avl_node) - avl_node));
+    EXPECT_EQ(usage.payload_bytes, 0u);
+    EXPECT_EQ(usage.Total(), n * HeapAllocationSize(avl_node));
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+    // The heap model matches what glibc malloc really reserves
+    EXPECT_EQ(HeapAllocationSize(avl_node), malloc_usable_size(avl.Search(0)) + sizeof(size_t));
+    for (size_t size : {1, 24, 25, 40, 100, 1000}) {
+        void *memory = std::malloc(size);
+        EXPECT_EQ(HeapAllocationSize(size), malloc_usable_size(memory) + sizeof(size_t));
+        std::free(memory);
+    }
+#endif
+
+    // Heap-owning keys: short strings stay inline, long ones are counted
+    binary_tree::RBTree<std::string> strings;
+    strings.Insert("short");
+    std::string long_key(100, 'x');
+    strings.Insert(long_key);
+    EXPECT_EQ(strings.MemoryUsage().payload_bytes, binary_tree::HeapBytes(long_key));
+    EXPECT_GE(binary_tree::HeapBytes(long_key), 101u);
+
+    // User types through ADL, payloads out of line
+    binary_tree::RBTree<app::Blob> blobs;
+    blobs.Insert(app::Blob{1, std::vector<char>(1000)});
+    blobs.Insert(app::Blob{2, std::vector<char>()});
+    EXPECT_EQ(blobs.MemoryUsage().payload_bytes, HeapAllocationSize(1000));
+
+    using Row = binary_tree::KeyPayload<int, std::vector<int>>;
+    binary_tree::RBTree<Row> rows;
+    rows.Insert(Row(1, std::vector<int>(10)));
+    rows.Insert(Row(2));
+    EXPECT_EQ(rows.MemoryUsage().payload_bytes,
+              HeapAllocationSize(sizeof(std::vector<int>)) + HeapAllocationSize(10 * sizeof(int)));
+
+    // A clone is one block, freeing from it leaves holes until the block goes
+    binary_tree::AVLTree<int> copy = avl.Clone();
+    usage = copy.MemoryUsage();
+    EXPECT_EQ(usage.block_bytes, n * avl_node);
+    EXPECT_EQ(usage.block_free_bytes, 0u);
+    EXPECT_EQ(usage.allocator_slack, HeapAllocationSize(n * avl_node) - n * avl_node);
+    for (int i = 0; i < n; i += 2) {
+        copy.Delete(i);
+    }
+    copy.Insert(-1);
+    usage = copy.MemoryUsage();
+    EXPECT_EQ(usage.nodes, static_cast<size_t>(n / 2 + 1));
+    EXPECT_EQ(usage.block_free_bytes, (n / 2) * avl_node);
+    EXPECT_GT(usage.Fragmentation(), 0.45);
+    // Compacting into a fresh tree gives the memory back
+    binary_tree::AVLTree<int> compacted;
+    copy.ForEach([&](int x) { compacted.Insert(x); });
+    EXPECT_EQ(compacted.MemoryUsage().block_bytes, 0u);
+    EXPECT_LT(compacted.MemoryUsage().Fragmentation(), 0.3);
+
+    // Tombstones hold their nodes
+    binary_tree::RBTree<int> lazy;
+    for (int i = 0; i < 100; ++i) {
+        lazy.Insert(i);
+    }
+    lazy.SetLazyDelete(true);
+    for (int i = 0; i < 50; ++i) {
+        lazy.Delete(i);
+    }
+    EXPECT_EQ(lazy.MemoryUsage().nodes, 100u);
+    lazy.Compact();
+    EXPECT_EQ(lazy.MemoryUsage().nodes, 50u);
+
+    // The other containers report the same way
+    binary_tree::FlatSet<int> flat;
+    flat.Reserve(100);
+    for (int i = 0; i < 10; ++i) {
+        flat.Insert(i);
+    }
+    EXPECT_EQ(flat.MemoryUsage().node_bytes, 10 * sizeof(int));
+    EXPECT_EQ(flat.MemoryUsage().Total(), HeapAllocationSize(100 * sizeof(int)));
+
+    binary_tree::ImplicitTreap<std::string> sequence;
+    sequence.PushBack(long_key);
+    sequence.PushBack("a");
+    EXPECT_EQ(sequence.MemoryUsage().nodes, 2u);
+    EXPECT_EQ(sequence.MemoryUsage().payload_bytes, binary_tree::HeapBytes(long_key));
+
+    std::vector<int> sample(perf_data, perf_data + 1000);
+    binary_tree::ShardedTree<binary_tree::AVLTree<int>> sharded(4, sample);
+    for (int i = 0; i < n; ++i) {
+        sharded.Insert(i);
+    }
+    EXPECT_EQ(sharded.MemoryUsage().nodes, static_cast<size_t>(n));
+    EXPECT_EQ(sharded.MemoryUsage().Total(), avl.MemoryUsage().Total());
+
+    // Nodes freed through a reclaimer are held by the manager for reuse
+    {
+        binary_tree::EpochManager epoch;
+        binary_tree::RBTree<int> reclaimed;
+        reclaimed.SetReclaimer(&epoch);
+        for (int i = 0; i < 1000; ++i) {
+            reclaimed.Insert(i);
+        }
+        for (int i = 0; i < 1000; ++i) {
+            reclaimed.Delete(i);
+        }
+        while (epoch.Collect() > 0 || epoch.PendingCount() > 0) {}
+        EXPECT_EQ(reclaimed.MemoryUsage().nodes, 0u);
+        EXPECT_EQ(epoch.CachedBytes(), 1000 * sizeof(binary_tree::RBTree<int>::TreeNodeType));
+    }
+
+    // Per-key footprint of the balanced trees for capacity planning
+    auto per_key = [](const binary_tree::TreeMemoryUsage& usage) {
+        return static_cast<double>(usage.Total()) / usage.nodes;
+    };
+    binary_tree::RBTree<int> rbt;
+    binary_tree::AATree<int> aa;
+    binary_tree::FlatSet<int> flat_keys;
+    for (int i = 0; i < n; ++i) {
+        rbt.Insert(perf_data[i]);
+        aa.Insert(perf_data[i]);
+        flat_keys.Insert(perf_data[i]);
+    }
+    std::cout << "Bytes per int key, AVL tree: " << per_key(avl.MemoryUsage()) << ", RBT: "
+              << per_key(rbt.MemoryUsage()) << ", AA tree: " << per_key(aa.MemoryUsage())
+              << ", flat set: " << per_key(flat_keys.MemoryUsage()) << std::endl;
+}
+
+// Counts what goes through it, hands everything on to the heap
+class CountingResource : public binary_tree::MemoryResource {
+ public:
+    size_t allocated = 0;
+    size_t deallocated = 0;
+
+ protected:
+    void* DoAllocate(size_t bytes, size_t) override {
+        ++allocated;
+        return ::operator new(bytes);
+    }
+    void DoDeallocate(void* memory, size_t, size_t) override {
+        ++deallocated;
+        ::operator delete(memory);
+    }
+};
+
+struct CountedKey {
+    static int destroyed;
+    int key;
+
+    CountedKey(int k = 0): key(k) {}
+    ~CountedKey() { ++destroyed; }
+    bool operator<(const CountedKey& rhs) const { return key < rhs.key; }
+    bool operator>(const CountedKey& rhs) const { return rhs.key < key; }
+    bool operator==(const CountedKey& rhs) const { return key == rhs.key; }
+};
+int CountedKey::destroyed = 0;
+
+TEST_F(BstTest, MemoryResource) {
+    using Node = binary_tree::RBTree<int>::TreeNodeType;
+    const int n = 1000;
+
+    // Bump allocation, aligned, caller's buffer first
+    alignas(16) char buffer[n * sizeof(Node) + 256];
+    {
+        binary_tree::MonotonicArena arena(buffer, sizeof(buffer));
+        void *a = arena.Allocate(3, 1);
+        void *b = arena.Allocate(8, 8);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(b) % 8, 0u);
+        EXPECT_GE(static_cast<char*>(b), static_cast<char*>(a) + 3);
+        EXPECT_EQ(arena.BytesReserved(), 0u);
+        arena.Allocate(sizeof(buffer), 16);
+        EXPECT_GE(arena.BytesReserved(), sizeof(buffer));
+        arena.Release();
+        EXPECT_EQ(arena.BytesUsed(), 0u);
+        EXPECT_EQ(arena.Allocate(1, 1), static_cast<void*>(buffer));
+    }
+
+    // A tree on a stack buffer never touches the heap
+    {
+        binary_tree::MonotonicArena arena(buffer, sizeof(buffer));
+        binary_tree::RBTree<int, binary_tree::TreeStats> rbt;
+        rbt.SetMemoryResource(&arena);
+        size_t allocations = g_allocations;
+        for (int i = 0; i < n; ++i) {
+            rbt.Insert(i);
+        }
+        for (int i = 0; i < n; i += 2) {
+            EXPECT_TRUE(rbt.Delete(i));
+        }
+        EXPECT_EQ(g_allocations - allocations, 0u);
+        EXPECT_EQ(arena.BytesReserved(), 0u);
+        EXPECT_TRUE(rbt.IsTreeValid());
+        EXPECT_EQ(rbt.MemoryUsage().allocator_slack, 0u);
+
+        // Trivially destructible nodes are dropped at once, the stats still
+        // see every node go
+        rbt.Clear();
+        auto cleared = rbt.StatsSnapshot();
+        EXPECT_EQ(cleared.allocations, cleared.deallocations);
+        EXPECT_EQ(rbt.GetHeight(), 0);
+        arena.Release();
+        rbt.Insert(1);
+        EXPECT_TRUE(rbt.IsTreeValid());
+    }
+
+    // Keys with a destructor still get it
+    {
+        binary_tree::MonotonicArena arena;
+        CountedKey::destroyed = 0;
+        {
+            binary_tree::AVLTree<CountedKey> avl;
+            avl.SetMemoryResource(&arena);
+            for (int i = 0; i < 100; ++i) {
+                avl.Insert(CountedKey(i));
+            }
+            CountedKey::destroyed = 0;
+        }
+        EXPECT_EQ(CountedKey::destroyed, 100);
+    }
+
+    // A general resource gets every node back
+    {
+        CountingResource counting;
+        binary_tree::AATree<int> aa;
+        aa.SetMemoryResource(&counting);
+        for (int i = 0; i < n; ++i) {
+            aa.Insert(perf_data[i]);
+        }
+        for (int i = 0; i < n / 2; ++i) {
+            aa.Delete(perf_data[i]);
+        }
+        binary_tree::AATree<int> moved(std::move(aa));
+        EXPECT_EQ(moved.GetMemoryResource(), &counting);
+        // Clones live on the heap
+        binary_tree::AATree<int> copy = moved.Clone();
+        EXPECT_EQ(copy.GetMemoryResource(), nullptr);
+        moved.Clear();
+        EXPECT_EQ(counting.allocated, counting.deallocated);
+        EXPECT_TRUE(copy.IsTreeValid());
+    }
+
+    binary_tree::MonotonicArena arena;
+    binary_tree::EpochManager epoch;
+    binary_tree::RBTree<int> rbt;
+    rbt.SetReclaimer(&epoch);
+    EXPECT_THROW(rbt.SetMemoryResource(&arena), std::runtime_error);
+    rbt.SetReclaimer(nullptr);
+    rbt.SetMemoryResource(&arena);
+    rbt.Insert(1);
+    EXPECT_THROW(rbt.SetMemoryResource(nullptr), std::runtime_error);
+
+    // Nodes only move between treaps on the same resource
+    binary_tree::Treap<int> left, right;
+    left.SetMemoryResource(&arena);
+    left.Insert(1);
+    right.Insert(2);
+    EXPECT_THROW(left.Merge(right), std::runtime_error);
+    binary_tree::Treap<int> heap_treap;
+    EXPECT_THROW(left.Split(1, &heap_treap), std::runtime_error);
+    right.Clear();
+    right.SetMemoryResource(&arena);
+    right.Insert(2);
+    left.Merge(right);
+    EXPECT_TRUE(left.IsTreeValid());
+
+    // Per-request trees: build, query, tear down
+    const int requests = 2000, keys_per_request = 500;
+    int64_t heap_time = 0, arena_time = 0;
+    size_t heap_found = 0, arena_found = 0;
+    {
+        Timer _(heap_time);
+        for (int r = 0; r < requests; ++r) {
+            binary_tree::RBTree<int> tree;
+            for (int i = 0; i < keys_per_request; ++i) {
+                tree.Insert(perf_data[r + i]);
+            }
+            heap_found += (tree.Search(perf_data[r]) != nullptr);
+        }
+    }
+    {
+        Timer _(arena_time);
+        binary_tree::MonotonicArena request_arena(keys_per_request * sizeof(Node));
+        for (int r = 0; r < requests; ++r) {
+            {
+                binary_tree::RBTree<int> tree;
+                tree.SetMemoryResource(&request_arena);
+                for (int i = 0; i < keys_per_request; ++i) {
+                    tree.Insert(perf_data[r + i]);
+                }
+                arena_found += (tree.Search(perf_data[r]) != nullptr);
+            }
+            request_arena.Release();
+        }
+    }
+    EXPECT_EQ(heap_found, arena_found);
+    std::cout << requests << " requests building a " << keys_per_request << " key RBT, heap: " << heap_time
+              << " us, monotonic arena: " << arena_time << " us" << std::endl;
+
+    // Teardown of a large tree
+    int64_t heap_clear_time = 0, arena_clear_time = 0;
+    {
+        binary_tree::RBTree<int> tree;
+        for (int i = 0; i < kNPerfData; ++i) {
+            tree.Insert(perf_data[i]);
+        }
+        Timer _(heap_clear_time);
+        tree.Clear();
+    }
+    {
+        binary_tree::MonotonicArena big_arena(1 << 20);
+        binary_tree::RBTree<int> tree;
+        tree.SetMemoryResource(&big_arena);
+        for (int i = 0; i < kNPerfData; ++i) {
+            tree.Insert(perf_data[i]);
+        }
+        Timer _(arena_clear_time);
+        tree.Clear();
+        big_arena.Release();
+    }
+    std::cout << "RBT Clear() of " << kNPerfData << " inserts, heap: " << heap_clear_time
+              << " us, monotonic arena: " << arena_clear_time << " us" << std::endl;
+}
+
+TEST_F(BstTest, TextWriter) {
+    // Same digits as std::to_string
+    EXPECT_EQ(Formatted(0), "0");
+    EXPECT_EQ(Formatted(-45), "-45");
+    EXPECT_EQ(Formatted(INT_MIN), std::to_string(INT_MIN));
+    EXPECT_EQ(Formatted(LLONG_MIN), std::to_string(LLONG_MIN));
+    EXPECT_EQ(Formatted(ULLONG_MAX), std::to_string(ULLONG_MAX));
+    EXPECT_EQ(Formatted(static_cast<unsigned char>(200)), "200");
+    EXPECT_EQ(Formatted(2.5), std::to_string(2.5));
+    EXPECT_EQ(Formatted(-1e300), std::to_string(-1e300));
+    EXPECT_EQ(Formatted(std::string("key")), "key");
+    EXPECT_EQ(Formatted(app::Version{1, 12}), "v1.12");
+    EXPECT_EQ(Formatted(binary_tree::Interval<int>{3, 9}), "[3, 9)");
+
+    // A fixed buffer keeps what fits and tells how much was needed
+    char small[8];
+    {
+        binary_tree::TextWriter out(small, sizeof(small));
+        out.Write("digraph ");
+        EXPECT_FALSE(out.Truncated());
+        out.SetEscapeQuotes(true);
+        out.Write("\"x\"");
+        EXPECT_TRUE(out.Truncated());
+        EXPECT_EQ(out.Size(), 13u);
+        EXPECT_EQ(std::string(out.Data(), sizeof(small)), "digraph ");
+    }
+    char quoted[16];
+    binary_tree::TextWriter escaped(quoted, sizeof(quoted));
+    escaped.SetEscapeQuotes(true);
+    escaped.Write("a\"b\\c").Put('"');
+    EXPECT_EQ(std::string(escaped.Data(), escaped.Size()), "a\\\"b\\\\c\\\"");
+
+    // The writer and the stream give the same dump
+    binary_tree::AVLTree<int> avl;
+    binary_tree::Treap<int> treap;
+    for (int i = 0; i < 1000; ++i) {
+        avl.Insert(perf_data[i]);
+        treap.Insert(perf_data[i]);
+    }
+    for (auto format : {binary_tree::DumpFormat::Text, binary_tree::DumpFormat::Dot, binary_tree::DumpFormat::Json}) {
+        std::ostringstream streamed;
+        avl.Dump(streamed, binary_tree::DumpOptions(format));
+        std::vector<char> buffer(streamed.str().size());
+        binary_tree::TextWriter out(buffer.data(), buffer.size());
+        avl.Dump(out, binary_tree::DumpOptions(format));
+        EXPECT_FALSE(out.Truncated());
+        EXPECT_EQ(std::string(out.Data(), out.Size()), streamed.str());
+    }
+    std::ostringstream printed, dumped;
+    printed << treap;
+    treap.Dump(dumped);
+    std::string expected = "[ ";
+    treap.ForEach([&](int key) { expected += treap.Search(key)->ToString() + " "; });
+    EXPECT_EQ(printed.str(), expected + "]\n" + dumped.str());
+
+    binary_tree::BinarySearchTree<app::Version> versions;
+    versions.Insert(app::Version{2, 0});
+    versions.Insert(app::Version{1, 9});
+    std::ostringstream version_dump;
+    versions.Dump(version_dump);
+    EXPECT_EQ(version_dump.str(),
+              "└──v2.0\n"
+              "    ├──v1.9\n"
+              "    │   ├──nil\n"
+              "    │   └──nil\n"
+              "    └──nil\n");
+
+    // Exporting a large tree allocates per level of the walk, not per node
+    binary_tree::RBTree<int> rbt;
+    for (int i = 0; i < kNPerfData; ++i) {
+        rbt.Insert(perf_data[i]);
+    }
+    std::vector<char> buffer(64 << 20);
+    int64_t stream_time = 0, writer_time = 0;
+    size_t stream_allocations = 0, writer_allocations = 0;
+    {
+        std::ostringstream os;
+        size_t before = g_allocations.load();
+        {
+            Timer _(stream_time);
+            rbt.ForEach([&os](int key) { os << key << '\n'; });
+        }
+        stream_allocations = g_allocations.load() - before;
+    }
+    {
+        size_t before = g_allocations.load();
+        {
+            Timer _(writer_time);
+            binary_tree::TextWriter out(buffer.data(), buffer.size());
+            rbt.ForEach([&out](int key) {
+                binary_tree::FormatValue(out, key);
+                out.Put('\n');
+            });
+        }
+        writer_allocations = g_allocations.load() - before;
+    }
+    EXPECT_EQ(writer_allocations, 0u);
+    std::cout << "Export with ostream: " << stream_time << "us, " << stream_allocations << " allocations" << std::endl;
+    std::cout << "Export with TextWriter: " << writer_time << "us, " << writer_allocations << " allocations" << std::endl;
+
+    size_t before = g_allocations.load();
+    {
+        binary_tree::TextWriter out(buffer.data(), buffer.size());
+        rbt.Dump(out, binary_tree::DumpOptions(binary_tree::DumpFormat::Json));
+        EXPECT_FALSE(out.Truncated());
+    }
+    // Only the walk's stack grows
+    EXPECT_LT(g_allocations.load() - before, 16u);
+}
+
+TEST_F(BstTest, NodeLayout) {
+    CheckHotLine(binary_tree::TreeNodeBase<WideRow>(WideRow(1)));
+    CheckHotLine(binary_tree::RBTreeNode<WideRow>(WideRow(1)));
+    CheckHotLine(binary_tree::AVLTreeNode<WideRow>(WideRow(1)));
+    CheckHotLine(binary_tree::TreapNode<WideRow>(WideRow(1)));
+    CheckHotLine(binary_tree::ImplicitTreapNode<WideRow>(WideRow(1), 0));
+
+    // With the payload out of line the whole node fits one line
+    using Row = binary_tree::KeyPayload<int, WideRow>;
+    EXPECT_LE(sizeof(binary_tree::RBTreeNode<Row>), 64u);
+
+    std::vector<int> keys(kNPerfData);
+    for (int i = 0; i < kNPerfData; ++i) {
+        keys[i] = i;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(kRandomSeed));
+
+    binary_tree::RBTree<Row> rows;
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_NE(rows.Insert(Row(keys[i], WideRow(keys[i], 'x'))), nullptr);
+    }
+    EXPECT_TRUE(rows.IsTreeValid());
+    auto found = rows.Search(keys[10]);
+    ASSERT_NE(found, nullptr);
+    ASSERT_TRUE(found->data_.HasPayload());
+    EXPECT_EQ(found->data_.GetPayload().key, keys[10]);
+    EXPECT_EQ(found->data_.GetPayload().columns[7], 'x');
+    EXPECT_EQ(Formatted(found->data_), std::to_string(keys[10]));
+    EXPECT_EQ(rows.Search(-1), nullptr);
+
+    // Copies are deep, moves hand the payload over
+    Row copy = found->data_;
+    copy.GetPayload().key = -5;
+    EXPECT_EQ(found->data_.GetPayload().key, keys[10]);
+    Row moved(std::move(copy));
+    EXPECT_FALSE(copy.HasPayload());
+    EXPECT_EQ(moved.GetPayload().key, -5);
+    copy = moved;
+    EXPECT_EQ(copy.GetPayload().key, -5);
+
+    for (int i = 0; i < 1000; i += 2) {
+        EXPECT_TRUE(rows.Delete(keys[i]));
+    }
+    EXPECT_TRUE(rows.IsTreeValid());
+    EXPECT_EQ(rows.Search(keys[11])->data_.GetPayload().key, keys[11]);
+
+    // Descents over a million wide rows, inline against split. Only the
+    // split nodes fit in the last level cache.
+    int64_t tail_time = 0, wide_time = 0, split_time = 0;
+    size_t tail_found = 0, wide_found = 0, split_found = 0;
+    {
+        binary_tree::RBTree<TailKeyRow> tail;
+        for (int key : keys) {
+            tail.Insert(TailKeyRow(key, 'x'));
+        }
+        Timer _(tail_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            tail_found += (tail.Search(TailKeyRow(perf_data[i])) != nullptr);
+        }
+    }
+    {
+        binary_tree::RBTree<WideRow> wide;
+        for (int key : keys) {
+            wide.Insert(WideRow(key, 'x'));
+        }
+        Timer _(wide_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            wide_found += (wide.Search(WideRow(perf_data[i])) != nullptr);
+        }
+    }
+    {
+        binary_tree::RBTree<Row> split;
+        for (int key : keys) {
+            split.Insert(Row(key, WideRow(key, 'x')));
+        }
+        Timer _(split_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            split_found += (split.Search(perf_data[i]) != nullptr);
+        }
+    }
+    EXPECT_EQ(tail_found, static_cast<size_t>(kNPerfData));
+    EXPECT_EQ(wide_found, static_cast<size_t>(kNPerfData));
+    EXPECT_EQ(split_found, static_cast<size_t>(kNPerfData));
+    std::cout << "RB Tree search, " << sizeof(binary_tree::RBTreeNode<TailKeyRow>)
+              << " byte nodes, key and links on different lines: " << tail_time << "us" << std::endl;
+    std::cout << "RB Tree search, " << sizeof(binary_tree::RBTreeNode<WideRow>)
+              << " byte nodes, key and links on one line: " << wide_time << "us" << std::endl;
+    std::cout << "RB Tree search, " << sizeof(binary_tree::RBTreeNode<Row>)
+              << " byte nodes with the payload out of line: " << split_time << "us" << std::endl;
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,336 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+
+namespace binary_tree {
+
+// ------------ Epoch-Based Reclamation -------------
+
+// Defers freeing unlinked objects until no reader can still reach them.
+// Readers Pin() their thread for the length of a traversal. Writers
+// Retire() what they unlink, and it is reclaimed once the global epoch has
+// moved two steps past the retire. The epoch only moves when every pinned
+// thread has seen the current one. Threads register on first use and leave
+// at thread exit, handing their leftovers to the manager.
+//
+// Reclaimed memory goes back to a per-thread free list that Allocate()
+// draws from, so a tree freeing through the manager reuses node memory.
+// The manager must outlive the trees and the pinned threads using it.
+class EpochManager {
+ public:
+    static const size_t kMaxThreads = 128;
+    // Retired objects a thread collects before trying to reclaim
+    static const size_t kCollectThreshold = 64;
+
+    // Keeps the calling thread pinned while alive, nests
+    class Guard {
+     public:
+        explicit Guard(EpochManager* manager): manager_(manager) { manager_->PinThread(); }
+        Guard(Guard&& other): manager_(other.manager_) { other.manager_ = nullptr; }
+        ~Guard() {
+            if (manager_) manager_->UnpinThread();
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+     private:
+        EpochManager* manager_;
+    };
+
+    EpochManager();
+    ~EpochManager();
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    Guard Pin() { return Guard(this); }
+
+    // destroy(object) runs the destructor only. The size bytes of memory
+    // behind object go to the free list of the thread that reclaims it.
+    void Retire(void* object, size_t size, void (*destroy)(void*));
+    // Memory for an object of size bytes, recycled when possible
+    void* Allocate(size_t size);
+
+    // Tries to advance the epoch and reclaims what is safe, returns how
+    // many objects were reclaimed
+    size_t Collect();
+
+    uint64_t Epoch() const { return epoch_.load(); }
+    // Objects retired by the calling thread and not reclaimed yet
+    size_t PendingCount();
+    // Reclaimed memory on the calling thread's free lists, held for reuse
+    size_t CachedBytes();
+    size_t ThreadCount() const;
+
+ private:
+    struct Retired {
+        void* object;
+        size_t size;
+        void (*destroy)(void*);
+        uint64_t epoch;
+    };
+
+    struct FreeList {
+        size_t size;
+        std::vector<void*> blocks;
+    };
+
+    struct Slot {
+        std::atomic<bool> used;
+        std::atomic<uint64_t> epoch;     // Epoch seen at pin time, kIdle when unpinned
+        // Only touched by the owning thread
+        int pin_depth;
+        std::vector<Retired> retired;
+        std::vector<FreeList> free_lists;
+
+        Slot(): used(false), epoch(kIdle), pin_depth(0) {}
+    };
+
+    // Slots a thread holds, kept per thread across managers
+    struct ThreadRegistry {
+        struct Entry {
+            EpochManager* manager;
+            uint64_t id;
+            size_t slot;
+        };
+        std::vector<Entry> entries;
+        ~ThreadRegistry();
+    };
+
+    static const uint64_t kIdle = UINT64_MAX;
+
+    uint64_t id_;
+    std::atomic<uint64_t> epoch_;
+    std::atomic<size_t> slots_used_;    // High-water mark of claimed slots
+    Slot slots_[kMaxThreads];
+    std::mutex orphans_mutex_;
+    std::vector<Retired> orphans_;      // Left behind by exited threads
+
+    void PinThread();
+    void UnpinThread();
+    Slot& LocalSlot();
+    void ReleaseSlot(size_t index);
+    bool TryAdvance();
+    size_t Reclaim(Slot* slot, std::vector<Retired>* retired, uint64_t epoch);
+    void Recycle(Slot* slot, void* memory, size_t size);
+
+    static ThreadRegistry& Registry() {
+        thread_local ThreadRegistry registry;
+        return registry;
+    }
+
+    // Managers still alive, so exiting threads never touch a destroyed one
+    static std::mutex& LiveMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::vector<std::pair<EpochManager*, uint64_t>>& Live() {
+        static std::vector<std::pair<EpochManager*, uint64_t>> live;
+        return live;
+    }
+    static uint64_t NextId() {
+        static std::atomic<uint64_t> next(1);
+        return next++;
+    }
+};
+
+inline EpochManager::EpochManager(): id_(NextId()), epoch_(0), slots_used_(0) {
+    std::lock_guard<std::mutex> lock(LiveMutex());
+    Live().push_back(std::make_pair(this, id_));
+}
+
+inline EpochManager::~EpochManager() {
+    {
+        std::lock_guard<std::mutex> lock(LiveMutex());
+        auto& live = Live();
+        for (size_t i = 0; i < live.size(); ++i) {
+            if (live[i].first == this && live[i].second == id_) {
+                live.erase(live.begin() + i);
+                break;
+            }
+        }
+    }
+
+    // No thread is pinned any more, everything can go
+    for (auto& slot : slots_) {
+        for (auto& retired : slot.retired) {
+            retired.destroy(retired.object);
+            ::operator delete(retired.object);
+        }
+        for (auto& list : slot.free_lists) {
+            for (void *block : list.blocks) ::operator delete(block);
+        }
+    }
+    for (auto& retired : orphans_) {
+        retired.destroy(retired.object);
+        ::operator delete(retired.object);
+    }
+}
+
+inline EpochManager::ThreadRegistry::~ThreadRegistry() {
+    std::lock_guard<std::mutex> lock(LiveMutex());
+    for (auto& entry : entries) {
+        for (auto& live : Live()) {
+            if (live.first == entry.manager && live.second == entry.id) {
+                entry.manager->ReleaseSlot(entry.slot);
+                break;
+            }
+        }
+    }
+}
+
+inline EpochManager::Slot& EpochManager::LocalSlot() {
+    ThreadRegistry& registry = Registry();
+    for (auto& entry : registry.entries) {
+        if (entry.manager == this && entry.id == id_) return slots_[entry.slot];
+    }
+
+    for (size_t i = 0; i < kMaxThreads; ++i) {
+        bool expected = false;
+        if (slots_[i].used.compare_exchange_strong(expected, true)) {
+            size_t used = slots_used_.load();
+            while (used < i + 1 && !slots_used_.compare_exchange_weak(used, i + 1)) {}
+            registry.entries.push_back(ThreadRegistry::Entry{this, id_, i});
+            return slots_[i];
+        }
+    }
+    throw std::runtime_error("EpochManager: too many threads");
+}
+
+inline void EpochManager::ReleaseSlot(size_t index) {
+    Slot& slot = slots_[index];
+    {
+        std::lock_guard<std::mutex> lock(orphans_mutex_);
+        orphans_.insert(orphans_.end(), slot.retired.begin(), slot.retired.end());
+    }
+    slot.retired.clear();
+    for (auto& list : slot.free_lists) {
+        for (void *block : list.blocks) ::operator delete(block);
+    }
+    slot.free_lists.clear();
+    slot.pin_depth = 0;
+    slot.epoch.store(kIdle);
+    slot.used.store(false);
+}
+
+inline void EpochManager::PinThread() {
+    Slot& slot = LocalSlot();
+    if (slot.pin_depth++ > 0) return;
+
+    // A seq_cst exchange rather than a store: the announcement must be
+    // visible before the traversal reads anything
+    slot.epoch.exchange(epoch_.load());
+}
+
+inline void EpochManager::UnpinThread() {
+    Slot& slot = LocalSlot();
+    if (--slot.pin_depth > 0) return;
+
+    slot.epoch.store(kIdle, std::memory_order_release);
+}
+
+inline bool EpochManager::TryAdvance() {
+    uint64_t current = epoch_.load();
+    size_t used = slots_used_.load();
+    for (size_t i = 0; i < used; ++i) {
+        uint64_t seen = slots_[i].epoch.load();
+        if (seen != kIdle && seen != current) return false;
+    }
+    return epoch_.compare_exchange_strong(current, current + 1);
+}
+
+inline void EpochManager::Retire(void* object, size_t size, void (*destroy)(void*)) {
+    Slot& slot = LocalSlot();
+    slot.retired.push_back(Retired{object, size, destroy, epoch_.load()});
+    if (slot.retired.size() >= kCollectThreshold) {
+        Collect();
+    }
+}
+
+inline size_t EpochManager::Collect() {
+    Slot& slot = LocalSlot();
+    TryAdvance();
+    uint64_t epoch = epoch_.load();
+    size_t reclaimed = Reclaim(&slot, &slot.retired, epoch);
+
+    std::unique_lock<std::mutex> lock(orphans_mutex_, std::try_to_lock);
+    if (lock.owns_lock() && !orphans_.empty()) {
+        reclaimed += Reclaim(&slot, &orphans_, epoch);
+    }
+    return reclaimed;
+}
+
+inline size_t EpochManager::Reclaim(Slot* slot, std::vector<Retired>* retired, uint64_t epoch) {
+    // Retired at e, a thread pinned before the unlink holds e at most,
+    // so at e + 2 nobody can still reach it
+    size_t kept = 0;
+    size_t reclaimed = 0;
+    for (size_t i = 0; i < retired->size(); ++i) {
+        Retired& entry = (*retired)[i];
+        if (entry.epoch + 2 <= epoch) {
+            entry.destroy(entry.object);
+            Recycle(slot, entry.object, entry.size);
+            ++reclaimed;
+        } else {
+            (*retired)[kept++] = entry;
+        }
+    }
+    retired->resize(kept);
+    return reclaimed;
+}
+
+inline void EpochManager::Recycle(Slot* slot, void* memory, size_t size) {
+    for (auto& list : slot->free_lists) {
+        if (list.size == size) {
+            list.blocks.push_back(memory);
+            return;
+        }
+    }
+    slot->free_lists.push_back(FreeList{size, std::vector<void*>(1, memory)});
+}
+
+inline void* EpochManager::Allocate(size_t size) {
+    Slot& slot = LocalSlot();
+    for (auto& list : slot.free_lists) {
+        if (list.size == size && !list.blocks.empty()) {
+            void *block = list.blocks.back();
+            list.blocks.pop_back();
+            return block;
+        }
+    }
+    return ::operator new(size);
+}
+
+inline size_t EpochManager::PendingCount() {
+    return LocalSlot().retired.size();
+}
+
+inline size_t EpochManager::CachedBytes() {
+    size_t bytes = 0;
+    for (auto& list : LocalSlot().free_lists) {
+        bytes += list.size * list.blocks.size();
+    }
+    return bytes;
+}
+
+inline size_t EpochManager::ThreadCount() const {
+    size_t count = 0;
+    size_t used = slots_used_.load();
+    for (size_t i = 0; i < used; ++i) {
+        if (slots_[i].used.load()) ++count;
+    }
+    return count;
+}
+
+}  // namespace binary_tree
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef FLAT_SET_HPP
+#define FLAT_SET_HPP
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "binary_tree.hpp"
+
+namespace binary_tree {
+
+// ------------ Flat Set -------------
+
+// Ordered set kept as a sorted vector. Beats the node-based trees on small
+// and read-mostly sets: one allocation, no pointers, cache-friendly search.
+// Inserting or deleting shifts the tail, O(n). Pointers returned by Insert
+// and Search are invalidated by the next modification.
+template<typename T>
+class FlatSet {
+ public:
+    FlatSet() {}
+
+    const T* Insert(const T& data);
+    const T* Search(const T& target) const;
+    bool Delete(const T& target);
+    void Clear() { data_.clear(); }
+
+    // Sorts the batch and merges it in with one pass over the set.
+    // Returns how many keys were new.
+    size_t InsertBatch(std::vector<T> batch);
+
+    size_t Size() const { return data_.size(); }
+    bool Empty() const { return data_.empty(); }
+    void Reserve(size_t n) { data_.reserve(n); }
+
+    // Elements count as nodes, the unused capacity as allocator slack
+    TreeMemoryUsage MemoryUsage() const;
+
+    // Sorted, unique keys
+    const std::vector<T>& Data() const { return data_; }
+    typename std::vector<T>::const_iterator begin() const { return data_.begin(); }
+    typename std::vector<T>::const_iterator end() const { return data_.end(); }
+
+ private:
+    std::vector<T> data_;
+
+    // Index of the first key not less than target. The halving loop has no
+    // data-dependent branch, the compiler turns the select into a cmov.
+    size_t LowerBound(const T& target) const;
+};
+
+template<typename T>
+size_t FlatSet<T>::LowerBound(const T& target) const {
+    size_t n = data_.size();
+    if (n == 0) return 0;
+
+    const T *first = data_.data();
+    while (n > 1) {
+        size_t half = n / 2;
+        first = (first[half] < target ? first + half : first);
+        n -= half;
+    }
+    return static_cast<size_t>(first - data_.data()) + (*first < target ? 1 : 0);
+}
+
+template<typename T>
+TreeMemoryUsage FlatSet<T>::MemoryUsage() const {
+    TreeMemoryUsage usage;
+    usage.nodes = data_.size();
+    usage.node_size = sizeof(T);
+    usage.node_bytes = data_.size() * sizeof(T);
+    if (data_.capacity()) {
+        usage.allocator_slack = HeapAllocationSize(data_.capacity() * sizeof(T)) - usage.node_bytes;
+    }
+    for (const auto& item : data_) {
+        usage.payload_bytes += HeapBytes(item);
+    }
+    return usage;
+}
+
+template<typename T>
+const T* FlatSet<T>::Insert(const T& data) {
+    size_t pos = LowerBound(data);
+    if (pos < data_.size() && !(data < data_[pos])) return nullptr;
+
+    // vector::insert moves the tail up by one
+    data_.insert(data_.begin() + pos, data);
+    return &data_[pos];
+}
+
+template<typename T>
+const T* FlatSet<T>::Search(const T& target) const {
+    size_t pos = LowerBound(target);
+    if (pos < data_.size() && !(target < data_[pos])) return &data_[pos];
+    return nullptr;
+}
+
+template<typename T>
+bool FlatSet<T>::Delete(const T& target) {
+    size_t pos = LowerBound(target);
+    if (pos == data_.size() || target < data_[pos]) return false;
+
+    data_.erase(data_.begin() + pos);
+    return true;
+}
+
+template<typename T>
+size_t FlatSet<T>::InsertBatch(std::vector<T> batch) {
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end(), [](const T& a, const T& b) {
+        return !(a < b) && !(b < a);
+    }), batch.end());
+
+    size_t old_size = data_.size();
+    data_.reserve(old_size + batch.size());
+    std::move(batch.begin(), batch.end(), std::back_inserter(data_));
+    std::inplace_merge(data_.begin(), data_.begin() + old_size, data_.end());
+
+    // Keys already in the set are next to their copy from the batch now
+    data_.erase(std::unique(data_.begin(), data_.end(), [](const T& a, const T& b) {
+        return !(a < b) && !(b < a);
+    }), data_.end());
+    return data_.size() - old_size;
+}
+
+// ------------ Adaptive Set -------------
+
+// Starts as a FlatSet and moves everything into an RBTree once it grows
+// past the threshold. It stays a tree until Clear().
+template<typename T, typename Stats = NoTreeStats>
+class AdaptiveSet {
+ public:
+    explicit AdaptiveSet(size_t threshold = 512): threshold_(threshold), promoted_(false), size_(0) {}
+
+    AdaptiveSet(const AdaptiveSet&) = delete;
+    AdaptiveSet& operator=(const AdaptiveSet&) = delete;
+
+    const T* Insert(const T& data);
+    const T* Search(const T& target) const;
+    bool Delete(const T& target);
+    void Clear();
+
+    size_t Size() const { return size_; }
+    bool IsPromoted() const { return promoted_; }
+    TreeMemoryUsage MemoryUsage() const { return promoted_ ? tree_.MemoryUsage() : flat_.MemoryUsage(); }
+    size_t Threshold() const { return threshold_; }
+
+    const RBTree<T, Stats>& Tree() const { return tree_; }
+
+ private:
+    size_t threshold_;
+    bool promoted_;
+    size_t size_;
+    FlatSet<T> flat_;
+    RBTree<T, Stats> tree_;
+
+    void Promote();
+};
+
+template<typename T, typename Stats>
+const T* AdaptiveSet<T, Stats>::Insert(const T& data) {
+    if (!promoted_) {
+        const T *inserted = flat_.Insert(data);
+        if (!inserted) return nullptr;
+
+        ++size_;
+        if (size_ <= threshold_) return inserted;
+        Promote();
+        return &tree_.Search(data)->data_;
+    }
+
+    auto node = tree_.Insert(data);
+    if (!node) return nullptr;
+    ++size_;
+    return &node->data_;
+}
+
+template<typename T, typename Stats>
+const T* AdaptiveSet<T, Stats>::Search(const T& target) const {
+    if (!promoted_) return flat_.Search(target);
+
+    auto node = tree_.Search(target);
+    return node ? &node->data_ : nullptr;
+}
+
+template<typename T, typename Stats>
+bool AdaptiveSet<T, Stats>::Delete(const T& target) {
+    bool deleted = (promoted_ ? tree_.Delete(target) : flat_.Delete(target));
+    if (deleted) --size_;
+    return deleted;
+}
+
+template<typename T, typename Stats>
+void AdaptiveSet<T, Stats>::Clear() {
+    flat_.Clear();
+    tree_.Clear();
+    promoted_ = false;
+    size_ = 0;
+}
+
+template<typename T, typename Stats>
+void AdaptiveSet<T, Stats>::Promote() {
+    // Sorted input, hinting each insert at the previous node skips the descent
+    typename RBTree<T, Stats>::TreeNodeType *hint = nullptr;
+    for (const auto& data : flat_) {
+        hint = tree_.InsertHint(hint, data);
+    }
+    // Give the array memory back
+    flat_ = FlatSet<T>();
+    promoted_ = true;
+}
+
+}  // namespace binary_tree
+
+#endif
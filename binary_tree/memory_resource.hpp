@@ -0,0 +1,141 @@
+#ifndef MEMORY_RESOURCE_HPP
+#define MEMORY_RESOURCE_HPP
+
+#include <new>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace binary_tree {
+
+// ------------ Memory Resource -------------
+
+// Where a tree takes its node memory from, the C++11 counterpart of
+// std::pmr::memory_resource. Implement DoAllocate / DoDeallocate, and
+// return true from IsMonotonic() when Deallocate does nothing and memory
+// only comes back all at once: trees then skip the per-node teardown.
+class MemoryResource {
+ public:
+    virtual ~MemoryResource() {}
+
+    void* Allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        return DoAllocate(bytes, alignment);
+    }
+    void Deallocate(void* memory, size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        DoDeallocate(memory, bytes, alignment);
+    }
+
+    virtual bool IsMonotonic() const { return false; }
+
+ protected:
+    virtual void* DoAllocate(size_t bytes, size_t alignment) = 0;
+    virtual void DoDeallocate(void* memory, size_t bytes, size_t alignment) = 0;
+};
+
+// ::operator new and delete, what the trees use without a resource
+class NewDeleteResource : public MemoryResource {
+ protected:
+    void* DoAllocate(size_t bytes, size_t) override { return ::operator new(bytes); }
+    void DoDeallocate(void* memory, size_t, size_t) override { ::operator delete(memory); }
+};
+
+// Bump allocator for short-lived trees, e.g. one per request. Hands out
+// memory from a caller's buffer first, then from blocks of growing size
+// taken from upstream. Deallocate is a no-op, Release() frees everything
+// at once. Must outlive the trees allocating from it. Not thread safe.
+class MonotonicArena : public MemoryResource {
+ public:
+    explicit MonotonicArena(size_t first_block = 4096, MemoryResource* upstream = nullptr):
+        upstream_(upstream), buffer_(nullptr), buffer_size_(0), pos_(nullptr), end_(nullptr),
+        blocks_(nullptr), next_block_(BlockSize(first_block)), used_(0), reserved_(0) {}
+    MonotonicArena(void* buffer, size_t size, MemoryResource* upstream = nullptr):
+        upstream_(upstream), buffer_(static_cast<char*>(buffer)), buffer_size_(size),
+        pos_(buffer_), end_(buffer_ + size), blocks_(nullptr),
+        next_block_(BlockSize(size)), used_(0), reserved_(0) {}
+    ~MonotonicArena() { Release(); }
+
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+
+    bool IsMonotonic() const override { return true; }
+
+    // Frees the upstream blocks and starts over in the caller's buffer.
+    // Nothing allocated before may be used afterwards.
+    void Release();
+
+    // Bytes handed out, and bytes taken from upstream
+    size_t BytesUsed() const { return used_; }
+    size_t BytesReserved() const { return reserved_; }
+
+ protected:
+    void* DoAllocate(size_t bytes, size_t alignment) override;
+    void DoDeallocate(void*, size_t, size_t) override {}
+
+ private:
+    static size_t BlockSize(size_t size) { return size < 256 ? 256 : size; }
+
+    // Blocks are chained through a header at their start
+    struct Block {
+        Block* next;
+        size_t size;
+    };
+
+    MemoryResource *upstream_;
+    char *buffer_;
+    size_t buffer_size_;
+    char *pos_;
+    char *end_;
+    Block *blocks_;
+    size_t next_block_;
+    size_t used_;
+    size_t reserved_;
+
+    void* UpstreamAllocate(size_t bytes) {
+        return upstream_ ? upstream_->Allocate(bytes) : ::operator new(bytes);
+    }
+    void UpstreamDeallocate(void* memory, size_t bytes) {
+        if (upstream_) upstream_->Deallocate(memory, bytes);
+        else ::operator delete(memory);
+    }
+};
+
+inline void* MonotonicArena::DoAllocate(size_t bytes, size_t alignment) {
+    uintptr_t pos = reinterpret_cast<uintptr_t>(pos_);
+    uintptr_t aligned = (pos + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+    if (!pos_ || aligned + bytes > reinterpret_cast<uintptr_t>(end_)) {
+        // Grow geometrically so a tree of n nodes takes O(log n) blocks
+        size_t size = std::max(next_block_, sizeof(Block) + bytes + alignment);
+        Block *block = static_cast<Block*>(UpstreamAllocate(size));
+        block->next = blocks_;
+        block->size = size;
+        blocks_ = block;
+        reserved_ += size;
+        next_block_ = size * 2;
+
+        pos_ = reinterpret_cast<char*>(block + 1);
+        end_ = reinterpret_cast<char*>(block) + size;
+        pos = reinterpret_cast<uintptr_t>(pos_);
+        aligned = (pos + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+    }
+
+    pos_ = reinterpret_cast<char*>(aligned + bytes);
+    used_ += bytes;
+    return reinterpret_cast<void*>(aligned);
+}
+
+inline void MonotonicArena::Release() {
+    while (blocks_) {
+        Block *next = blocks_->next;
+        UpstreamDeallocate(blocks_, blocks_->size);
+        blocks_ = next;
+    }
+    pos_ = buffer_;
+    end_ = buffer_ + buffer_size_;
+    next_block_ = BlockSize(buffer_size_);
+    used_ = 0;
+    reserved_ = 0;
+}
+
+}  // namespace binary_tree
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef SHARDED_TREE_HPP
+#define SHARDED_TREE_HPP
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+
+#include "binary_tree.hpp"
+
+namespace binary_tree {
+
+// ------------ Sharded Tree -------------
+
+// Splits the key space by range over independently locked trees, e.g.
+// ShardedTree<RBTree<int>>. Writers on different shards never contend.
+// Shard i holds the keys in [splitter i - 1, splitter i).
+//
+// Single-key operations lock one shard. Iteration and range queries lock
+// the shards they cover in index order and see a consistent view of them.
+// Rebalance moves one boundary at a time under the two shards next to it,
+// the rest of the shards stay available.
+template<typename Tree>
+class ShardedTree {
+ public:
+    using ValueType = typename Tree::ValueType;
+
+    // Places the splitters at the quantiles of sample. Fewer shards are
+    // made when the sample has fewer distinct keys.
+    ShardedTree(size_t n_shards, std::vector<ValueType> sample);
+
+    ShardedTree(const ShardedTree&) = delete;
+    ShardedTree& operator=(const ShardedTree&) = delete;
+
+    bool Insert(const ValueType& data);
+    bool Contains(const ValueType& target) const;
+    bool Delete(const ValueType& target);
+
+    size_t Size() const;
+    size_t ShardCount() const { return shards_.size(); }
+    // Sum over the shard trees, each locked in turn
+    TreeMemoryUsage MemoryUsage() const;
+    std::vector<size_t> ShardSizes() const;
+    std::vector<ValueType> Splitters() const { return *std::atomic_load(&splitters_); }
+
+    // Calls fn(data) in key order across the shards
+    template<typename Fn>
+    void ForEach(Fn fn) const;
+    // Same for the keys in [lo, hi), only the shards overlapping it are locked
+    template<typename Fn>
+    void ForEachInRange(const ValueType& lo, const ValueType& hi, Fn fn) const;
+    std::vector<ValueType> RangeQuery(const ValueType& lo, const ValueType& hi) const;
+
+    // When the largest shard holds more than max_skew times the average,
+    // moves the boundaries to the quantiles of the current keys. Returns
+    // true if any boundary moved.
+    bool Rebalance(double max_skew = 1.5);
+
+    // Checks every shard tree and that each shard only holds its own range
+    bool IsTreeValid() const;
+
+ private:
+    struct Shard {
+        mutable std::mutex mutex;
+        Tree tree;
+        size_t size;
+        // Range of the shard, guarded by mutex. An unset side is unbounded.
+        bool has_lo;
+        bool has_hi;
+        ValueType lo;
+        ValueType hi;
+
+        Shard(): size(0), has_lo(false), has_hi(false), lo(), hi() {}
+
+        bool Owns(const ValueType& key) const {
+            return (!has_lo || !(key < lo)) && (!has_hi || key < hi);
+        }
+    };
+
+    using SplitterList = std::vector<ValueType>;
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // Routing snapshot, replaced as a whole with atomic_store. A shard's own
+    // bounds are the authority, routing retries when they disagree.
+    std::shared_ptr<const SplitterList> splitters_;
+    // One rebalance at a time
+    std::mutex rebalance_mutex_;
+
+    // Locks the shard owning key, retrying if its boundary moved meanwhile
+    Shard& LockOwner(const ValueType& key, std::unique_lock<std::mutex>* lock) const;
+    // Locks the shards overlapping [lo, hi) in index order
+    size_t LockRange(const ValueType& lo, const ValueType& hi,
+                     std::vector<std::unique_lock<std::mutex>>* locks) const;
+    bool MoveBoundary(size_t index, const ValueType& target);
+    static void MoveKeys(Shard* from, Shard* to, const ValueType& lo, const ValueType& hi);
+};
+
+template<typename Tree>
+ShardedTree<Tree>::ShardedTree(size_t n_shards, std::vector<ValueType> sample) {
+    if (n_shards == 0) {
+        throw std::runtime_error("ShardedTree needs at least one shard");
+    }
+
+    std::sort(sample.begin(), sample.end());
+    sample.erase(std::unique(sample.begin(), sample.end(), [](const ValueType& a, const ValueType& b) {
+        return !(a < b) && !(b < a);
+    }), sample.end());
+
+    size_t count = std::min(n_shards, sample.size() + 1);
+    std::shared_ptr<SplitterList> splitters(new SplitterList());
+    for (size_t i = 1; i < count; ++i) {
+        splitters->push_back(sample[i * sample.size() / count]);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+        Shard& shard = *shards_.back();
+        if (i > 0) {
+            shard.has_lo = true;
+            shard.lo = (*splitters)[i - 1];
+        }
+        if (i + 1 < count) {
+            shard.has_hi = true;
+            shard.hi = (*splitters)[i];
+        }
+    }
+    splitters_ = splitters;
+}
+
+template<typename Tree>
+typename ShardedTree<Tree>::Shard&
+ShardedTree<Tree>::LockOwner(const ValueType& key, std::unique_lock<std::mutex>* lock) const {
+    for (;;) {
+        std::shared_ptr<const SplitterList> splitters = std::atomic_load(&splitters_);
+        size_t index = std::upper_bound(splitters->begin(), splitters->end(), key) - splitters->begin();
+        Shard& shard = *shards_[index];
+        *lock = std::unique_lock<std::mutex>(shard.mutex);
+        if (shard.Owns(key)) return shard;
+        lock->unlock();
+    }
+}
+
+template<typename Tree>
+bool ShardedTree<Tree>::Insert(const ValueType& data) {
+    std::unique_lock<std::mutex> lock;
+    Shard& shard = LockOwner(data, &lock);
+    if (!shard.tree.Insert(data)) return false;
+    ++shard.size;
+    return true;
+}
+
+template<typename Tree>
+bool ShardedTree<Tree>::Contains(const ValueType& target) const {
+    std::unique_lock<std::mutex> lock;
+    Shard& shard = LockOwner(target, &lock);
+    return shard.tree.Search(target) != nullptr;
+}
+
+template<typename Tree>
+bool ShardedTree<Tree>::Delete(const ValueType& target) {
+    std::unique_lock<std::mutex> lock;
+    Shard& shard = LockOwner(target, &lock);
+    if (!shard.tree.Delete(target)) return false;
+    --shard.size;
+    return true;
+}
+
+template<typename Tree>
+size_t ShardedTree<Tree>::Size() const {
+    size_t size = 0;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        size += shard->size;
+    }
+    return size;
+}
+
+template<typename Tree>
+TreeMemoryUsage ShardedTree<Tree>::MemoryUsage() const {
+    TreeMemoryUsage usage;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        usage.Add(shard->tree.MemoryUsage());
+    }
+    return usage;
+}
+
+template<typename Tree>
+std::vector<size_t> ShardedTree<Tree>::ShardSizes() const {
+    std::vector<size_t> sizes;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        sizes.push_back(shard->size);
+    }
+    return sizes;
+}
+
+template<typename Tree>
+template<typename Fn>
+void ShardedTree<Tree>::ForEach(Fn fn) const {
+    // Holding all the locks keeps Rebalance from moving keys across
+    // shards that were already visited
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto& shard : shards_) {
+        locks.push_back(std::unique_lock<std::mutex>(shard->mutex));
+    }
+    for (auto& shard : shards_) {
+        shard->tree.ForEach(fn);
+    }
+}
+
+template<typename Tree>
+size_t ShardedTree<Tree>::LockRange(const ValueType& lo, const ValueType& hi,
+                                    std::vector<std::unique_lock<std::mutex>>* locks) const {
+    for (;;) {
+        std::shared_ptr<const SplitterList> splitters = std::atomic_load(&splitters_);
+        size_t first = std::upper_bound(splitters->begin(), splitters->end(), lo) - splitters->begin();
+        size_t last = std::lower_bound(splitters->begin(), splitters->end(), hi) - splitters->begin();
+        for (size_t i = first; i <= last; ++i) {
+            locks->push_back(std::unique_lock<std::mutex>(shards_[i]->mutex));
+        }
+
+        // The locked shards are contiguous, checking both ends is enough
+        const Shard& front = *shards_[first];
+        const Shard& back = *shards_[last];
+        if ((!front.has_lo || !(lo < front.lo)) && (!back.has_hi || !(back.hi < hi))) {
+            return first;
+        }
+        locks->clear();
+    }
+}
+
+template<typename Tree>
+template<typename Fn>
+void ShardedTree<Tree>::ForEachInRange(const ValueType& lo, const ValueType& hi, Fn fn) const {
+    if (!(lo < hi)) return;
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    size_t first = LockRange(lo, hi, &locks);
+    for (size_t i = 0; i < locks.size(); ++i) {
+        shards_[first + i]->tree.ForEachInRange(lo, hi, fn);
+    }
+}
+
+template<typename Tree>
+std::vector<typename ShardedTree<Tree>::ValueType>
+ShardedTree<Tree>::RangeQuery(const ValueType& lo, const ValueType& hi) const {
+    std::vector<ValueType> result;
+    ForEachInRange(lo, hi, [&result](const ValueType& data) {
+        result.push_back(data);
+    });
+    return result;
+}
+
+template<typename Tree>
+bool ShardedTree<Tree>::Rebalance(double max_skew) {
+    std::lock_guard<std::mutex> guard(rebalance_mutex_);
+    size_t n_shards = shards_.size();
+    if (n_shards < 2) return false;
+
+    std::vector<size_t> sizes = ShardSizes();
+    size_t total = 0;
+    size_t largest = 0;
+    for (auto size : sizes) {
+        total += size;
+        largest = std::max(largest, size);
+    }
+    if (total == 0 || static_cast<double>(largest) <= max_skew * total / n_shards) return false;
+
+    // Every stride-th key, shard by shard, comes out in global key order
+    size_t stride = std::max<size_t>(1, total / (n_shards * 32));
+    std::vector<ValueType> sample;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        size_t i = 0;
+        shard->tree.ForEach([&](const ValueType& data) {
+            if (i++ % stride == 0) sample.push_back(data);
+        });
+    }
+    if (sample.empty()) return false;
+
+    std::vector<ValueType> targets;
+    for (size_t i = 1; i < n_shards; ++i) {
+        targets.push_back(sample[i * sample.size() / n_shards]);
+    }
+
+    // A boundary can only move within its two shards, a target further away
+    // is reached over several passes as the neighbours move too
+    bool moved = false;
+    for (size_t pass = 0; pass < n_shards; ++pass) {
+        bool moved_in_pass = false;
+        for (size_t i = 0; i + 1 < n_shards; ++i) {
+            moved_in_pass = MoveBoundary(i, targets[i]) || moved_in_pass;
+        }
+        if (!moved_in_pass) break;
+        moved = true;
+    }
+    return moved;
+}
+
+template<typename Tree>
+bool ShardedTree<Tree>::MoveBoundary(size_t index, const ValueType& target) {
+    Shard& left = *shards_[index];
+    Shard& right = *shards_[index + 1];
+    std::lock_guard<std::mutex> left_lock(left.mutex);
+    std::lock_guard<std::mutex> right_lock(right.mutex);
+
+    ValueType current = left.hi;
+    ValueType to = target;
+    if (left.has_lo && to < left.lo) to = left.lo;
+    if (right.has_hi && right.hi < to) to = right.hi;
+    if (!(to < current) && !(current < to)) return false;
+
+    if (to < current) {
+        MoveKeys(&left, &right, to, current);
+    } else {
+        MoveKeys(&right, &left, current, to);
+    }
+    left.hi = to;
+    right.lo = to;
+
+    // Only the rebalancer writes the snapshot, copying it here is safe
+    std::shared_ptr<SplitterList> splitters(new SplitterList(*std::atomic_load(&splitters_)));
+    (*splitters)[index] = to;
+    std::atomic_store(&splitters_, std::shared_ptr<const SplitterList>(splitters));
+    return true;
+}
+
+template<typename Tree>
+void ShardedTree<Tree>::MoveKeys(Shard* from, Shard* to, const ValueType& lo, const ValueType& hi) {
+    std::vector<ValueType> keys;
+    from->tree.ForEachInRange(lo, hi, [&keys](const ValueType& data) {
+        keys.push_back(data);
+    });
+    for (auto& key : keys) {
+        from->tree.Delete(key);
+    }
+
+    // Sorted, each key goes right after the previous one
+    typename Tree::TreeNodeType *hint = nullptr;
+    for (auto& key : keys) {
+        hint = to->tree.InsertHint(hint, key);
+    }
+    from->size -= keys.size();
+    to->size += keys.size();
+}
+
+template<typename Tree>
+bool ShardedTree<Tree>::IsTreeValid() const {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto& shard : shards_) {
+        locks.push_back(std::unique_lock<std::mutex>(shard->mutex));
+    }
+
+    std::shared_ptr<const SplitterList> splitters = std::atomic_load(&splitters_);
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        const Shard& shard = *shards_[i];
+        if (!shard.tree.Validate().Ok()) return false;
+        if (shard.has_lo != (i > 0) || shard.has_hi != (i + 1 < shards_.size())) return false;
+        if (shard.has_hi && (shard.hi < (*splitters)[i] || (*splitters)[i] < shard.hi)) return false;
+
+        size_t size = 0;
+        bool owned = true;
+        shard.tree.ForEach([&](const ValueType& data) {
+            ++size;
+            owned = owned && shard.Owns(data);
+        });
+        if (!owned || size != shard.size) return false;
+    }
+    return true;
+}
+
+}  // namespace binary_tree
+
+#endif
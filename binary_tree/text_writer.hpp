@@ -0,0 +1,202 @@
+#ifndef TEXT_WRITER_HPP
+#define TEXT_WRITER_HPP
+
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
+#include <type_traits>
+
+namespace binary_tree {
+
+// ------------ Text Writer -------------
+
+// Collects text in a buffer and hands it on in large chunks, either to a
+// stream or into a caller-provided array. Nothing here allocates.
+//
+// Values are written with FormatValue(writer, value). Overloads for the
+// arithmetic types and strings are below. User types get theirs next to
+// the type, ADL picks it up:
+//
+//   namespace app {
+//   inline void FormatValue(binary_tree::TextWriter& out, const Key& key) {
+//       FormatValue(out, key.id);
+//   }
+//   }
+class TextWriter {
+ public:
+    static const size_t kBufferSize = 4096;
+
+    // Flushes to os when the buffer fills up and on destruction
+    explicit TextWriter(std::ostream& os): os_(&os), begin_(local_), pos_(local_),
+                                           end_(local_ + kBufferSize), flushed_(0),
+                                           truncated_(false), escape_(false), json_(false) {}
+    // Writes into buffer[0, size) only, whatever does not fit is dropped
+    TextWriter(char* buffer, size_t size): os_(nullptr), begin_(buffer), pos_(buffer),
+                                           end_(buffer + size), flushed_(0),
+                                           truncated_(false), escape_(false), json_(false) {}
+    ~TextWriter() { Flush(); }
+
+    TextWriter(const TextWriter&) = delete;
+    TextWriter& operator=(const TextWriter&) = delete;
+
+    TextWriter& Write(const char* data, size_t size);
+    TextWriter& Write(const char* str) { return Write(str, std::strlen(str)); }
+    TextWriter& Put(char c);
+    void Flush();
+
+    // While on, '"' and '\' are written with a backslash in front, for
+    // values inside quoted DOT strings
+    void SetEscapeQuotes(bool escape) { escape_ = escape; json_ = false; }
+    // Same, and control characters become \n, \r, \t or \u00XX, for JSON strings
+    void SetEscapeJson(bool escape) { escape_ = escape; json_ = escape; }
+
+    // Characters written so far, including the dropped ones
+    size_t Size() const { return flushed_ + static_cast<size_t>(pos_ - begin_); }
+    // Set once a fixed buffer ran out of room
+    bool Truncated() const { return truncated_; }
+    // The text in a fixed buffer, not terminated
+    const char* Data() const { return begin_; }
+
+ private:
+    std::ostream *os_;
+    char *begin_;
+    char *pos_;
+    char *end_;
+    size_t flushed_;
+    bool truncated_;
+    bool escape_;
+    bool json_;
+    char local_[kBufferSize];
+
+    void WriteRaw(const char* data, size_t size);
+};
+
+inline TextWriter& TextWriter::Write(const char* data, size_t size) {
+    if (!escape_) {
+        WriteRaw(data, size);
+        return *this;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c == '"' || c == '\\') {
+            WriteRaw(data + start, i - start);
+            WriteRaw("\\", 1);
+            start = i;
+        } else if (json_ && c < 0x20) {
+            WriteRaw(data + start, i - start);
+            if (c == '\n') {
+                WriteRaw("\\n", 2);
+            } else if (c == '\r') {
+                WriteRaw("\\r", 2);
+            } else if (c == '\t') {
+                WriteRaw("\\t", 2);
+            } else {
+                static const char kHex[] = "0123456789abcdef";
+                char code[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+                WriteRaw(code, sizeof(code));
+            }
+            start = i + 1;
+        }
+    }
+    WriteRaw(data + start, size - start);
+    return *this;
+}
+
+inline TextWriter& TextWriter::Put(char c) {
+    if (escape_ || pos_ == end_) return Write(&c, 1);
+    *pos_++ = c;
+    return *this;
+}
+
+inline void TextWriter::WriteRaw(const char* data, size_t size) {
+    while (size > 0) {
+        if (pos_ == end_) {
+            if (!os_) {
+                // Count what is dropped so Size() tells how much was needed
+                flushed_ += size;
+                truncated_ = true;
+                return;
+            }
+            Flush();
+        }
+        size_t chunk = std::min(size, static_cast<size_t>(end_ - pos_));
+        std::memcpy(pos_, data, chunk);
+        pos_ += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+inline void TextWriter::Flush() {
+    if (!os_ || pos_ == begin_) return;
+    os_->write(begin_, pos_ - begin_);
+    flushed_ += static_cast<size_t>(pos_ - begin_);
+    pos_ = begin_;
+}
+
+// ------------ FormatValue -------------
+
+template<typename Int>
+inline bool IsNegative(Int value, std::true_type) { return value < 0; }
+template<typename Int>
+inline bool IsNegative(Int, std::false_type) { return false; }
+
+// Integers are converted back to front on the stack, like to_chars
+template<typename Int>
+typename std::enable_if<std::is_integral<Int>::value && !std::is_same<Int, bool>::value>::type
+FormatValue(TextWriter& out, Int value) {
+    typedef typename std::make_unsigned<Int>::type Unsigned;
+    char digits[3 * sizeof(Int) + 2];
+    char *end = digits + sizeof(digits);
+    char *pos = end;
+    bool negative = IsNegative(value, std::is_signed<Int>());
+    // Negate in unsigned arithmetic, the most negative value has no positive twin
+    Unsigned magnitude = (negative ? Unsigned(0) - static_cast<Unsigned>(value) : static_cast<Unsigned>(value));
+    do {
+        *--pos = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (negative) *--pos = '-';
+    out.Write(pos, static_cast<size_t>(end - pos));
+}
+
+// Same digits as std::to_string
+template<typename Float>
+typename std::enable_if<std::is_floating_point<Float>::value>::type
+FormatValue(TextWriter& out, Float value) {
+    char digits[512];
+    int size = std::snprintf(digits, sizeof(digits), "%f", static_cast<double>(value));
+    if (size > 0) out.Write(digits, std::min(static_cast<size_t>(size), sizeof(digits) - 1));
+}
+
+inline void FormatValue(TextWriter& out, bool value) { out.Put(value ? '1' : '0'); }
+inline void FormatValue(TextWriter& out, const char* value) { out.Write(value); }
+inline void FormatValue(TextWriter& out, const std::string& value) { out.Write(value.data(), value.size()); }
+
+// For the ToString() convenience methods. Short text is formatted on the
+// stack, the string is the only allocation and small strings skip even that.
+template<typename Node>
+std::string FormatToString(const Node& node) {
+    char local[64];
+    size_t size = 0;
+    {
+        TextWriter out(local, sizeof(local));
+        node.Format(out);
+        if (!out.Truncated()) return std::string(out.Data(), out.Size());
+        size = out.Size();
+    }
+    std::string str(size, '\0');
+    TextWriter out(&str[0], size);
+    node.Format(out);
+    return str;
+}
+
+}  // namespace binary_tree
+
+#endif
@@ -0,0 +1,448 @@
+#ifndef BUFFER_TREE_HPP
+#define BUFFER_TREE_HPP
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <stdexcept>
+#include <cstddef>
+
+namespace buffer_tree {
+
+// ------------ Buffered B^e Tree -------------
+
+// Write-optimized ordered set. Inner nodes keep a sorted buffer of pending
+// insert and delete messages next to their pivots. An update only lands in
+// the root buffer. When a buffer overflows, the largest batch headed for one
+// child is moved down in a single merge, so a message is copied a few times
+// per level in bulk instead of paying a descent and a rebalance of its own.
+// Searches check the buffers on the way down, newer messages sit higher.
+//
+// Updates are blind: Insert and Delete do not tell whether the key was
+// there. Nodes split when they overflow but are not merged when they
+// underflow, emptied leaves are dropped. Pointers returned by Search are
+// invalidated by the next update. The tree is only a few levels high, so
+// the node walks recurse.
+template<typename T>
+class BufferTree {
+ public:
+    // fanout: most children of an inner node, buffer_size: most pending
+    // messages an inner node holds, leaf_size: most keys in a leaf
+    explicit BufferTree(size_t fanout = 16, size_t buffer_size = 1024, size_t leaf_size = 512);
+    ~BufferTree() { Destroy(root_); }
+
+    BufferTree(const BufferTree&) = delete;
+    BufferTree& operator=(const BufferTree&) = delete;
+
+    // Adds data, replacing an equal key
+    void Insert(const T& data) { Put(Message{data, false}); }
+    void Delete(const T& target) { Put(Message{target, true}); }
+    const T* Search(const T& target) const;
+    bool Contains(const T& target) const { return Search(target) != nullptr; }
+
+    // Calls fn(data) for every key in order, with the pending messages applied
+    template<typename Fn>
+    void ForEach(Fn fn) const;
+
+    // Pushes every pending message down to the leaves
+    void Flush();
+    void Clear();
+
+    // Messages waiting in the inner node buffers
+    size_t PendingCount() const { return CountPending(root_); }
+    int GetHeight() const;
+
+    // Checks ordering, pivot ranges, node sizes and that all leaves are on one level
+    bool IsTreeValid() const;
+
+ private:
+    struct Message {
+        T data;
+        bool deleted;
+    };
+
+    struct Node {
+        bool leaf;
+        // Leaf: the keys. Inner: the pivots, child i holds [keys[i - 1], keys[i]).
+        std::vector<T> keys;
+        std::vector<Node*> children;
+        // Inner only, sorted, at most one message per key
+        std::vector<Message> buffer;
+
+        explicit Node(bool is_leaf): leaf(is_leaf) {}
+    };
+
+    size_t fanout_;
+    size_t buffer_size_;
+    size_t leaf_size_;
+    Node *root_;
+
+    static bool MessageLess(const Message& lhs, const Message& rhs) { return lhs.data < rhs.data; }
+    static bool Equal(const T& lhs, const T& rhs) { return !(lhs < rhs) && !(rhs < lhs); }
+
+    void Put(Message message);
+    // Moves batches from node's buffer to its children until at most keep are left
+    void FlushBuffer(Node* node, size_t keep);
+    void FlushAll(Node* node);
+    // Applies the sorted messages [first, last) to a leaf / merges them into
+    // an inner node's buffer, where they win over older messages for the key
+    static void ApplyToLeaf(Node* leaf, Message* first, Message* last);
+    static void MergeIntoBuffer(Node* node, Message* first, Message* last);
+    // Splits an overflowing child into about half-full pieces, or drops an
+    // emptied leaf. Returns how many children now stand in its place.
+    size_t FixChild(Node* parent, size_t index);
+    void GrowRoot();
+
+    template<typename Fn>
+    void Visit(const Node* node, const Message* first, const Message* last, Fn& fn) const;
+    bool CheckNode(const Node* node, const T* lo, const T* hi, int depth, int* leaf_depth) const;
+    static size_t CountPending(const Node* node);
+    static void Destroy(Node* node);
+};
+
+template<typename T>
+BufferTree<T>::BufferTree(size_t fanout, size_t buffer_size, size_t leaf_size):
+    fanout_(fanout), buffer_size_(buffer_size), leaf_size_(leaf_size), root_(nullptr) {
+    if (fanout < 3 || buffer_size < 2 || leaf_size < 2) {
+        throw std::runtime_error("BufferTree needs fanout >= 3, buffer and leaf size >= 2");
+    }
+    root_ = new Node(true);
+}
+
+template<typename T>
+void BufferTree<T>::Put(Message message) {
+    if (root_->leaf) {
+        // Small trees are a single leaf, updated in place
+        ApplyToLeaf(root_, &message, &message + 1);
+        if (root_->keys.size() > leaf_size_) GrowRoot();
+        return;
+    }
+
+    std::vector<Message>& buffer = root_->buffer;
+    auto it = std::lower_bound(buffer.begin(), buffer.end(), message, MessageLess);
+    if (it != buffer.end() && !(message.data < it->data)) {
+        *it = std::move(message);
+    } else {
+        buffer.insert(it, std::move(message));
+    }
+
+    if (buffer.size() > buffer_size_) {
+        FlushBuffer(root_, buffer_size_ / 2);
+        if (root_->children.size() > fanout_) GrowRoot();
+    }
+}
+
+template<typename T>
+void BufferTree<T>::FlushBuffer(Node* node, size_t keep) {
+    std::vector<Message>& buffer = node->buffer;
+    while (buffer.size() > keep && !buffer.empty()) {
+        // The batch for child i is the run of messages between its pivots,
+        // pick the longest
+        size_t best = 0, best_begin = 0, best_end = 0;
+        size_t begin = 0;
+        for (size_t i = 0; i < node->children.size(); ++i) {
+            size_t end = buffer.size();
+            if (i < node->keys.size()) {
+                Message bound{node->keys[i], false};
+                end = std::lower_bound(buffer.begin() + begin, buffer.end(), bound, MessageLess) - buffer.begin();
+            }
+            if (end - begin > best_end - best_begin) {
+                best = i;
+                best_begin = begin;
+                best_end = end;
+            }
+            begin = end;
+        }
+
+        Node *child = node->children[best];
+        Message *first = buffer.data() + best_begin;
+        Message *last = buffer.data() + best_end;
+        if (child->leaf) {
+            ApplyToLeaf(child, first, last);
+        } else {
+            MergeIntoBuffer(child, first, last);
+        }
+        buffer.erase(buffer.begin() + best_begin, buffer.begin() + best_end);
+
+        if (!child->leaf && child->buffer.size() > buffer_size_) {
+            FlushBuffer(child, buffer_size_ / 2);
+        }
+        FixChild(node, best);
+    }
+}
+
+template<typename T>
+void BufferTree<T>::FlushAll(Node* node) {
+    if (node->leaf) return;
+
+    FlushBuffer(node, 0);
+    for (size_t i = 0; i < node->children.size();) {
+        FlushAll(node->children[i]);
+        i += FixChild(node, i);
+    }
+}
+
+template<typename T>
+void BufferTree<T>::Flush() {
+    FlushAll(root_);
+    while (root_->leaf ? root_->keys.size() > leaf_size_ : root_->children.size() > fanout_) {
+        GrowRoot();
+    }
+}
+
+template<typename T>
+void BufferTree<T>::ApplyToLeaf(Node* leaf, Message* first, Message* last) {
+    std::vector<T>& keys = leaf->keys;
+    if (last - first == 1) {
+        // Single message: binary search and shift, no new vector
+        auto it = std::lower_bound(keys.begin(), keys.end(), first->data);
+        bool found = (it != keys.end() && !(first->data < *it));
+        if (first->deleted) {
+            if (found) keys.erase(it);
+        } else if (found) {
+            *it = std::move(first->data);
+        } else {
+            keys.insert(it, std::move(first->data));
+        }
+        return;
+    }
+
+    std::vector<T> merged;
+    merged.reserve(keys.size() + (last - first));
+    auto key = keys.begin();
+    for (; first != last; ++first) {
+        while (key != keys.end() && *key < first->data) {
+            merged.push_back(std::move(*key++));
+        }
+        if (key != keys.end() && !(first->data < *key)) ++key;
+        if (!first->deleted) merged.push_back(std::move(first->data));
+    }
+    std::move(key, keys.end(), std::back_inserter(merged));
+    keys.swap(merged);
+}
+
+template<typename T>
+void BufferTree<T>::MergeIntoBuffer(Node* node, Message* first, Message* last) {
+    std::vector<Message>& buffer = node->buffer;
+    std::vector<Message> merged;
+    merged.reserve(buffer.size() + (last - first));
+    auto old = buffer.begin();
+    for (; first != last; ++first) {
+        while (old != buffer.end() && old->data < first->data) {
+            merged.push_back(std::move(*old++));
+        }
+        // The message from above is newer
+        if (old != buffer.end() && !(first->data < old->data)) ++old;
+        merged.push_back(std::move(*first));
+    }
+    std::move(old, buffer.end(), std::back_inserter(merged));
+    buffer.swap(merged);
+}
+
+template<typename T>
+size_t BufferTree<T>::FixChild(Node* parent, size_t index) {
+    Node *child = parent->children[index];
+    if (child->leaf && child->keys.empty() && parent->children.size() > 1) {
+        // Its range goes to the left neighbour, or the right one for the first child
+        parent->keys.erase(parent->keys.begin() + (index == 0 ? 0 : index - 1));
+        parent->children.erase(parent->children.begin() + index);
+        delete child;
+        return 0;
+    }
+
+    size_t count = (child->leaf ? child->keys.size() : child->children.size());
+    size_t limit = (child->leaf ? leaf_size_ : fanout_);
+    if (count <= limit) return 1;
+
+    size_t parts = std::max(static_cast<size_t>(2), (2 * count + limit - 1) / limit);
+    std::vector<Node*> pieces;
+    std::vector<T> separators;
+    for (size_t p = 0; p < parts; ++p) {
+        size_t begin = count * p / parts;
+        size_t end = count * (p + 1) / parts;
+        Node *piece = new Node(child->leaf);
+        if (child->leaf) {
+            if (p > 0) separators.push_back(child->keys[begin]);
+            piece->keys.assign(std::make_move_iterator(child->keys.begin() + begin),
+                               std::make_move_iterator(child->keys.begin() + end));
+        } else {
+            // Pivot begin - 1 separates this piece from the previous one
+            if (p > 0) separators.push_back(child->keys[begin - 1]);
+            piece->children.assign(child->children.begin() + begin, child->children.begin() + end);
+            piece->keys.assign(child->keys.begin() + begin, child->keys.begin() + end - 1);
+        }
+        pieces.push_back(piece);
+    }
+    if (!child->leaf) {
+        // Hand each piece the messages of its range
+        size_t begin = 0;
+        for (size_t p = 0; p < parts; ++p) {
+            size_t end = child->buffer.size();
+            if (p + 1 < parts) {
+                Message bound{separators[p], false};
+                end = std::lower_bound(child->buffer.begin() + begin, child->buffer.end(), bound, MessageLess)
+                      - child->buffer.begin();
+            }
+            pieces[p]->buffer.assign(std::make_move_iterator(child->buffer.begin() + begin),
+                                     std::make_move_iterator(child->buffer.begin() + end));
+            begin = end;
+        }
+        child->children.clear();
+    }
+    delete child;
+
+    parent->children.erase(parent->children.begin() + index);
+    parent->children.insert(parent->children.begin() + index, pieces.begin(), pieces.end());
+    parent->keys.insert(parent->keys.begin() + index, separators.begin(), separators.end());
+    return parts;
+}
+
+template<typename T>
+void BufferTree<T>::GrowRoot() {
+    Node *root = new Node(false);
+    root->children.push_back(root_);
+    root_ = root;
+    FixChild(root_, 0);
+}
+
+template<typename T>
+const T* BufferTree<T>::Search(const T& target) const {
+    const Node *node = root_;
+    while (!node->leaf) {
+        const std::vector<Message>& buffer = node->buffer;
+        Message probe{target, false};
+        auto it = std::lower_bound(buffer.begin(), buffer.end(), probe, MessageLess);
+        if (it != buffer.end() && !(target < it->data)) {
+            return it->deleted ? nullptr : &it->data;
+        }
+        node = node->children[std::upper_bound(node->keys.begin(), node->keys.end(), target) - node->keys.begin()];
+    }
+
+    auto it = std::lower_bound(node->keys.begin(), node->keys.end(), target);
+    return (it != node->keys.end() && !(target < *it)) ? &*it : nullptr;
+}
+
+template<typename T>
+template<typename Fn>
+void BufferTree<T>::ForEach(Fn fn) const {
+    Visit(root_, nullptr, nullptr, fn);
+}
+
+template<typename T>
+template<typename Fn>
+void BufferTree<T>::Visit(const Node* node, const Message* first, const Message* last, Fn& fn) const {
+    if (node->leaf) {
+        auto key = node->keys.begin();
+        for (; first != last; ++first) {
+            while (key != node->keys.end() && *key < first->data) {
+                fn(*key++);
+            }
+            if (key != node->keys.end() && !(first->data < *key)) ++key;
+            if (!first->deleted) fn(first->data);
+        }
+        for (; key != node->keys.end(); ++key) {
+            fn(*key);
+        }
+        return;
+    }
+
+    // Messages from above are newer than this node's own
+    std::vector<Message> pending;
+    pending.reserve(node->buffer.size() + (last - first));
+    auto old = node->buffer.begin();
+    for (; first != last; ++first) {
+        while (old != node->buffer.end() && old->data < first->data) {
+            pending.push_back(*old++);
+        }
+        if (old != node->buffer.end() && !(first->data < old->data)) ++old;
+        pending.push_back(*first);
+    }
+    pending.insert(pending.end(), old, node->buffer.end());
+
+    size_t begin = 0;
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        size_t end = pending.size();
+        if (i < node->keys.size()) {
+            Message bound{node->keys[i], false};
+            end = std::lower_bound(pending.begin() + begin, pending.end(), bound, MessageLess) - pending.begin();
+        }
+        Visit(node->children[i], pending.data() + begin, pending.data() + end, fn);
+        begin = end;
+    }
+}
+
+template<typename T>
+void BufferTree<T>::Clear() {
+    Destroy(root_);
+    root_ = new Node(true);
+}
+
+template<typename T>
+int BufferTree<T>::GetHeight() const {
+    int height = 1;
+    for (const Node *node = root_; !node->leaf; node = node->children[0]) {
+        ++height;
+    }
+    return height;
+}
+
+template<typename T>
+bool BufferTree<T>::IsTreeValid() const {
+    int leaf_depth = -1;
+    return CheckNode(root_, nullptr, nullptr, 0, &leaf_depth);
+}
+
+template<typename T>
+bool BufferTree<T>::CheckNode(const Node* node, const T* lo, const T* hi, int depth, int* leaf_depth) const {
+    auto in_range = [lo, hi](const T& key) { return (!lo || !(key < *lo)) && (!hi || key < *hi); };
+    for (size_t i = 0; i < node->keys.size(); ++i) {
+        if (!in_range(node->keys[i])) return false;
+        if (i > 0 && !(node->keys[i - 1] < node->keys[i])) return false;
+    }
+
+    if (node->leaf) {
+        if (*leaf_depth < 0) *leaf_depth = depth;
+        return *leaf_depth == depth && node->keys.size() <= leaf_size_ && node->buffer.empty();
+    }
+
+    if (node->children.size() != node->keys.size() + 1 || node->children.size() > fanout_ ||
+        node->buffer.size() > buffer_size_) {
+        return false;
+    }
+    for (size_t i = 0; i < node->buffer.size(); ++i) {
+        if (!in_range(node->buffer[i].data)) return false;
+        if (i > 0 && !(node->buffer[i - 1].data < node->buffer[i].data)) return false;
+    }
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        const T *child_lo = (i == 0 ? lo : &node->keys[i - 1]);
+        const T *child_hi = (i == node->keys.size() ? hi : &node->keys[i]);
+        if (!CheckNode(node->children[i], child_lo, child_hi, depth + 1, leaf_depth)) return false;
+    }
+    return true;
+}
+
+template<typename T>
+size_t BufferTree<T>::CountPending(const Node* node) {
+    if (node->leaf) return 0;
+
+    size_t count = node->buffer.size();
+    for (const Node *child : node->children) {
+        count += CountPending(child);
+    }
+    return count;
+}
+
+template<typename T>
+void BufferTree<T>::Destroy(Node* node) {
+    if (!node) return;
+
+    for (Node *child : node->children) {
+        Destroy(child);
+    }
+    delete node;
+}
+
+}  // namespace buffer_tree
+
+#endif
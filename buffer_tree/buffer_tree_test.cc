@@ -0,0 +1,202 @@
+#include <vector>
+#include <set>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "binary_tree.hpp"
+#include "buffer_tree.hpp"
+
+class Timer {
+private:
+    std::chrono::time_point<std::chrono::steady_clock> start_;
+    int64_t &duration_us_;
+
+public:
+    explicit Timer(int64_t &dur) : duration_us_(dur) {
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    ~Timer() {
+        auto end = std::chrono::steady_clock::now();
+        duration_us_ = std::chrono::duration_cast<std::chrono::microseconds>(end - start_).count();
+    }
+};
+
+class BufferTreeTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<int> keys(0, kNPerfData * 4);
+        perf_data.resize(kNPerfData);
+        for (auto& key : perf_data) {
+            key = keys(rng);
+        }
+    }
+
+    static const int kNPerfData = 1000000;
+    std::vector<int> perf_data;
+};
+
+// Key with a payload that equal keys overwrite
+struct Entry {
+    int key;
+    int value;
+
+    bool operator<(const Entry& rhs) const { return key < rhs.key; }
+};
+
+template<typename Tree>
+std::vector<int> Keys(const Tree& tree) {
+    std::vector<int> keys;
+    tree.ForEach([&keys](int key) { keys.push_back(key); });
+    return keys;
+}
+
+TEST_F(BufferTreeTest, Operations) {
+    EXPECT_THROW(buffer_tree::BufferTree<int>(2, 8, 4), std::runtime_error);
+
+    // Small nodes so a few thousand keys give a tree of several levels
+    buffer_tree::BufferTree<int> tree(4, 8, 4);
+    std::set<int> model;
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> keys(0, 2000);
+    for (int i = 0; i < 20000; ++i) {
+        int key = keys(rng);
+        if (rng() % 3 == 0) {
+            tree.Delete(key);
+            model.erase(key);
+        } else {
+            tree.Insert(key);
+            model.insert(key);
+        }
+
+        int probe = keys(rng);
+        ASSERT_EQ(tree.Contains(probe), model.count(probe) == 1) << probe;
+        if (i % 1000 == 0) {
+            ASSERT_TRUE(tree.IsTreeValid());
+            ASSERT_EQ(Keys(tree), std::vector<int>(model.begin(), model.end()));
+        }
+    }
+    EXPECT_GT(tree.GetHeight(), 3);
+    EXPECT_GT(tree.PendingCount(), 0u);
+
+    // Flushing moves everything to the leaves without changing the contents
+    tree.Flush();
+    EXPECT_EQ(tree.PendingCount(), 0u);
+    EXPECT_TRUE(tree.IsTreeValid());
+    EXPECT_EQ(Keys(tree), std::vector<int>(model.begin(), model.end()));
+
+    // Deleting everything leaves an empty but valid tree
+    for (int key = 0; key <= 2000; ++key) {
+        tree.Delete(key);
+    }
+    EXPECT_TRUE(Keys(tree).empty());
+    tree.Flush();
+    EXPECT_TRUE(tree.IsTreeValid());
+    EXPECT_FALSE(tree.Contains(keys(rng)));
+
+    tree.Clear();
+    EXPECT_EQ(tree.GetHeight(), 1);
+    tree.Insert(7);
+    EXPECT_TRUE(tree.Contains(7));
+}
+
+TEST_F(BufferTreeTest, NewestMessageWins) {
+    buffer_tree::BufferTree<Entry> tree(4, 8, 4);
+    for (int round = 0; round < 5; ++round) {
+        for (int key = 0; key < 500; ++key) {
+            tree.Insert(Entry{key, round});
+        }
+        for (int key = 0; key < 500; key += 7) {
+            tree.Delete(Entry{key, 0});
+        }
+    }
+
+    for (int key = 0; key < 500; ++key) {
+        const Entry *entry = tree.Search(Entry{key, 0});
+        if (key % 7 == 0) {
+            ASSERT_EQ(entry, nullptr);
+        } else {
+            ASSERT_NE(entry, nullptr);
+            ASSERT_EQ(entry->value, 4);
+        }
+    }
+    tree.Flush();
+    ASSERT_TRUE(tree.IsTreeValid());
+    EXPECT_EQ(tree.Search(Entry{1, 0})->value, 4);
+}
+
+TEST_F(BufferTreeTest, IngestVsBinaryTrees) {
+    buffer_tree::BufferTree<int> buffered;
+    binary_tree::RBTree<int> rbt;
+    binary_tree::AVLTree<int> avl;
+
+    int64_t buffered_insert_time, rbt_insert_time, avl_insert_time;
+    {
+        Timer _(buffered_insert_time);
+        for (int key : perf_data) buffered.Insert(key);
+    }
+    {
+        Timer _(rbt_insert_time);
+        for (int key : perf_data) rbt.Insert(key);
+    }
+    {
+        Timer _(avl_insert_time);
+        for (int key : perf_data) avl.Insert(key);
+    }
+    ASSERT_TRUE(buffered.IsTreeValid());
+
+    // Reads pay for checking the buffers on the way down
+    int64_t buffered_search_time, rbt_search_time, avl_search_time;
+    int buffered_found = 0, rbt_found = 0, avl_found = 0;
+    {
+        Timer _(buffered_search_time);
+        for (int i = 0; i < kNPerfData; i += 4) buffered_found += buffered.Contains(perf_data[i] + 1);
+    }
+    {
+        Timer _(rbt_search_time);
+        for (int i = 0; i < kNPerfData; i += 4) rbt_found += (rbt.Search(perf_data[i] + 1) != nullptr);
+    }
+    {
+        Timer _(avl_search_time);
+        for (int i = 0; i < kNPerfData; i += 4) avl_found += (avl.Search(perf_data[i] + 1) != nullptr);
+    }
+    EXPECT_EQ(buffered_found, rbt_found);
+    EXPECT_EQ(buffered_found, avl_found);
+
+    // Ingest with a query every 20 updates, a third of the updates deletes
+    buffer_tree::BufferTree<int> mixed_buffered;
+    binary_tree::RBTree<int> mixed_rbt;
+    int64_t mixed_buffered_time, mixed_rbt_time;
+    int mixed_buffered_found = 0, mixed_rbt_found = 0;
+    {
+        Timer _(mixed_buffered_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            if (i % 3 == 2) mixed_buffered.Delete(perf_data[i - 1]);
+            else mixed_buffered.Insert(perf_data[i]);
+            if (i % 20 == 0) mixed_buffered_found += mixed_buffered.Contains(perf_data[i / 2]);
+        }
+    }
+    {
+        Timer _(mixed_rbt_time);
+        for (int i = 0; i < kNPerfData; ++i) {
+            if (i % 3 == 2) mixed_rbt.Delete(perf_data[i - 1]);
+            else mixed_rbt.Insert(perf_data[i]);
+            if (i % 20 == 0) mixed_rbt_found += (mixed_rbt.Search(perf_data[i / 2]) != nullptr);
+        }
+    }
+    EXPECT_EQ(mixed_buffered_found, mixed_rbt_found);
+
+    std::cout << "Random insertion of " << kNPerfData << " keys, buffer tree: " << buffered_insert_time
+              << " us, RBT: " << rbt_insert_time << " us, AVL: " << avl_insert_time << " us" << std::endl;
+    std::cout << "Search of " << kNPerfData / 4 << " keys, buffer tree: " << buffered_search_time
+              << " us, RBT: " << rbt_search_time << " us, AVL: " << avl_search_time << " us" << std::endl;
+    std::cout << "Mixed ingest, buffer tree: " << mixed_buffered_time << " us, RBT: " << mixed_rbt_time
+              << " us; buffer tree height " << buffered.GetHeight() << ", " << buffered.PendingCount()
+              << " pending messages" << std::endl;
+}
@@ -0,0 +1,126 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+
+namespace replay {
+
+// ------------ Latency Histogram -------------
+
+// Log-linear histogram in the style of HdrHistogram. Values below 256 get a
+// bucket each, above that every power of two is cut into 128 buckets, so a
+// reported value is within 1/128 of the recorded one over the whole 64-bit
+// range. Recording is a few shifts and an increment, no allocation.
+class LatencyHistogram {
+ public:
+    static const int kSubBucketBits = 8;
+    static const size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    static const size_t kHalfBuckets = kSubBuckets / 2;
+    static const size_t kBuckets = kSubBuckets + (64 - kSubBucketBits) * kHalfBuckets;
+
+    LatencyHistogram(): counts_(kBuckets, 0), count_(0), min_(UINT64_MAX), max_(0), sum_(0) {}
+
+    void Record(uint64_t value) { Record(value, 1); }
+    void Record(uint64_t value, uint64_t times);
+    void Merge(const LatencyHistogram& other);
+    void Clear();
+
+    uint64_t Count() const { return count_; }
+    uint64_t Min() const { return count_ ? min_ : 0; }
+    uint64_t Max() const { return max_; }
+    double Mean() const { return count_ ? sum_ / static_cast<double>(count_) : 0.0; }
+
+    // Smallest value that at least percentile percent of the records are
+    // not above, up to the bucket precision. 100 gives the exact maximum.
+    uint64_t Percentile(double percentile) const;
+
+    static size_t BucketIndex(uint64_t value);
+    // Highest value that lands in bucket index
+    static uint64_t BucketHigh(size_t index);
+
+ private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_;
+    uint64_t min_;
+    uint64_t max_;
+    double sum_;
+
+    static int HighestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        int bit = 0;
+        while (value >>= 1) ++bit;
+        return bit;
+#endif
+    }
+};
+
+inline size_t LatencyHistogram::BucketIndex(uint64_t value) {
+    if (value < kSubBuckets) return static_cast<size_t>(value);
+
+    // Keep the top kSubBucketBits bits, the leading one is implied by the shift
+    int shift = HighestBit(value) - (kSubBucketBits - 1);
+    size_t top = static_cast<size_t>(value >> shift);
+    return kSubBuckets + static_cast<size_t>(shift - 1) * kHalfBuckets + (top - kHalfBuckets);
+}
+
+inline uint64_t LatencyHistogram::BucketHigh(size_t index) {
+    if (index < kSubBuckets) return index;
+
+    size_t offset = index - kSubBuckets;
+    int shift = static_cast<int>(offset / kHalfBuckets) + 1;
+    uint64_t top = kHalfBuckets + offset % kHalfBuckets;
+    return ((top + 1) << shift) - 1;
+}
+
+inline void LatencyHistogram::Record(uint64_t value, uint64_t times) {
+    if (times == 0) return;
+
+    counts_[BucketIndex(value)] += times;
+    count_ += times;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += static_cast<double>(value) * static_cast<double>(times);
+}
+
+inline void LatencyHistogram::Merge(const LatencyHistogram& other) {
+    if (other.count_ == 0) return;
+
+    for (size_t i = 0; i < kBuckets; ++i) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+}
+
+inline void LatencyHistogram::Clear() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = 0;
+    min_ = UINT64_MAX;
+    max_ = 0;
+    sum_ = 0;
+}
+
+inline uint64_t LatencyHistogram::Percentile(double percentile) const {
+    if (count_ == 0) return 0;
+
+    double wanted = std::ceil(std::min(std::max(percentile, 0.0), 100.0) / 100.0 * static_cast<double>(count_));
+    uint64_t rank = std::max(static_cast<uint64_t>(wanted), uint64_t(1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        seen += counts_[i];
+        if (seen >= rank) return std::min(BucketHigh(i), max_);
+    }
+    return max_;
+}
+
+}  // namespace replay
+
+#endif
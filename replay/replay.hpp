@@ -0,0 +1,229 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "latency_histogram.hpp"
+
+namespace replay {
+
+// ------------ Trace -------------
+
+enum class OpType {
+    Insert = 0,
+    Search,
+    Delete,
+    Range,      // Visits the keys in [key, hi)
+};
+
+static const int kOpTypes = 4;
+
+inline const char* OpName(OpType type) {
+    switch (type) {
+        case OpType::Insert: return "insert";
+        case OpType::Search: return "search";
+        case OpType::Delete: return "delete";
+        case OpType::Range: return "range";
+    }
+    return "unknown";
+}
+
+struct TraceOp {
+    uint64_t time_us;   // Offset from the start of the recording
+    OpType type;
+    int64_t key;
+    int64_t hi;         // Range end, unused by the other ops
+};
+
+// One op per line, "<time_us> <op> <key> [<hi>]", op being insert, search,
+// delete or range. Blank lines and lines starting with '#' are skipped.
+// Throws std::runtime_error naming the line of the first bad op.
+inline std::vector<TraceOp> ReadTrace(std::istream& is) {
+    std::vector<TraceOp> trace;
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(is, line)) {
+        ++line_number;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+
+        std::istringstream fields(line);
+        std::string name;
+        TraceOp op = TraceOp();
+        if (!(fields >> op.time_us >> name >> op.key)) {
+            throw std::runtime_error("Trace line " + std::to_string(line_number) + ": expected <time_us> <op> <key>");
+        }
+        if (name == "insert") op.type = OpType::Insert;
+        else if (name == "search") op.type = OpType::Search;
+        else if (name == "delete") op.type = OpType::Delete;
+        else if (name == "range") op.type = OpType::Range;
+        else throw std::runtime_error("Trace line " + std::to_string(line_number) + ": unknown op " + name);
+
+        if (op.type == OpType::Range && !(fields >> op.hi)) {
+            throw std::runtime_error("Trace line " + std::to_string(line_number) + ": range needs <key> <hi>");
+        }
+        if (!trace.empty() && op.time_us < trace.back().time_us) {
+            throw std::runtime_error("Trace line " + std::to_string(line_number) + ": time goes backwards");
+        }
+        trace.push_back(op);
+    }
+    return trace;
+}
+
+inline void WriteTrace(std::ostream& os, const std::vector<TraceOp>& trace) {
+    for (const auto& op : trace) {
+        os << op.time_us << ' ' << OpName(op.type) << ' ' << op.key;
+        if (op.type == OpType::Range) os << ' ' << op.hi;
+        os << '\n';
+    }
+}
+
+struct GenerateOptions {
+    size_t ops;
+    int64_t key_space;      // Keys are drawn from [0, key_space)
+    int mix[kOpTypes];      // Relative weight of each op type
+    int64_t range_width;
+    double rate;            // Mean ops per second, arrivals are Poisson
+    uint64_t seed;
+
+    GenerateOptions(): ops(100000), key_space(1000000), mix{40, 40, 15, 5},
+                       range_width(100), rate(100000), seed(1234) {}
+};
+
+// Synthetic trace for trying the driver without a recording. The same
+// options always give the same trace.
+inline std::vector<TraceOp> GenerateTrace(const GenerateOptions& options) {
+    std::mt19937_64 rng(options.seed);
+    std::uniform_int_distribution<int64_t> keys(0, options.key_space - 1);
+    std::discrete_distribution<int> types(options.mix, options.mix + kOpTypes);
+    std::exponential_distribution<double> gaps(options.rate / 1e6);
+
+    std::vector<TraceOp> trace;
+    trace.reserve(options.ops);
+    double time_us = 0;
+    for (size_t i = 0; i < options.ops; ++i) {
+        TraceOp op = TraceOp();
+        op.time_us = static_cast<uint64_t>(time_us);
+        op.type = static_cast<OpType>(types(rng));
+        op.key = keys(rng);
+        op.hi = (op.type == OpType::Range ? op.key + options.range_width : 0);
+        trace.push_back(op);
+        time_us += gaps(rng);
+    }
+    return trace;
+}
+
+// ------------ Replay -------------
+
+struct ReplayOptions {
+    // Issue every op at its recorded time, scaled by speed. Latency is then
+    // measured from the scheduled time, so a slow op also charges the ops
+    // queued behind it, like a real client would see. Unpaced replay runs
+    // back to back and measures service time only.
+    bool paced;
+    double speed;
+
+    ReplayOptions(): paced(false), speed(1.0) {}
+};
+
+struct ReplayResult {
+    LatencyHistogram latency[kOpTypes];     // Nanoseconds per op
+    uint64_t hits[kOpTypes];                // Keys inserted, found, deleted, visited in ranges
+    double seconds;
+
+    ReplayResult(): hits(), seconds(0) {}
+
+    uint64_t Count() const {
+        uint64_t count = 0;
+        for (int i = 0; i < kOpTypes; ++i) count += latency[i].Count();
+        return count;
+    }
+    LatencyHistogram Total() const {
+        LatencyHistogram total;
+        for (int i = 0; i < kOpTypes; ++i) total.Merge(latency[i]);
+        return total;
+    }
+    double Throughput() const { return seconds > 0 ? static_cast<double>(Count()) / seconds : 0.0; }
+};
+
+// Runs op against any of the trees, returns its hits
+template<typename Tree>
+uint64_t ApplyOp(Tree& tree, const TraceOp& op) {
+    switch (op.type) {
+        case OpType::Insert: return tree.Insert(op.key) ? 1 : 0;
+        case OpType::Search: return tree.Search(op.key) ? 1 : 0;
+        case OpType::Delete: return tree.Delete(op.key) ? 1 : 0;
+        case OpType::Range: {
+            uint64_t visited = 0;
+            tree.ForEachInRange(op.key, op.hi, [&visited](const int64_t&) { ++visited; });
+            return visited;
+        }
+    }
+    return 0;
+}
+
+template<typename Tree>
+ReplayResult Replay(Tree& tree, const std::vector<TraceOp>& trace, const ReplayOptions& options = ReplayOptions()) {
+    typedef std::chrono::steady_clock Clock;
+    ReplayResult result;
+    if (trace.empty()) return result;
+
+    const uint64_t first_us = trace.front().time_us;
+    const Clock::time_point start = Clock::now();
+    for (const auto& op : trace) {
+        Clock::time_point begin = Clock::now();
+        if (options.paced) {
+            auto offset = std::chrono::nanoseconds(static_cast<int64_t>((op.time_us - first_us) * 1000.0 / options.speed));
+            Clock::time_point scheduled = start + offset;
+            // Sleep through long gaps, wakeups can be a millisecond late, so
+            // the last stretch is spun for accuracy
+            if (scheduled - begin > std::chrono::milliseconds(2)) {
+                std::this_thread::sleep_for(scheduled - begin - std::chrono::milliseconds(1));
+            }
+            while (Clock::now() < scheduled) {}
+            begin = scheduled;
+        }
+
+        uint64_t hits = ApplyOp(tree, op);
+        Clock::time_point end = Clock::now();
+
+        int type = static_cast<int>(op.type);
+        result.hits[type] += hits;
+        result.latency[type].Record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()));
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return result;
+}
+
+// High-water mark of the resident set of this process, 0 where unknown
+inline uint64_t PeakRssBytes() {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+}  // namespace replay
+
+#endif
@@ -0,0 +1,159 @@
+#include <vector>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "binary_tree.hpp"
+#include "replay.hpp"
+
+class ReplayTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        replay::GenerateOptions options;
+        options.ops = 20000;
+        options.key_space = 5000;
+        trace = replay::GenerateTrace(options);
+    }
+
+    std::vector<replay::TraceOp> trace;
+};
+
+TEST_F(ReplayTest, HistogramPercentiles) {
+    replay::LatencyHistogram histogram;
+    EXPECT_EQ(histogram.Percentile(50), 0u);
+    EXPECT_EQ(histogram.Min(), 0u);
+
+    for (uint64_t v = 1; v <= 100000; ++v) {
+        histogram.Record(v);
+    }
+    EXPECT_EQ(histogram.Count(), 100000u);
+    EXPECT_EQ(histogram.Min(), 1u);
+    EXPECT_EQ(histogram.Max(), 100000u);
+    EXPECT_DOUBLE_EQ(histogram.Mean(), 50000.5);
+    EXPECT_EQ(histogram.Percentile(100), 100000u);
+    // Within the 1/128 bucket precision, never below the exact answer
+    for (double p : {50.0, 90.0, 99.0, 99.9}) {
+        uint64_t exact = static_cast<uint64_t>(p * 1000);
+        EXPECT_GE(histogram.Percentile(p), exact);
+        EXPECT_LE(histogram.Percentile(p), exact + exact / 128);
+    }
+
+    // Small values are exact, one bucket each
+    replay::LatencyHistogram small;
+    small.Record(7, 99);
+    small.Record(200);
+    EXPECT_EQ(small.Percentile(99), 7u);
+    EXPECT_EQ(small.Percentile(99.9), 200u);
+
+    histogram.Merge(small);
+    EXPECT_EQ(histogram.Count(), 100100u);
+    EXPECT_EQ(histogram.Min(), 1u);
+    histogram.Clear();
+    EXPECT_EQ(histogram.Count(), 0u);
+
+    // Buckets tile the whole range without gaps
+    for (size_t i = 1; i < replay::LatencyHistogram::kBuckets; ++i) {
+        uint64_t low = replay::LatencyHistogram::BucketHigh(i - 1) + 1;
+        ASSERT_EQ(replay::LatencyHistogram::BucketIndex(low), i);
+        ASSERT_EQ(replay::LatencyHistogram::BucketIndex(replay::LatencyHistogram::BucketHigh(i)), i);
+    }
+    EXPECT_EQ(replay::LatencyHistogram::BucketHigh(replay::LatencyHistogram::kBuckets - 1), UINT64_MAX);
+}
+
+TEST_F(ReplayTest, TraceFormat) {
+    std::istringstream is("# recorded trace\n"
+                          "0 insert 5\n"
+                          "\n"
+                          "10 search 5\n"
+                          "12 range 0 10\n"
+                          "40 delete -3\n");
+    auto ops = replay::ReadTrace(is);
+    ASSERT_EQ(ops.size(), 4u);
+    EXPECT_EQ(ops[0].type, replay::OpType::Insert);
+    EXPECT_EQ(ops[2].type, replay::OpType::Range);
+    EXPECT_EQ(ops[2].hi, 10);
+    EXPECT_EQ(ops[3].key, -3);
+    EXPECT_EQ(ops[3].time_us, 40u);
+
+    // Written traces read back the same
+    std::stringstream round_trip;
+    replay::WriteTrace(round_trip, trace);
+    auto read = replay::ReadTrace(round_trip);
+    ASSERT_EQ(read.size(), trace.size());
+    for (size_t i = 0; i < trace.size(); ++i) {
+        ASSERT_EQ(read[i].time_us, trace[i].time_us);
+        ASSERT_EQ(read[i].type, trace[i].type);
+        ASSERT_EQ(read[i].key, trace[i].key);
+        ASSERT_EQ(read[i].hi, trace[i].hi);
+    }
+
+    for (const char* bad : {"0 insert\n", "0 upsert 1\n", "0 range 1\n", "5 insert 1\n3 insert 2\n"}) {
+        std::istringstream bad_is(bad);
+        EXPECT_THROW(replay::ReadTrace(bad_is), std::runtime_error);
+    }
+    std::istringstream second_line("0 insert 1\nx search 1\n");
+    try {
+        replay::ReadTrace(second_line);
+        FAIL();
+    } catch (const std::runtime_error& e) {
+        EXPECT_NE(std::string(e.what()).find("line 2"), std::string::npos);
+    }
+}
+
+TEST_F(ReplayTest, Replay) {
+    // Same seed, same trace
+    replay::GenerateOptions options;
+    options.ops = 20000;
+    options.key_space = 5000;
+    auto again = replay::GenerateTrace(options);
+    ASSERT_EQ(again.size(), trace.size());
+    for (size_t i = 0; i < trace.size(); ++i) {
+        ASSERT_EQ(again[i].key, trace[i].key);
+        ASSERT_EQ(again[i].time_us, trace[i].time_us);
+    }
+
+    // Hits against a std::set model
+    uint64_t expected[replay::kOpTypes] = {};
+    std::set<int64_t> model;
+    for (const auto& op : trace) {
+        switch (op.type) {
+            case replay::OpType::Insert: expected[0] += model.insert(op.key).second; break;
+            case replay::OpType::Search: expected[1] += model.count(op.key); break;
+            case replay::OpType::Delete: expected[2] += model.erase(op.key); break;
+            case replay::OpType::Range:
+                expected[3] += std::distance(model.lower_bound(op.key), model.lower_bound(op.hi));
+                break;
+        }
+    }
+
+    binary_tree::RBTree<int64_t> rbt;
+    binary_tree::AATree<int64_t> aa;
+    auto rbt_result = replay::Replay(rbt, trace);
+    auto aa_result = replay::Replay(aa, trace);
+    EXPECT_EQ(rbt_result.Count(), trace.size());
+    EXPECT_EQ(rbt_result.Total().Count(), trace.size());
+    for (int i = 0; i < replay::kOpTypes; ++i) {
+        EXPECT_EQ(rbt_result.hits[i], expected[i]);
+        EXPECT_EQ(aa_result.hits[i], expected[i]);
+    }
+    EXPECT_GT(rbt_result.Throughput(), 0);
+
+    // Paced at 100x: the trace spans about 0.2 s recorded, so about 2 ms replayed
+    std::vector<replay::TraceOp> head(trace.begin(), trace.begin() + 200);
+    binary_tree::RBTree<int64_t> paced_tree;
+    replay::ReplayOptions paced;
+    paced.paced = true;
+    paced.speed = 100;
+    auto paced_result = replay::Replay(paced_tree, head, paced);
+    EXPECT_EQ(paced_result.Count(), head.size());
+    EXPECT_GE(paced_result.seconds, (head.back().time_us - head.front().time_us) / 1e6 / paced.speed);
+
+    std::cout << "RBT replay " << trace.size() << " ops, p50: " << rbt_result.Total().Percentile(50)
+              << " ns, p99: " << rbt_result.Total().Percentile(99) << " ns, p999: "
+              << rbt_result.Total().Percentile(99.9) << " ns, " << static_cast<uint64_t>(rbt_result.Throughput())
+              << " ops/s; AA tree p99: " << aa_result.Total().Percentile(99) << " ns, peak RSS: "
+              << replay::PeakRssBytes() / 1024 << " KB" << std::endl;
+}
@@ -0,0 +1,158 @@
+// Replays an operation trace against the trees and reports latency
+// percentiles, throughput and peak RSS.
+//
+//   tree_replay [--tree rb,avl,...] [--paced] [--speed X] <trace | ->
+//   tree_replay --generate N [--seed S] [--keys K] [--mix I,S,D,R] [--rate OPS] > trace.txt
+//
+// Trees: bst, rb, avl, aa, treap, scapegoat, splay. Each one replays the
+// trace from empty, one after the other. Peak RSS is the process high-water
+// mark, so compare memory with one tree per run.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "binary_tree.hpp"
+#include "replay.hpp"
+
+namespace {
+
+int Usage() {
+    std::cerr << "usage: tree_replay [--tree rb,avl,...] [--paced] [--speed X] <trace | ->\n"
+              << "       tree_replay --generate N [--seed S] [--keys K] [--mix I,S,D,R] [--rate OPS]\n"
+              << "trees: bst, rb, avl, aa, treap, scapegoat, splay" << std::endl;
+    return 2;
+}
+
+std::vector<std::string> SplitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::istringstream is(list);
+    std::string item;
+    while (std::getline(is, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+void PrintRow(const char* name, const replay::LatencyHistogram& latency, uint64_t hits) {
+    std::cout << "  " << std::left << std::setw(8) << name << std::right
+              << std::setw(10) << latency.Count() << std::setw(12) << hits
+              << std::setw(10) << latency.Percentile(50) << std::setw(10) << latency.Percentile(99)
+              << std::setw(10) << latency.Percentile(99.9) << std::setw(12) << latency.Max() << '\n';
+}
+
+template<typename Tree>
+void Run(const std::string& name, const std::vector<replay::TraceOp>& trace, const replay::ReplayOptions& options) {
+    replay::ReplayResult result;
+    {
+        Tree tree;
+        result = replay::Replay(tree, trace, options);
+    }
+
+    std::cout << "tree " << name << ": " << result.Count() << " ops in " << std::fixed << std::setprecision(3)
+              << result.seconds << " s, " << std::setprecision(0) << result.Throughput() << " ops/s, peak RSS "
+              << std::setprecision(1) << replay::PeakRssBytes() / 1048576.0 << " MB\n";
+    std::cout << "  " << std::left << std::setw(8) << "op" << std::right << std::setw(10) << "count"
+              << std::setw(12) << "hits" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns"
+              << std::setw(10) << "p999 ns" << std::setw(12) << "max ns" << '\n';
+    uint64_t total_hits = 0;
+    for (int i = 0; i < replay::kOpTypes; ++i) {
+        if (result.latency[i].Count() == 0) continue;
+        PrintRow(replay::OpName(static_cast<replay::OpType>(i)), result.latency[i], result.hits[i]);
+        total_hits += result.hits[i];
+    }
+    PrintRow("all", result.Total(), total_hits);
+    std::cout << std::flush;
+}
+
+bool RunTree(const std::string& name, const std::vector<replay::TraceOp>& trace, const replay::ReplayOptions& options) {
+    using namespace binary_tree;
+    if (name == "bst") Run<BinarySearchTree<int64_t>>(name, trace, options);
+    else if (name == "rb") Run<RBTree<int64_t>>(name, trace, options);
+    else if (name == "avl") Run<AVLTree<int64_t>>(name, trace, options);
+    else if (name == "aa") Run<AATree<int64_t>>(name, trace, options);
+    else if (name == "treap") Run<Treap<int64_t>>(name, trace, options);
+    else if (name == "scapegoat") Run<ScapegoatTree<int64_t>>(name, trace, options);
+    else if (name == "splay") Run<SplayTree<int64_t>>(name, trace, options);
+    else return false;
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::string> trees(1, "rb");
+    replay::ReplayOptions options;
+    replay::GenerateOptions generate;
+    bool generating = false;
+    std::string path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (arg == "--paced") {
+            options.paced = true;
+        } else if (arg == "--speed" && has_value) {
+            options.speed = std::atof(argv[++i]);
+            if (options.speed <= 0) return Usage();
+        } else if (arg == "--tree" && has_value) {
+            trees = SplitList(argv[++i]);
+        } else if (arg == "--generate" && has_value) {
+            generating = true;
+            generate.ops = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--seed" && has_value) {
+            generate.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--keys" && has_value) {
+            generate.key_space = std::atoll(argv[++i]);
+            if (generate.key_space <= 0) return Usage();
+        } else if (arg == "--rate" && has_value) {
+            generate.rate = std::atof(argv[++i]);
+            if (generate.rate <= 0) return Usage();
+        } else if (arg == "--mix" && has_value) {
+            std::vector<std::string> weights = SplitList(argv[++i]);
+            if (weights.size() != static_cast<size_t>(replay::kOpTypes)) return Usage();
+            for (int w = 0; w < replay::kOpTypes; ++w) {
+                generate.mix[w] = std::atoi(weights[w].c_str());
+            }
+        } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+            return Usage();
+        } else {
+            path = arg;
+        }
+    }
+
+    if (generating) {
+        replay::WriteTrace(std::cout, replay::GenerateTrace(generate));
+        return 0;
+    }
+    if (path.empty()) return Usage();
+
+    std::vector<replay::TraceOp> trace;
+    try {
+        if (path == "-") {
+            trace = replay::ReadTrace(std::cin);
+        } else {
+            std::ifstream file(path);
+            if (!file) {
+                std::cerr << "cannot open " << path << std::endl;
+                return 1;
+            }
+            trace = replay::ReadTrace(file);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << path << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    for (const auto& name : trees) {
+        if (!RunTree(name, trace, options)) {
+            std::cerr << "unknown tree " << name << std::endl;
+            return Usage();
+        }
+    }
+    return 0;
+}